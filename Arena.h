@@ -0,0 +1,103 @@
+/**
+@file Arena.h
+@brief This file defines the arena allocator: storage of many small arrays carved out of large
+blocks and released in bulk, for the codes of the index and the buffers of a query.
+*/
+
+#ifndef ARENA_H_INCLUDED
+#define ARENA_H_INCLUDED
+
+#include <vector>
+
+using std::vector;
+
+/**
+Only for types that need no constructor nor destructor: the memory is handed out as is, and
+is given back all at once by reset() or by the destructor.
+@brief bump allocator over large blocks
+*/
+class Arena
+{
+public:
+
+    /// @param block_l size of the blocks in bytes. larger requests get a block of their own
+    Arena(long block_l = 1 << 20) : block(block_l), cur(0), off(0), used_bytes(0) {}
+
+    ~Arena()
+    {
+        release();
+    }
+
+    /// storage for n elements of T, aligned on 16 bytes
+    template<class T>
+    T* alloc(long n)
+    {
+        long bytes = (n * (long)sizeof(T) + 15) & ~15L;
+        // the blocks kept by reset() are reused in order before new ones are taken
+        while(cur < blocks.size() && off + bytes > sizes[cur])
+        {
+            cur++;
+            off = 0;
+        }
+        if(cur == blocks.size())
+        {
+            long sz = bytes > block ? bytes : block;
+            blocks.push_back(new char[sz]);
+            sizes.push_back(sz);
+            off = 0;
+        }
+        char* p = blocks[cur] + off;
+        off += bytes;
+        used_bytes += bytes;
+        return (T*)p;
+    }
+
+    /// everything allocated is released at once, the blocks are kept for the next allocations
+    void reset()
+    {
+        cur = 0;
+        off = 0;
+        used_bytes = 0;
+    }
+
+    /// everything allocated is released and the blocks are freed
+    void release()
+    {
+        for(unsigned int i = 0; i < blocks.size(); i++)
+            delete[] blocks[i];
+        blocks.clear();
+        sizes.clear();
+        reset();
+    }
+
+    /// bytes handed out since the last reset
+    long used() const
+    {
+        return used_bytes;
+    }
+
+    /// bytes of the blocks held
+    long reserved() const
+    {
+        long tot = 0;
+        for(unsigned int i = 0; i < sizes.size(); i++)
+            tot += sizes[i];
+        return tot;
+    }
+
+private:
+
+    /// not copyable: the copies would free the same blocks
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+
+    long block;
+    vector<char*> blocks;
+    vector<long> sizes;
+    /// block being carved, and the offset in it
+    unsigned int cur;
+    long off;
+    long used_bytes;
+};
+
+#endif // ARENA_H_INCLUDED
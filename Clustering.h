@@ -33,6 +33,8 @@ struct nn_par
     int *assignment;   // assignment of each points to center id
     float* cost;
     int iterator;
+    /// assign by the largest inner product, the cost is 1 - <x, c>
+    bool spherical;
 };
 
 struct nn_par2
@@ -72,6 +74,26 @@ struct kmeans_par
     // output
     /// pointer to centers to be generated. size (k*d) must be pre-allocated
     float   *centers;
+
+    /// checkpoint file. when not empty, the state is saved there after each iteration and
+    /// an interrupted run on the same data resumes from it. the file is removed once done.
+    string  ckpt;
+
+    /// spherical k-means: the points are assigned by inner product and the centers are normalized
+    bool    spherical;
+};
+
+/// state of a k-means run, as saved in kmeans_par::ckpt
+struct kmeans_state
+{
+    /// attempt running
+    int     attempt;
+    /// next iteration to run in that attempt
+    int     iteration;
+    /// min cost of the finished attempts
+    float   best_cost;
+    /// cost of the last iteration of the running attempt
+    float   old_cost;
 };
 
 /// cluster data utility with k-means supported
@@ -89,26 +111,34 @@ public:
     {
         printf("K-MEANS -- data: %u x %u  k: %u  iter: %u  attempts: %u.\n", para->n, para->d, para->k, para->iter, para->attempts);
 
-        float cost = 1e100;
         float* centers_tmp = new float[para->k * para->d];
-        for(int i = 0; i < para->attempts; i++)
+        kmeans_state state = {0, 0, 1e30f, 0.0f};
+        if(!para->ckpt.empty() && load_ckpt(para, state, centers_tmp))
+            printf("Resume k-means from %s: attempt %d, iteration %d.\n", para->ckpt.c_str(), state.attempt, state.iteration);
+
+        for(; state.attempt < para->attempts; state.attempt++)
         {
             float cost_tmp = 0.0f;
             cout << "start kmeans once" << endl;
-            kmeans_once(para->data, centers_tmp, para->n, para->d, para->k, para->iter, cost_tmp, para->nt);
-            printf("Attempts: %u, cost: %e\n", i, cost_tmp);
+            kmeans_once(para->data, centers_tmp, para->n, para->d, para->k, para->iter, cost_tmp, para->nt, para, state);
+            printf("Attempts: %u, cost: %e\n", state.attempt, cost_tmp);
 
-            if( cost_tmp < cost )
+            if( cost_tmp < state.best_cost )
             {
                 printf("*********************************\n");
                 printf("copy min cost to para->centers.\n");
                 printf("*********************************\n");
-                cost = cost_tmp;
+                state.best_cost = cost_tmp;
                 memcpy(para->centers, centers_tmp, sizeof(float) * para->k * para->d);
             }
+            state.iteration = 0;
+            state.old_cost = 0.0f;
         }
-        //delete[] centers_tmp;
-        return cost;
+        delete[] centers_tmp;
+
+        if(!para->ckpt.empty())
+            remove(para->ckpt.c_str());
+        return state.best_cost;
     }
 
     static void nn_task2(void* arg, int tid, int i, pthread_mutex_t& mutex)
@@ -148,36 +178,40 @@ private:
     @param iter number of iterations
     @param cost total cost of this run
     @param nt number of core to use for computing
+    @param para the k-means parameter, for the checkpoint file and the best centers so far
+    @param state the run to continue. when state.iteration > 0, centers already hold the centers of that iteration
     @return void
     */
-    static void kmeans_once(const float* data, float* centers, int n, int d, int k, int iter, float& cost, int nt)
+    static void kmeans_once(const float* data, float* centers, int n, int d, int k, int iter, float& cost, int nt, kmeans_par* para, kmeans_state& state)
     {
-        //int* initial_center_idx = init_rand(n, k);
-        int* initial_center_idx = init_kpp(n, k, d, data);
+        if(state.iteration == 0)
+        {
+            //int* initial_center_idx = init_rand(n, k);
+            int* initial_center_idx = init_kpp(n, k, d, data);
 
-        cout << "init centers" << endl;
-        // init centers with random generated index
-        for(int i = 0; i < k; i++)
-            for(int j = 0; j<d; j++)
-                centers[i*d + j] = data[initial_center_idx[i]*d + j];
+            cout << "init centers" << endl;
+            // init centers with random generated index
+            for(int i = 0; i < k; i++)
+                for(int j = 0; j<d; j++)
+                    centers[i*d + j] = data[initial_center_idx[i]*d + j];
 
-        delete[] initial_center_idx;
+            delete[] initial_center_idx;
+        }
 
 
         int* ownership = new int[n];
         float* cost_tmp = new float[n];
-        float old_cost = 0;
+        float old_cost = state.old_cost;
+        cost = old_cost; // in case the checkpoint was taken after the last iteration
         //printf("debug:n= %d, nt=%d\n",n,nt);
         // begin iteration
-        for(int iteration = 0; iteration < iter; iteration ++)
+        for(int iteration = state.iteration; iteration < iter; iteration ++)
         {
             cost = 0;
             // re-assignment of center_id to each data
             /** assign points to clusters with multi-threading */
-            nn_par ti = {centers, data, k, d, ownership, cost_tmp, iteration};
-            MultiThd::compute_tasks(n, nt, &nn_task, &ti);
-            for(int j = 0; j < n; j ++)
-                cost += cost_tmp[j];
+            nn_par ti = {centers, data, k, d, ownership, cost_tmp, iteration, para->spherical};
+            cost = MultiThd::parallel_reduce(n, nt, &nn_range, &ti, 0);
 
             printf("Iter: %d   Cost: %.4f\n", iteration, cost);
             if(abs(cost - old_cost) < 0.000001)
@@ -210,9 +244,18 @@ private:
                     {
                         centers[i*d + j] /= cnt;
                     }
+                    // the mean direction of the points
+                    if(para->spherical)
+                        Util::normalize(centers + i*d, d);
                 }
             }
 
+            if(!para->ckpt.empty())
+            {
+                state.iteration = iteration + 1;
+                state.old_cost = old_cost;
+                save_ckpt(para, state, centers);
+            }
         }// end of iteration
 
         delete[] cost_tmp;
@@ -220,6 +263,63 @@ private:
     }
 
     
+    /**
+    layout: [n d k spherical attempt iteration] [best_cost old_cost] [best centers: k x d] [running centers: k x d]
+    @brief save the state of k-means to para->ckpt
+    @param centers the centers of the running attempt
+    */
+    static void save_ckpt(kmeans_par* para, const kmeans_state& state, const float* centers)
+    {
+        // write aside and rename, so that a crash while writing keeps the previous checkpoint
+        string tmp = para->ckpt + ".tmp";
+        FILE* fout = fopen(tmp.c_str(), "wb");
+        if(!fout)
+        {
+            printf("FILE IO ERROR: %s\n", tmp.c_str());
+            exit(1);
+        }
+        int head[6] = {para->n, para->d, para->k, para->spherical, state.attempt, state.iteration};
+        float cost[2] = {state.best_cost, state.old_cost};
+        fwrite(head, sizeof(int), 6, fout);
+        fwrite(cost, sizeof(float), 2, fout);
+        fwrite(para->centers, sizeof(float), para->k * para->d, fout);
+        fwrite(centers, sizeof(float), para->k * para->d, fout);
+        fclose(fout);
+        rename(tmp.c_str(), para->ckpt.c_str());
+    }
+
+    /**
+    @brief load the state of k-means from para->ckpt. best centers go to para->centers
+    @param centers keeps the centers of the running attempt
+    @return false if there is no checkpoint for this data
+    */
+    static bool load_ckpt(kmeans_par* para, kmeans_state& state, float* centers)
+    {
+        FILE* fin = fopen(para->ckpt.c_str(), "rb");
+        if(!fin)
+            return false;
+
+        int head[6];
+        float cost[2];
+        int sz = para->k * para->d;
+        bool ok = 6 == fread(head, sizeof(int), 6, fin) && 2 == fread(cost, sizeof(float), 2, fin)
+               && head[0] == para->n && head[1] == para->d && head[2] == para->k && head[3] == (int)para->spherical
+               && sz == (int)fread(para->centers, sizeof(float), sz, fin)
+               && sz == (int)fread(centers, sizeof(float), sz, fin);
+        fclose(fin);
+        if(!ok)
+        {
+            printf("Checkpoint %s does not match the data, start over.\n", para->ckpt.c_str());
+            return false;
+        }
+
+        state.attempt = head[4];
+        state.iteration = head[5];
+        state.best_cost = cost[0];
+        state.old_cost = cost[1];
+        return true;
+    }
+
     /**
     random number generator [pure random]
     @brief generate k random number from [0, n-1]
@@ -300,25 +400,20 @@ private:
     /**
     help function of kmeans_once
     @brief assignment nearest center id to i-th point.
-    it is the single computation for multi-threading computation.
-    @param arg type of nn_par*, contains the input and output needed for computation
-    @param tid thread id
-    @param i the index of this computation task against all tasks
-    @param mutex mutex for updating shared data
+    @param t contains the input and output needed for computation
+    @param i the index of the point
     @return void
     */
-    static void nn_task(void* arg, int tid, int i, pthread_mutex_t& mutex)
+    static void nearest_center(nn_par* t, int i)
     {
-        nn_par* t = (nn_par*) arg;
-        //printf("tid: %d, i: %d\n", tid, i);
-
         float dist_best = 1e100;
         for(int m = 0; m < t->k; m++) // loop for k centers, decides the nearest one
         {
             // print process cluster number per 100.
             //if(m%1000 == 0)
             //printf("iterator times:%d thread:%d centors:%d process %d clusters dist.\n", t->iterator, tid,t->k, m);
-            float dist = Util::dist_l2_sq(t->centers + m*t->d, t->data + i*t->d, t->d);
+            float dist = t->spherical ? 1.0f - Util::dot(t->centers + m*t->d, t->data + i*t->d, t->d)
+                                      : Util::dist_l2_sq(t->centers + m*t->d, t->data + i*t->d, t->d);
             if(dist < dist_best)
             {
                 dist_best = dist;
@@ -328,6 +423,21 @@ private:
         t->cost[i] = dist_best;
     }
 
+    /**
+    @brief nearest_center on the points [begin, end), a range of the multi-threaded assignment
+    @return the cost of these points
+    */
+    static double nn_range(void* arg, int tid, int begin, int end)
+    {
+        nn_par* t = (nn_par*) arg;
+        double cost = 0.0;
+        for(int i = begin; i < end; i++)
+        {
+            nearest_center(t, i);
+            cost += t->cost[i];
+        }
+        return cost;
+    }
 
 
 };
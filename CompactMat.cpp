@@ -0,0 +1,372 @@
+/**
+@file CompactMat.cpp
+@brief this file implements the reduced precision matrix defined in CompactMat.h
+*/
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cassert>
+#include <algorithm>
+
+#include "CompactMat.h"
+#include "IO.h"
+#include "util.h"
+
+
+/// fp32 -> fp16, round to nearest even
+static unsigned short float2half(float f)
+{
+    unsigned int x;
+    memcpy(&x, &f, sizeof(float));
+    unsigned int sign = (x >> 16) & 0x8000;
+    int e = (x >> 23) & 0xff;
+    unsigned int mant = x & 0x7fffff;
+
+    if(e == 0xff) // inf or nan
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+    int exp = e - 127 + 15;
+    if(exp >= 31) // too large: inf
+        return sign | 0x7c00;
+    if(exp <= 0) // subnormal or zero
+    {
+        if(exp < -10)
+            return sign;
+        mant |= 0x800000;
+        int shift = 14 - exp;
+        unsigned int h = mant >> shift;
+        unsigned int rem = mant & ((1u << shift) - 1);
+        unsigned int halfway = 1u << (shift - 1);
+        if(rem > halfway || (rem == halfway && (h & 1)))
+            h++;
+        return sign | h;
+    }
+
+    unsigned int h = (exp << 10) | (mant >> 13);
+    unsigned int rem = mant & 0x1fff;
+    if(rem > 0x1000 || (rem == 0x1000 && (h & 1))) // a carry into the exponent is still right
+        h++;
+    return sign | h;
+}
+
+/// fp16 -> fp32
+static float half2float_slow(unsigned short h)
+{
+    unsigned int sign = (h & 0x8000) << 16;
+    int exp = (h >> 10) & 0x1f;
+    unsigned int mant = h & 0x3ff;
+    unsigned int x;
+
+    if(exp == 0)
+    {
+        if(mant == 0)
+            x = sign;
+        else // subnormal: normalize it
+        {
+            exp = 1;
+            while(!(mant & 0x400))
+            {
+                mant <<= 1;
+                exp--;
+            }
+            mant &= 0x3ff;
+            x = sign | ((exp + 112) << 23) | (mant << 13);
+        }
+    }
+    else if(exp == 31)
+        x = sign | 0x7f800000 | (mant << 13);
+    else
+        x = sign | ((exp + 112) << 23) | (mant << 13);
+
+    float f;
+    memcpy(&f, &x, sizeof(float));
+    return f;
+}
+
+/// fp16 -> fp32 lookup table, filled before main() so that threads can share it
+struct half_table
+{
+    float val[65536];
+    half_table()
+    {
+        for(int i = 0; i < 65536; i++)
+            val[i] = half2float_slow((unsigned short)i);
+    }
+};
+static half_table h2f;
+
+/// fp32 -> bf16, round to nearest even
+static unsigned short float2bf16(float f)
+{
+    unsigned int x;
+    memcpy(&x, &f, sizeof(float));
+    if((x & 0x7f800000) == 0x7f800000) // inf or nan: truncate
+        return x >> 16;
+    x += 0x7fff + ((x >> 16) & 1);
+    return x >> 16;
+}
+
+/// bf16 -> fp32
+static inline float bf162float(unsigned short h)
+{
+    unsigned int x = ((unsigned int)h) << 16;
+    float f;
+    memcpy(&f, &x, sizeof(float));
+    return f;
+}
+
+
+void CompactMat::alloc()
+{
+    half = NULL;
+    q = NULL;
+    scale = NULL;
+    if(fmt == FMT_INT8)
+    {
+        q = new signed char[(long)n*d];
+        scale = new float[n];
+    }
+    else
+        half = new unsigned short[(long)n*d];
+}
+
+CompactMat::CompactMat(const float* src, int n_l, int d_l, int fmt_l)
+{
+    assert(fmt_l == FMT_FP16 || fmt_l == FMT_BF16 || fmt_l == FMT_INT8);
+    n = n_l;
+    d = d_l;
+    fmt = fmt_l;
+    alloc();
+
+    for(int i = 0; i < n; i++)
+    {
+        const float* row = src + (long)i*d;
+        if(fmt == FMT_INT8)
+        {
+            // symmetric quantization of the row on [-127, 127]
+            float max_abs = 0.0f;
+            for(int j = 0; j < d; j++)
+                max_abs = std::max(max_abs, (float)fabs(row[j]));
+            scale[i] = (max_abs > 0) ? max_abs / 127.0f : 1.0f;
+            for(int j = 0; j < d; j++)
+                q[(long)i*d + j] = (signed char)floor(row[j] / scale[i] + 0.5f);
+        }
+        else if(fmt == FMT_FP16)
+        {
+            for(int j = 0; j < d; j++)
+                half[(long)i*d + j] = float2half(row[j]);
+        }
+        else
+        {
+            for(int j = 0; j < d; j++)
+                half[(long)i*d + j] = float2bf16(row[j]);
+        }
+    }
+}
+
+CompactMat::~CompactMat()
+{
+    delete[] half;
+    delete[] q;
+    delete[] scale;
+}
+
+
+float CompactMat::dist_l2_sq(const float* x, int i) const
+{
+    float dist = 0.0f;
+    if(fmt == FMT_INT8)
+    {
+        const signed char* r = q + (long)i*d;
+        float s = scale[i];
+        for(int j = 0; j < d; j++)
+        {
+            float diff = x[j] - s*r[j];
+            dist += diff*diff;
+        }
+    }
+    else if(fmt == FMT_FP16)
+    {
+        const unsigned short* r = half + (long)i*d;
+        for(int j = 0; j < d; j++)
+        {
+            float diff = x[j] - h2f.val[r[j]];
+            dist += diff*diff;
+        }
+    }
+    else
+    {
+        const unsigned short* r = half + (long)i*d;
+        for(int j = 0; j < d; j++)
+        {
+            float diff = x[j] - bf162float(r[j]);
+            dist += diff*diff;
+        }
+    }
+    return dist;
+}
+
+float CompactMat::dot(const float* x, int i) const
+{
+    float s = 0.0f;
+    if(fmt == FMT_INT8)
+    {
+        const signed char* r = q + (long)i*d;
+        for(int j = 0; j < d; j++)
+            s += x[j]*r[j];
+        s *= scale[i];
+    }
+    else if(fmt == FMT_FP16)
+    {
+        const unsigned short* r = half + (long)i*d;
+        for(int j = 0; j < d; j++)
+            s += x[j]*h2f.val[r[j]];
+    }
+    else
+    {
+        const unsigned short* r = half + (long)i*d;
+        for(int j = 0; j < d; j++)
+            s += x[j]*bf162float(r[j]);
+    }
+    return s;
+}
+
+void CompactMat::decode(int i, float* out) const
+{
+    for(int j = 0; j < d; j++)
+    {
+        if(fmt == FMT_INT8)
+            out[j] = scale[i]*q[(long)i*d + j];
+        else if(fmt == FMT_FP16)
+            out[j] = h2f.val[half[(long)i*d + j]];
+        else
+            out[j] = bf162float(half[(long)i*d + j]);
+    }
+}
+
+void CompactMat::nearest(const float* x, int n_x, int ldx, int row0, int nrows, int* out, float* dist) const
+{
+    for(int p = 0; p < n_x; p++)
+    {
+        float dist_best = 1e30f;
+        int best = 0;
+        for(int i = 0; i < nrows; i++)
+        {
+            float dst = dist_l2_sq(x + p*ldx, row0 + i);
+            if(dst < dist_best)
+            {
+                dist_best = dst;
+                best = i;
+            }
+        }
+        out[p] = best;
+        if(dist != NULL)
+            dist[p] = dist_best;
+    }
+}
+
+float CompactMat::agreement(const float* ref, const float* x, int n_x, int ldx, int row0, int nrows, float& rel_err) const
+{
+    int same = 0;
+    double err = 0.0;
+    for(int p = 0; p < n_x; p++)
+    {
+        float ref_best = 1e30f;
+        int ref_id = 0;
+        for(int i = 0; i < nrows; i++)
+        {
+            float dst = Util::dist_l2_sq(x + p*ldx, ref + (long)(row0 + i)*d, d);
+            if(dst < ref_best)
+            {
+                ref_best = dst;
+                ref_id = i;
+            }
+        }
+
+        int id;
+        nearest(x + p*ldx, 1, ldx, row0, nrows, &id, NULL);
+        same += (id == ref_id);
+        if(ref_best > 0)
+            err += fabs(dist_l2_sq(x + p*ldx, row0 + ref_id) - ref_best) / ref_best;
+    }
+    rel_err = (n_x > 0) ? err / n_x : 0.0f;
+    return (n_x > 0) ? (float)same / n_x : 1.0f;
+}
+
+long CompactMat::bytes() const
+{
+    if(fmt == FMT_INT8)
+        return (long)n*d + (long)n*sizeof(float);
+    return (long)n*d*sizeof(unsigned short);
+}
+
+
+void CompactMat::write2Disk(string file) const
+{
+    string tmp = file + ".tmp";
+    FILE* fout = fopen(tmp.c_str(), "wb");
+    IO::chkFileErr(fout, tmp);
+
+    int head[3] = {n, d, fmt};
+    fwrite(head, sizeof(int), 3, fout);
+    if(fmt == FMT_INT8)
+    {
+        fwrite(scale, sizeof(float), n, fout);
+        fwrite(q, sizeof(signed char), (long)n*d, fout);
+    }
+    else
+        fwrite(half, sizeof(unsigned short), (long)n*d, fout);
+
+    fclose(fout);
+    rename(tmp.c_str(), file.c_str());
+}
+
+CompactMat* CompactMat::loadFromDisk(string file)
+{
+    FILE* fin = fopen(file.c_str(), "rb");
+    if(!fin)
+        return NULL;
+
+    int head[3];
+    assert( 3 == fread(head, sizeof(int), 3, fin) );
+    CompactMat* mat = new CompactMat();
+    mat->n = head[0];
+    mat->d = head[1];
+    mat->fmt = head[2];
+    mat->alloc();
+
+    long sz = (long)mat->n * mat->d;
+    if(mat->fmt == FMT_INT8)
+    {
+        assert( mat->n == (int)fread(mat->scale, sizeof(float), mat->n, fin) );
+        assert( sz == (long)fread(mat->q, sizeof(signed char), sz, fin) );
+    }
+    else
+        assert( sz == (long)fread(mat->half, sizeof(unsigned short), sz, fin) );
+
+    fclose(fin);
+    return mat;
+}
+
+
+int CompactMat::parse_fmt(string name)
+{
+    if(name == "fp32")
+        return FMT_FP32;
+    if(name == "fp16")
+        return FMT_FP16;
+    if(name == "bf16")
+        return FMT_BF16;
+    if(name == "int8")
+        return FMT_INT8;
+
+    printf("error: unknown codebook format %s.\n", name.c_str());
+    exit(1);
+}
+
+string CompactMat::fmt_name(int fmt)
+{
+    const char* names[4] = {"fp32", "fp16", "bf16", "int8"};
+    assert(fmt >= 0 && fmt < 4);
+    return names[fmt];
+}
@@ -0,0 +1,107 @@
+/**
+@file CompactMat.h
+@brief This file defines a float matrix stored in reduced precision (fp16, bf16 or int8 with
+a scale per row), used to keep codebooks small in memory and on disk.
+*/
+
+#ifndef COMPACTMAT_H_INCLUDED
+#define COMPACTMAT_H_INCLUDED
+
+#include <string>
+
+using std::string;
+
+/// storage formats of CompactMat
+enum
+{
+    FMT_FP32 = 0,
+    FMT_FP16 = 1,
+    FMT_BF16 = 2,
+    FMT_INT8 = 3
+};
+
+
+/**
+Rows are converted back to float on the fly inside the distance loops, so a matrix is never
+expanded to fp32 in memory.
+@brief n x d matrix in reduced precision
+*/
+class CompactMat
+{
+public:
+
+    /// number of rows
+    int n;
+    /// dimension of each row
+    int d;
+    /// storage format, one of FMT_*
+    int fmt;
+
+    /**
+    @brief convert a fp32 matrix
+    @param src matrix to convert. size of n x d
+    @param n_l number of rows
+    @param d_l dimension of each row
+    @param fmt_l storage format, FMT_FP16, FMT_BF16 or FMT_INT8
+    */
+    CompactMat(const float* src, int n_l, int d_l, int fmt_l);
+
+    ~CompactMat();
+
+    /// squared l2 distance between x (size of d) and row i
+    float dist_l2_sq(const float* x, int i) const;
+
+    /// inner product between x (size of d) and row i
+    float dot(const float* x, int i) const;
+
+    /// convert row i back to float. out is size of d
+    void decode(int i, float* out) const;
+
+    /**
+    @brief nearest row in [row0, row0 + nrows) of each of the n points of x
+    @param x the points. point i starts at x + i*ldx
+    @param out keeps the nearest row, counted from row0. size of n
+    @param dist keeps the squared distance to it, can be NULL. size of n
+    */
+    void nearest(const float* x, int n_x, int ldx, int row0, int nrows, int* out, float* dist) const;
+
+    /**
+    @brief measure the effect of the reduced precision on the nearest row search of the points of x
+    @param ref the fp32 matrix this one was converted from. size of n x d
+    @param x the points. point i starts at x + i*ldx
+    @param row0 first row of the searched range
+    @param nrows number of rows of the searched range
+    @param rel_err keeps the mean relative error of the distance to the true nearest row
+    @return fraction of points whose nearest row is unchanged
+    */
+    float agreement(const float* ref, const float* x, int n_x, int ldx, int row0, int nrows, float& rel_err) const;
+
+    /// bytes used by the matrix in memory
+    long bytes() const;
+
+    /// write the matrix to 'file'. layout: [n d fmt] [scales: n floats, int8 only] [data]
+    void write2Disk(string file) const;
+
+    /// load a matrix written by write2Disk, NULL if 'file' does not exist
+    static CompactMat* loadFromDisk(string file);
+
+    /// format from its name in config: fp32, fp16, bf16 or int8
+    static int parse_fmt(string name);
+
+    /// name of a format, also used as extension of the files on disk
+    static string fmt_name(int fmt);
+
+private:
+
+    /// fp16 or bf16 bits. size of n x d
+    unsigned short* half;
+    /// int8 values. size of n x d
+    signed char* q;
+    /// scale of each int8 row. size of n
+    float* scale;
+
+    CompactMat() {}
+    void alloc();
+};
+
+#endif // COMPACTMAT_H_INCLUDED
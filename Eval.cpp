@@ -0,0 +1,306 @@
+/**
+@file Eval.cpp
+@brief this file implements the evaluation defined in Eval.h
+*/
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <queue>
+#include <functional>
+#include <algorithm>
+
+#include "Eval.h"
+#include "IO.h"
+#include "MultiThd.h"
+#include "Latency.h"
+
+using std::map;
+
+extern Config con;
+
+/// queries searched together by a thread of the brute force
+static const int gt_block = 16;
+/// base vectors matched at a time against a block of queries
+static const int gt_chunk = 4096;
+
+const int Eval::ranks[3] = {1, 10, 100};
+
+/// arguments used when searching the queries with multi-threading
+struct eval_args
+{
+    SearchEngine* engine;
+    const float* query;
+    int d;
+    int topk;
+    /// the results of each query, as indices of the base. size of nq
+    vector<int>* found;
+    /// maps the ids of the engine to indices of the base, -1 when not in the base
+    const vector<int>* id_map;
+    /// time of each query, in ns. size of nq
+    long* time;
+};
+
+
+/// 64-bit FNV-1a hash of n bytes, continued from h
+static unsigned long long fnv1a(const void* data, long n, unsigned long long h)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    for(long i = 0; i < n; i++)
+    {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+
+void Eval::gt_task(void* arg, int tid, int i, pthread_mutex_t& mutex)
+{
+    gt_args* a = (gt_args*)arg;
+    int d = a->d;
+    int q0 = i*gt_block;
+    int nb = std::min(gt_block, a->nq - q0);
+    float* ip = a->ip_buf + (long)tid*gt_block*gt_chunk;
+
+    // min-heap of the k best (inner product, index) of each query
+    typedef std::pair<float, int> scored;
+    vector< std::priority_queue<scored, vector<scored>, std::greater<scored> > > best(nb);
+    for(long c0 = 0; c0 < a->n_base; c0 += gt_chunk)
+    {
+        int nc = (int)std::min((long)gt_chunk, a->n_base - c0);
+        Util::inner_products(a->query + (long)q0*d, nb, d, a->base + c0*d, nc, d, ip);
+        for(int q = 0; q < nb; q++)
+        {
+            const float* row = ip + (long)q*nc;
+            for(int j = 0; j < nc; j++)
+            {
+                if((int)best[q].size() < a->k)
+                    best[q].push(scored(row[j], c0 + j));
+                else if(row[j] > best[q].top().first)
+                {
+                    best[q].pop();
+                    best[q].push(scored(row[j], c0 + j));
+                }
+            }
+        }
+    }
+
+    for(int q = 0; q < nb; q++)
+    {
+        int* out = a->gt + (long)(q0 + q)*a->k;
+        for(int r = best[q].size() - 1; r >= 0; r--) // the heap pops the worst first
+        {
+            out[r] = best[q].top().second;
+            best[q].pop();
+        }
+    }
+}
+
+
+void Eval::ground_truth(const float* base, long n_base, const float* query, int nq, int d, int k, int nt, int* gt)
+{
+    printf("Brute-force search of %d queries in %ld vectors...\n", nq, n_base);
+    gt_args args = {base, n_base, query, nq, d, k, gt, new float[(long)nt*gt_block*gt_chunk]};
+    MultiThd::compute_tasks((nq + gt_block - 1) / gt_block, nt, &gt_task, &args);
+    delete[] args.ip_buf;
+}
+
+
+void Eval::cached_ground_truth(string file, const float* base, long n_base, const float* query, int nq, int d, int k, int nt, int* gt)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    h = fnv1a(base, sizeof(float)*n_base*d, h);
+    h = fnv1a(query, sizeof(float)*(long)nq*d, h);
+
+    FILE* fin = fopen(file.c_str(), "rb");
+    if(fin != NULL)
+    {
+        long head[4];
+        unsigned long long h_file;
+        bool ok = fread(head, sizeof(long), 4, fin) == 4 && fread(&h_file, sizeof(h_file), 1, fin) == 1
+                  && head[0] == n_base && head[1] == nq && head[2] == d && head[3] == k && h_file == h
+                  && fread(gt, sizeof(int), (long)nq*k, fin) == (size_t)nq*k;
+        fclose(fin);
+        if(ok)
+        {
+            printf("Ground truth read from %s\n", file.c_str());
+            return;
+        }
+        printf("Ground truth %s is stale, computing it again.\n", file.c_str());
+    }
+
+    ground_truth(base, n_base, query, nq, d, k, nt, gt);
+
+    // written aside first, so that an interrupted run does not leave a broken cache
+    string tmp = file + ".tmp";
+    FILE* fout = fopen(tmp.c_str(), "wb");
+    IO::chkFileErr(fout, tmp);
+    long head[4] = {n_base, nq, d, k};
+    fwrite(head, sizeof(long), 4, fout);
+    fwrite(&h, sizeof(h), 1, fout);
+    fwrite(gt, sizeof(int), (long)nq*k, fout);
+    fclose(fout);
+    rename(tmp.c_str(), file.c_str());
+}
+
+
+/// search query i and keep its results as indices of the base
+static void eval_task(void* arg, int tid, int i, pthread_mutex_t& mutex)
+{
+    eval_args* a = (eval_args*)arg;
+    vector<Result> res;
+    long start = clock_ns();
+    a->engine->search(a->query + (long)i*a->d, a->topk, res);
+    a->time[i] = clock_ns() - start;
+    for(unsigned int j = 0; j < res.size(); j++)
+        a->found[i].push_back((*a->id_map)[res[j].im_id]);
+}
+
+
+eval_data* Eval::prepare(SearchEngine* engine, string base_dir, string query_dir, string gt_file, int nt)
+{
+    float* base;
+    int n_base = 0, d = 0;
+    eval_data* data = new eval_data;
+    vector<string*> base_names, query_names;
+    IO::load_vlad(base_dir, &base, &base_names, &n_base, &d);
+    IO::load_vlad(query_dir, &data->query, &query_names, &data->nq, &data->d);
+    if(n_base == 0 || data->nq == 0 || d != data->d)
+    {
+        printf("error: nothing to evaluate in %s and %s.\n", base_dir.c_str(), query_dir.c_str());
+        exit(1);
+    }
+    for(int i = 0; i < n_base; i++)
+        Util::normalize(base + (long)i*d, d);
+    for(int i = 0; i < data->nq; i++)
+        Util::normalize(data->query + (long)i*d, d);
+
+    data->k = std::min(ranks[2], n_base);
+    data->gt = new int[(long)data->nq*data->k];
+    cached_ground_truth(gt_file, base, n_base, data->query, data->nq, d, data->k, nt, data->gt);
+
+    // the engine knows the vectors by the names of its index
+    map<string, int> base_idx;
+    for(int i = 0; i < n_base; i++)
+        base_idx[*base_names[i]] = i;
+    data->id_map.assign(engine->im_db.size(), -1);
+    for(unsigned int i = 0; i < engine->im_db.size(); i++)
+    {
+        map<string, int>::iterator it = base_idx.find(engine->im_db[i]);
+        if(it != base_idx.end())
+            data->id_map[i] = it->second;
+    }
+
+    delete[] base;
+    for(unsigned int i = 0; i < base_names.size(); i++)
+        delete base_names[i];
+    for(unsigned int i = 0; i < query_names.size(); i++)
+        delete query_names[i];
+    return data;
+}
+
+
+eval_result Eval::measure(SearchEngine* engine, const eval_data& data, int nt, int R)
+{
+    int nq = data.nq;
+    vector<int>* found = new vector<int>[nq];
+    long* time = new long[nq];
+    eval_args args = {engine, data.query, data.d, std::max(ranks[2], R), found, &data.id_map, time};
+    engine->stats.clear();
+    long start = clock_ns();
+    MultiThd::compute_tasks(nq, nt, &eval_task, &args);
+    double wall = (clock_ns() - start) * 1e-9;
+
+    eval_result res;
+    res.nq = nq;
+    res.qps = nq / wall;
+    res.probes = engine->stats.mean_lists();
+    res.partial = engine->stats.num_partial();
+    LatencyHistogram lat;
+    for(int i = 0; i < nq; i++)
+        lat.add(time[i]);
+    res.latency_us = lat.mean() / 1000.0;
+    res.p99_us = lat.percentile(99) / 1000.0;
+
+    int rs[4] = {ranks[0], ranks[1], ranks[2], R};
+    double* recall[4] = {&res.recall[0], &res.recall[1], &res.recall[2], &res.recall_r};
+    for(int r = 0; r < 4; r++)
+    {
+        int hits = 0;
+        for(int i = 0; i < nq; i++)
+        {
+            int n = std::min(rs[r], (int)found[i].size());
+            hits += std::find(found[i].begin(), found[i].begin() + n, data.gt[(long)i*data.k]) != found[i].begin() + n;
+        }
+        *recall[r] = (double)hits / nq;
+    }
+
+    delete[] found;
+    delete[] time;
+    return res;
+}
+
+
+eval_result Eval::evaluate(SearchEngine* engine, string base_dir, string query_dir, string gt_file, int nt)
+{
+    eval_data* data = prepare(engine, base_dir, query_dir, gt_file, nt);
+    printf("Searching %d queries with %d threads...\n", data->nq, nt);
+    eval_result res = measure(engine, *data, nt, ranks[2]);
+    delete data;
+    return res;
+}
+
+
+string Eval::setting()
+{
+    string s = "coarsek=" + Util::num2str(con.coarsek);
+    if(con.codec != CODEC_SQ8)
+        s += " nsq=" + Util::num2str(con.nsq) + " nsqbits=" + Util::num2str(con.nsqbits);
+    if(con.codec != CODEC_PQ)
+        s += " codec=" + ResidualCodec::name(con.codec);
+    if(con.imi)
+        s += " imi_budget=" + Util::num2str(con.imi_budget);
+    else
+        s += " ma=" + Util::num2str(con.ma);
+    if(con.hnsw)
+        s += " hnsw_ef=" + Util::num2str(con.hnsw_ef);
+    if(con.cb_fmt != FMT_FP32)
+        s += string(" cb_fmt=") + CompactMat::fmt_name(con.cb_fmt);
+    if(con.rerank > 0)
+        s += " rerank=" + Util::num2str(con.rerank);
+    if(con.probe_ratio > 0 && !con.imi)
+        s += " probe_ratio=" + Util::num2str(con.probe_ratio) + " probe_min=" + Util::num2str(con.probe_min);
+    if(con.metric == METRIC_IP)
+        s += " metric=ip";
+    if(con.he_len > 0)
+        s += " he_len=" + Util::num2str(con.he_len) + " ht=" + Util::num2str(con.ht);
+    if(con.poly_ht > 0)
+        s += " poly_ht=" + Util::num2str(con.poly_ht);
+    if(con.adc_full)
+        s += con.prune ? " score=full prune=1" : " score=full";
+    if(con.scan_budget > 0)
+        s += " scan_budget=" + Util::num2str(con.scan_budget);
+    if(con.deadline_us > 0)
+        s += " deadline_us=" + Util::num2str(con.deadline_us);
+    return s;
+}
+
+
+void Eval::report(const eval_result& res, string setting, string file)
+{
+    printf("%-40s %8s %8s %8s %8s %10s %12s %8s\n", "setting", "queries", "R@1", "R@10", "R@100", "QPS", "latency(us)", "probes");
+    printf("%-40s %8d %8.4f %8.4f %8.4f %10.1f %12.1f %8.2f\n", setting.c_str(), res.nq,
+           res.recall[0], res.recall[1], res.recall[2], res.qps, res.latency_us, res.probes);
+    if(res.partial > 0)
+        printf("%d of the %d queries ran out of budget, their results are partial\n", res.partial, res.nq);
+
+    bool exists = IO::f_exists(file);
+    FILE* fout = fopen(file.c_str(), "a");
+    IO::chkFileErr(fout, file);
+    if(!exists)
+        fprintf(fout, "setting\tqueries\tR@1\tR@10\tR@100\tQPS\tlatency_us\tprobes\n");
+    fprintf(fout, "%s\t%d\t%.4f\t%.4f\t%.4f\t%.1f\t%.1f\t%.2f\n", setting.c_str(), res.nq,
+            res.recall[0], res.recall[1], res.recall[2], res.qps, res.latency_us, res.probes);
+    fclose(fout);
+    printf("Appended to %s\n", file.c_str());
+}
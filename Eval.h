@@ -0,0 +1,130 @@
+/**
+@file Eval.h
+@brief This file defines the evaluation of the search against exact nearest neighbours: the ground
+truth is found by brute force and cached on disk, and recall@R is measured with the QPS.
+*/
+#ifndef EVAL_H_INCLUDED
+#define EVAL_H_INCLUDED
+
+#include <string>
+#include <vector>
+
+#include "SearchEngine.h"
+
+using std::string;
+using std::vector;
+
+/// arguments of the brute-force search of a block of queries with multi-threading
+struct gt_args
+{
+    const float* base;
+    long n_base;
+    const float* query;
+    int nq;
+    int d;
+    /// number of neighbours kept per query
+    int k;
+    /// the k nearest base vectors of each query, nearest first. size of nq x k
+    int* gt;
+    /// inner products of a block of queries with a chunk of the base. size of nt x block x chunk
+    float* ip_buf;
+};
+
+/// measures of one evaluation, see Eval::evaluate
+struct eval_result
+{
+    int nq;
+    /// recall@1, @10 and @100 of the nearest neighbour
+    double recall[3];
+    /// recall at the rank asked to Eval::measure
+    double recall_r;
+    /// queries per second, with nt threads
+    double qps;
+    /// mean and 99th percentile latency of a query in microseconds
+    double latency_us;
+    double p99_us;
+    /// mean number of lists probed per query
+    double probes;
+    /// number of queries cut by their budget
+    int partial;
+};
+
+/// the queries of an evaluation with their ground truth, see Eval::prepare
+struct eval_data
+{
+    int nq;
+    int d;
+    /// the queries, normalized. nq x d
+    float* query;
+    /// number of neighbours in the ground truth
+    int k;
+    /// the k nearest base vectors of each query, nearest first. nq x k
+    int* gt;
+    /// maps the ids of the engine to indices of the base, -1 when not in the base
+    vector<int> id_map;
+
+    eval_data() : query(NULL), gt(NULL) {}
+    ~eval_data()
+    {
+        delete[] query;
+        delete[] gt;
+    }
+};
+
+
+/// evaluation of the search against exact nearest neighbours
+class Eval
+{
+public:
+
+    /// the ranks at which recall is measured
+    static const int ranks[3];
+
+    /**
+    The base and the queries are normalized first, as by indexing and search, so that the
+    nearest neighbours are those of the largest inner product.
+    @brief exact k nearest base vectors of each query, with nt threads
+    @param gt keeps the indices of the neighbours in base, nearest first. size of nq x k
+    */
+    static void ground_truth(const float* base, long n_base, const float* query, int nq, int d, int k, int nt, int* gt);
+
+    /**
+    The file keeps a fingerprint of the base and of the queries, and is computed again when they change.
+    @brief ground_truth() cached in 'file'
+    */
+    static void cached_ground_truth(string file, const float* base, long n_base, const float* query, int nq, int d, int k, int nt, int* gt);
+
+    /**
+    @brief load the queries of query_dir, with their ground truth in the base of base_dir
+    @param gt_file where the ground truth is cached
+    @param nt number of threads of the brute-force search
+    */
+    static eval_data* prepare(SearchEngine* engine, string base_dir, string query_dir, string gt_file, int nt);
+
+    /**
+    recall@R is the share of the queries whose nearest neighbour is among the first R results.
+    @brief search the queries of data with engine, as it is set now, and measure recall@1/10/100 and recall@R
+    @param nt number of threads searching
+    */
+    static eval_result measure(SearchEngine* engine, const eval_data& data, int nt, int R);
+
+    /**
+    @brief prepare() and measure() in one go
+    */
+    static eval_result evaluate(SearchEngine* engine, string base_dir, string query_dir, string gt_file, int nt);
+
+    /// the search parameters of con, e.g. "coarsek=256 nsq=8 nsqbits=8 ma=4"
+    static string setting();
+
+    /**
+    @brief print the measures as a row of a table, and append it to 'file' (tab separated)
+    @param setting the parameters of the engine, see setting()
+    */
+    static void report(const eval_result& res, string setting, string file);
+
+private:
+
+    static void gt_task(void* arg, int tid, int i, pthread_mutex_t& mutex);
+};
+
+#endif // EVAL_H_INCLUDED
@@ -0,0 +1,346 @@
+/**
+@file HNSW.cpp
+@brief this file implements the HNSW graph defined in HNSW.h
+*/
+#include <queue>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+
+#include "HNSW.h"
+#include "CompactMat.h"
+#include "util.h"
+#include "IO.h"
+
+using std::pair;
+using std::priority_queue;
+
+typedef pair<float, int> dist_id;
+
+/// orders dist_id so that priority_queue pops the nearest one first
+struct farther
+{
+    bool operator () (const dist_id& a, const dist_id& b) const
+    {
+        return a.first > b.first;
+    }
+};
+
+
+HNSW::HNSW(const float* data_l, int n_l, int d_l)
+{
+    data = data_l;
+    cdata = NULL;
+    n = n_l;
+    d = d_l;
+    M = 0;
+    max_level = -1;
+    entry = -1;
+    seed = 12345;
+    pthread_mutex_init(&tags_mutex, NULL);
+}
+
+HNSW::~HNSW()
+{
+    for(unsigned int i = 0; i < free_tags.size(); i++)
+        delete free_tags[i];
+    pthread_mutex_destroy(&tags_mutex);
+}
+
+visit_tags* HNSW::take_tags() const
+{
+    visit_tags* tags = NULL;
+    pthread_mutex_lock(&tags_mutex);
+    if(!free_tags.empty())
+    {
+        tags = free_tags.back();
+        free_tags.pop_back();
+    }
+    pthread_mutex_unlock(&tags_mutex);
+    if(tags == NULL)
+    {
+        tags = new visit_tags;
+        tags->tag.assign(n, 0);
+        tags->epoch = 0;
+    }
+    return tags;
+}
+
+void HNSW::give_tags(visit_tags* tags) const
+{
+    pthread_mutex_lock(&tags_mutex);
+    free_tags.push_back(tags);
+    pthread_mutex_unlock(&tags_mutex);
+}
+
+long HNSW::bytes() const
+{
+    long b = level.capacity()*sizeof(int) + links.capacity()*sizeof(links[0]);
+    for(unsigned int i = 0; i < links.size(); i++)
+    {
+        b += links[i].capacity()*sizeof(links[i][0]);
+        for(unsigned int l = 0; l < links[i].size(); l++)
+            b += links[i][l].capacity()*sizeof(int);
+    }
+    return b;
+}
+
+float HNSW::dist_to(const float* q, int i) const
+{
+    if(cdata != NULL)
+        return cdata->dist_l2_sq(q, i);
+    return Util::dist_l2_sq(q, data + (long)i*d, d);
+}
+
+void HNSW::set_data(const CompactMat* cdata_l)
+{
+    cdata = cdata_l;
+    data = NULL;
+}
+
+int HNSW::random_level()
+{
+    double r = (rand_r(&seed) + 1.0) / (RAND_MAX + 2.0);
+    return (int)(-log(r) / log((double)M));
+}
+
+
+void HNSW::search_layer(const float* q, int ep, int ef, int layer, visit_tags* tags, vector<dist_id>& out) const
+{
+    // a new epoch forgets the nodes of the last search. the tags are only cleared when it wraps around
+    unsigned int* visited = &tags->tag[0];
+    unsigned int epoch = ++tags->epoch;
+    if(epoch == 0)
+    {
+        tags->tag.assign(n, 0);
+        epoch = tags->epoch = 1;
+    }
+    priority_queue<dist_id, vector<dist_id>, farther> cand; // nearest on top
+    priority_queue<dist_id> best;                           // farthest on top, at most ef
+
+    float dist_ep = dist_to(q, ep);
+    cand.push(dist_id(dist_ep, ep));
+    best.push(dist_id(dist_ep, ep));
+    visited[ep] = epoch;
+
+    while(!cand.empty())
+    {
+        dist_id c = cand.top();
+        if(c.first > best.top().first) // every candidate left is farther than the worst kept
+            break;
+        cand.pop();
+
+        const vector<int>& nbs = links[c.second][layer];
+        for(unsigned int j = 0; j < nbs.size(); j++)
+        {
+            int nb = nbs[j];
+            if(visited[nb] == epoch)
+                continue;
+            visited[nb] = epoch;
+
+            float dist = dist_to(q, nb);
+            if((int)best.size() < ef || dist < best.top().first)
+            {
+                cand.push(dist_id(dist, nb));
+                best.push(dist_id(dist, nb));
+                if((int)best.size() > ef)
+                    best.pop();
+            }
+        }
+    }
+
+    out.resize(best.size());
+    for(int i = (int)best.size() - 1; i >= 0; i--)
+    {
+        out[i] = best.top();
+        best.pop();
+    }
+}
+
+
+void HNSW::select_neighbours(vector<dist_id>& cand, int max_links) const
+{
+    // keep a candidate only if it is closer to the base node than to every neighbour kept so far,
+    // so that links spread in all directions instead of piling up in the nearest cluster.
+    vector<dist_id> kept;
+    for(unsigned int i = 0; i < cand.size() && (int)kept.size() < max_links; i++)
+    {
+        bool good = true;
+        for(unsigned int j = 0; j < kept.size(); j++)
+        {
+            if(Util::dist_l2_sq(data + (long)cand[i].second*d, data + (long)kept[j].second*d, d) < cand[i].first)
+            {
+                good = false;
+                break;
+            }
+        }
+        if(good)
+            kept.push_back(cand[i]);
+    }
+    cand.swap(kept);
+}
+
+
+void HNSW::build(int M_l, int ef_construction)
+{
+    printf("Building HNSW graph -- n: %d  d: %d  M: %d  efConstruction: %d.\n", n, d, M_l, ef_construction);
+    assert(data != NULL);
+    M = std::max(M_l, 2);
+    max_level = -1;
+    entry = -1;
+    level.assign(n, 0);
+    links.assign(n, vector< vector<int> >());
+
+    vector<dist_id> cand;
+    visit_tags* tags = take_tags();
+    for(int i = 0; i < n; i++)
+    {
+        const float* q = data + (long)i*d;
+        int lvl = random_level();
+        level[i] = lvl;
+        links[i].resize(lvl + 1);
+
+        if(entry < 0)
+        {
+            entry = i;
+            max_level = lvl;
+            continue;
+        }
+
+        // greedy descent on the layers above the new node
+        int ep = entry;
+        for(int l = max_level; l > lvl; l--)
+        {
+            search_layer(q, ep, 1, l, tags, cand);
+            ep = cand[0].second;
+        }
+
+        for(int l = std::min(lvl, max_level); l >= 0; l--)
+        {
+            int max_links = (l == 0) ? 2*M : M;
+            search_layer(q, ep, ef_construction, l, tags, cand);
+            ep = cand[0].second;
+
+            select_neighbours(cand, M);
+            for(unsigned int j = 0; j < cand.size(); j++)
+            {
+                int nb = cand[j].second;
+                links[i][l].push_back(nb);
+
+                vector<int>& nb_links = links[nb][l];
+                nb_links.push_back(i);
+                if((int)nb_links.size() > max_links) // shrink the links of the neighbour
+                {
+                    vector<dist_id> nb_cand(nb_links.size());
+                    for(unsigned int x = 0; x < nb_links.size(); x++)
+                        nb_cand[x] = dist_id(dist_to(data + (long)nb*d, nb_links[x]), nb_links[x]);
+                    std::sort(nb_cand.begin(), nb_cand.end());
+                    select_neighbours(nb_cand, max_links);
+
+                    nb_links.resize(nb_cand.size());
+                    for(unsigned int x = 0; x < nb_cand.size(); x++)
+                        nb_links[x] = nb_cand[x].second;
+                }
+            }
+        }
+
+        if(lvl > max_level)
+        {
+            max_level = lvl;
+            entry = i;
+        }
+
+        if((i+1) % 1000 == 0)
+        {
+            printf("\r%d", i+1); fflush(stdout);
+        }
+    }
+    give_tags(tags);
+    printf("\n");
+}
+
+
+void HNSW::search(const float* q, int k, int ef, int* idx, float* dist)
+{
+    vector<dist_id> cand;
+    visit_tags* tags = take_tags();
+    int ep = entry;
+    for(int l = max_level; l > 0; l--)
+    {
+        search_layer(q, ep, 1, l, tags, cand);
+        ep = cand[0].second;
+    }
+    search_layer(q, ep, std::max(ef, k), 0, tags, cand);
+    give_tags(tags);
+
+    for(int i = 0; i < k; i++)
+    {
+        // the graph returns less than k only when n < k
+        int j = std::min(i, (int)cand.size() - 1);
+        idx[i] = cand[j].second;
+        if(dist != NULL)
+            dist[i] = cand[j].first;
+    }
+}
+
+
+void HNSW::write2Disk(string file)
+{
+    FILE* fout = fopen(file.c_str(), "wb");
+    IO::chkFileErr(fout, file);
+
+    int head[5] = {n, d, M, max_level, entry};
+    fwrite(head, sizeof(int), 5, fout);
+    for(int i = 0; i < n; i++)
+    {
+        fwrite(&level[i], sizeof(int), 1, fout);
+        for(int l = 0; l <= level[i]; l++)
+        {
+            int sz = links[i][l].size();
+            fwrite(&sz, sizeof(int), 1, fout);
+            if(sz > 0)
+                fwrite(&links[i][l][0], sizeof(int), sz, fout);
+        }
+    }
+
+    fclose(fout);
+}
+
+bool HNSW::loadFromDisk(string file)
+{
+    FILE* fin = fopen(file.c_str(), "rb");
+    if(!fin)
+        return false;
+
+    int head[5];
+    assert( 5 == fread(head, sizeof(int), 5, fin) );
+    if(head[0] != n || head[1] != d)
+    {
+        printf("HNSW graph %s does not match the codebook (%d x %d), ignored.\n", file.c_str(), head[0], head[1]);
+        fclose(fin);
+        return false;
+    }
+    M = head[2];
+    max_level = head[3];
+    entry = head[4];
+
+    level.assign(n, 0);
+    links.assign(n, vector< vector<int> >());
+    for(int i = 0; i < n; i++)
+    {
+        assert( 1 == fread(&level[i], sizeof(int), 1, fin) );
+        links[i].resize(level[i] + 1);
+        for(int l = 0; l <= level[i]; l++)
+        {
+            int sz;
+            assert( 1 == fread(&sz, sizeof(int), 1, fin) );
+            links[i][l].resize(sz);
+            if(sz > 0)
+                assert( sz == (int)fread(&links[i][l][0], sizeof(int), sz, fin) );
+        }
+    }
+
+    fclose(fin);
+    return true;
+}
@@ -0,0 +1,135 @@
+/**
+@file HNSW.h
+@brief This file defines a hierarchical navigable small world graph used to search
+the nearest centroids of a codebook approximately.
+*/
+
+#ifndef HNSW_H_INCLUDED
+#define HNSW_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+using std::string;
+using std::vector;
+
+class CompactMat;
+
+
+/**
+A node was visited by the running layer search if its tag equals epoch, so that a new search only
+increments epoch instead of clearing the tags of the whole graph.
+@brief the nodes visited by the searches of one thread
+*/
+struct visit_tags
+{
+    /// tag of each node. size of n
+    vector<unsigned int> tag;
+    unsigned int epoch;
+};
+
+
+/**
+The graph only keeps links. Vectors are read from the codebook it is built on, which must
+stay alive and unchanged as long as the graph is used.
+@brief HNSW graph over the rows of a n x d float matrix
+*/
+class HNSW
+{
+public:
+
+    /**
+    @brief constructor. the graph is empty until build() or load()
+    @param data the matrix to index. size of n x d
+    @param n number of rows
+    @param d dimension of each row
+    */
+    HNSW(const float* data, int n, int d);
+
+    ~HNSW();
+
+    /**
+    @brief insert all rows of data into the graph
+    @param M number of links per node on upper layers. layer 0 keeps 2*M
+    @param ef_construction size of the candidate list while inserting
+    */
+    void build(int M, int ef_construction);
+
+    /**
+    @brief search the k nearest rows of q
+    @param q query vector. size of d
+    @param k number of neighbours to return
+    @param ef size of the candidate list. at least k
+    @param idx keeps the ids of the neighbours, nearest first. size of k
+    @param dist keeps the squared distance of each neighbour, can be NULL. size of k
+    */
+    void search(const float* q, int k, int ef, int* idx, float* dist);
+
+    /**
+    @brief read the vectors from a reduced precision copy of the matrix from now on
+    @remark the graph can not be built any more after this
+    */
+    void set_data(const CompactMat* cdata_l);
+
+    /// bytes used by the links of the graph in memory
+    long bytes() const;
+
+    /**
+    @brief write the links of the graph to 'file'
+    */
+    void write2Disk(string file);
+
+    /**
+    @brief load the links of the graph from 'file'
+    @return false if the file does not exist or was not built for a n x d matrix
+    */
+    bool loadFromDisk(string file);
+
+private:
+
+    /// the indexed matrix. size of n x d
+    const float* data;
+    /// reduced precision copy of the matrix, used instead of data when not NULL
+    const CompactMat* cdata;
+    /// number of rows
+    int n;
+    /// dimension
+    int d;
+    /// number of links per node on upper layers
+    int M;
+    /// top layer of the graph
+    int max_level;
+    /// node to start searching from
+    int entry;
+    /// level of each node. size of n
+    vector<int> level;
+    /// links[i][l] keeps the neighbours of node i on layer l
+    vector< vector< vector<int> > > links;
+    /// seed for random_level. fixed, so that the same codebook always gives the same graph
+    unsigned int seed;
+    /// tags of the threads not searching now. a search takes one and gives it back
+    mutable vector<visit_tags*> free_tags;
+    mutable pthread_mutex_t tags_mutex;
+
+    /// visit tags for a search, reused from an earlier one when possible
+    visit_tags* take_tags() const;
+
+    /// give back the tags of a finished search
+    void give_tags(visit_tags* tags) const;
+
+    /// distance between query q and row i
+    float dist_to(const float* q, int i) const;
+
+    /// beam search of width ef on layer 'layer', starting from 'ep', marking the nodes visited in 'tags'.
+    /// results come out nearest first
+    void search_layer(const float* q, int ep, int ef, int layer, visit_tags* tags, vector< std::pair<float, int> >& out) const;
+
+    /// keep at most 'max_links' diverse neighbours out of 'cand', which is sorted nearest first
+    void select_neighbours(vector< std::pair<float, int> >& cand, int max_links) const;
+
+    /// random level of a newly inserted node
+    int random_level();
+};
+
+#endif // HNSW_H_INCLUDED
@@ -0,0 +1,200 @@
+/**
+@file HammingEmbed.cpp
+@brief this file implements the Hamming embedding defined in HammingEmbed.h
+*/
+#include <cmath>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#include "HammingEmbed.h"
+#include "util.h"
+#include "IO.h"
+
+using std::vector;
+
+
+HammingEmbed::HammingEmbed(int nbits_l, int d_l)
+{
+    nbits = nbits_l;
+    d = d_l;
+    ncell = 0;
+    assert(nbits > 0 && nbits <= 32 && nbits <= d);
+    proj = new float[nbits*d];
+    median = NULL;
+    thresh = NULL;
+}
+
+HammingEmbed::~HammingEmbed()
+{
+    delete[] proj;
+    delete[] median;
+    delete[] thresh;
+}
+
+void HammingEmbed::random_projection()
+{
+    // gaussian rows made orthonormal by Gram-Schmidt. the seed is fixed, so that a training is repeatable
+    unsigned int seed = 12345;
+    for(int i = 0; i < nbits; i++)
+    {
+        float* p = proj + i*d;
+        float norm = 0.0f;
+        while(norm < 1e-6f)
+        {
+            for(int j = 0; j < d; j++)
+            {
+                double u1 = (rand_r(&seed) + 1.0) / (RAND_MAX + 2.0);
+                double u2 = (rand_r(&seed) + 1.0) / (RAND_MAX + 2.0);
+                p[j] = (float)(sqrt(-2.0*log(u1)) * cos(2*M_PI*u2));
+            }
+            for(int k = 0; k < i; k++)
+            {
+                float ip = Util::dot(p, proj + k*d, d);
+                for(int j = 0; j < d; j++)
+                    p[j] -= ip * proj[k*d + j];
+            }
+            norm = sqrt(Util::dot(p, p, d));
+        }
+        for(int j = 0; j < d; j++)
+            p[j] /= norm;
+    }
+}
+
+void HammingEmbed::train(const float* residual, const int* cells, int n, int ncell_l, string p_mat)
+{
+    ncell = ncell_l;
+    int row = 0, col = 0;
+    bool loaded = false;
+    if(IO::f_exists(p_mat))
+    {
+        float* mat = IO::loadFMat(p_mat, row, col, -1);
+        loaded = (row >= nbits && col == d);
+        if(loaded)
+            memcpy(proj, mat, sizeof(float)*nbits*d);
+        else
+            printf("%s is %d x %d instead of %d x %d, a random projection is drawn.\n", p_mat.c_str(), row, col, nbits, d);
+        delete[] mat;
+    }
+    if(!loaded)
+        random_projection();
+
+    // projections of the residuals, grouped by bit and by cell
+    vector< vector<float> > by_cell(ncell);
+    vector<float> all((long)n*nbits);
+    float* pr = new float[nbits];
+    for(int i = 0; i < n; i++)
+    {
+        project(residual + (long)i*d, pr);
+        for(int b = 0; b < nbits; b++)
+            all[(long)b*n + i] = pr[b];
+        by_cell[cells[i]].insert(by_cell[cells[i]].end(), pr, pr + nbits);
+    }
+    delete[] pr;
+
+    float* global = new float[nbits];
+    for(int b = 0; b < nbits; b++)
+    {
+        vector<float>::iterator first = all.begin() + (long)b*n, mid = first + n/2;
+        std::nth_element(first, mid, first + n);
+        global[b] = (n > 0) ? *mid : 0.0f;
+    }
+
+    delete[] median;
+    median = new float[ncell*nbits];
+    vector<float> v;
+    int empty = 0;
+    for(int c = 0; c < ncell; c++)
+    {
+        int m = by_cell[c].size() / nbits;
+        empty += (m == 0);
+        for(int b = 0; b < nbits; b++)
+        {
+            if(m == 0)
+            {
+                median[c*nbits + b] = global[b];
+                continue;
+            }
+            v.resize(m);
+            for(int i = 0; i < m; i++)
+                v[i] = by_cell[c][i*nbits + b];
+            std::nth_element(v.begin(), v.begin() + m/2, v.end());
+            median[c*nbits + b] = v[m/2];
+        }
+    }
+    delete[] global;
+    printf("Hamming embedding of %d bits trained on %d residuals, %d of %d cells without residual.\n", nbits, n, empty, ncell);
+}
+
+void HammingEmbed::write2Disk(string dir)
+{
+    IO::writeMat(proj, nbits, d, dir + "he.proj");
+    IO::writeMat(median, ncell, nbits, dir + "he.median");
+}
+
+bool HammingEmbed::loadFromDisk(string dir, int ncell_l)
+{
+    if(!IO::f_exists(dir + "he.proj") || !IO::f_exists(dir + "he.median"))
+        return false;
+    int row, col;
+    float* p = IO::loadFMat(dir + "he.proj", row, col, -1);
+    bool ok = (row == nbits && col == d);
+    if(ok)
+        memcpy(proj, p, sizeof(float)*nbits*d);
+    delete[] p;
+    float* m = IO::loadFMat(dir + "he.median", row, col, -1);
+    ok = ok && (row == ncell_l && col == nbits);
+    if(!ok)
+    {
+        delete[] m;
+        return false;
+    }
+    ncell = ncell_l;
+    delete[] median;
+    median = m;
+    return true;
+}
+
+unsigned int HammingEmbed::sign(const float* residual, int cell) const
+{
+    unsigned int sig = 0;
+    const float* m = median + cell*nbits;
+    for(int b = 0; b < nbits; b++)
+        if(Util::dot(proj + b*d, residual, d) > m[b])
+            sig |= 1u << b;
+    return sig;
+}
+
+void HammingEmbed::project(const float* q, float* out) const
+{
+    for(int b = 0; b < nbits; b++)
+        out[b] = Util::dot(proj + b*d, q, d);
+}
+
+void HammingEmbed::set_center(int cell, const float* center)
+{
+    if(thresh == NULL)
+        thresh = new float[ncell*nbits];
+    float* t = thresh + cell*nbits;
+    project(center, t);
+    for(int b = 0; b < nbits; b++)
+        t[b] += median[cell*nbits + b];
+}
+
+unsigned int HammingEmbed::sign_projected(const float* pq, int cell) const
+{
+    unsigned int sig = 0;
+    const float* t = thresh + cell*nbits;
+    for(int b = 0; b < nbits; b++)
+        if(pq[b] > t[b])
+            sig |= 1u << b;
+    return sig;
+}
+
+long HammingEmbed::bytes() const
+{
+    return sizeof(float) * ((long)nbits*d + (long)ncell*nbits*(thresh != NULL ? 2 : 1));
+}
@@ -0,0 +1,92 @@
+/**
+@file HammingEmbed.h
+@brief This file defines the Hamming embedding of the residuals: a binary signature per indexed vector,
+compared with the signature of the query to skip most entries of a list before their ADC score.
+*/
+
+#ifndef HAMMINGEMBED_H_INCLUDED
+#define HAMMINGEMBED_H_INCLUDED
+
+#include <string>
+
+using std::string;
+
+
+/**
+Bit i of the signature of a residual r in cell c is set when <p_i, r> is above the median of the
+training residuals of c, p_i being row i of an orthogonal projection. The query q gets its signature
+for cell c from the same test, written as <p_i, q> > <p_i, c> + median: <p_i, q> is computed once
+per query and the thresholds of each cell once at load, see set_center().
+@brief Hamming embedding of the residuals of a coarse codebook
+*/
+class HammingEmbed
+{
+public:
+
+    /**
+    @brief constructor. the embedding is empty until train() or loadFromDisk()
+    @param nbits number of bits of a signature, at most 32 and d
+    @param d dimension of the vectors
+    */
+    HammingEmbed(int nbits, int d);
+
+    ~HammingEmbed();
+
+    /**
+    @brief learn the medians of the projected residuals of each cell
+    @param residual the training residuals. size of n x d
+    @param cells the cell of each residual. size of n
+    @param ncell number of cells of the coarse codebook. the cells without residual get the medians of all of them
+    @param p_mat file of the nbits x d projection. a random orthogonal one is drawn when it does not exist
+    */
+    void train(const float* residual, const int* cells, int n, int ncell, string p_mat);
+
+    /**
+    @brief write the projection and the medians to dir/he.proj and dir/he.median
+    */
+    void write2Disk(string dir);
+
+    /**
+    @brief load the projection and the medians written by write2Disk
+    @return false if the files do not exist or were not trained for nbits x d and ncell cells
+    */
+    bool loadFromDisk(string dir, int ncell);
+
+    /// signature of the residual of a vector against the centroid of 'cell', on the index side
+    unsigned int sign(const float* residual, int cell) const;
+
+    /// projection of a query q on the nbits rows. out is size of nbits
+    void project(const float* q, float* out) const;
+
+    /**
+    @brief set the thresholds of the query side for 'cell'
+    @param center the centroid of the cell. size of d
+    */
+    void set_center(int cell, const float* center);
+
+    /// signature of a query for 'cell', from its projection pq. needs set_center() of the cell
+    unsigned int sign_projected(const float* pq, int cell) const;
+
+    /// number of bits of a signature
+    int get_nbits() const { return nbits; }
+
+    /// bytes used by the projection, the medians and the thresholds in memory
+    long bytes() const;
+
+private:
+
+    int nbits;
+    int d;
+    int ncell;
+    /// the projection. size of nbits x d
+    float* proj;
+    /// median of the projected residuals of each cell. size of ncell x nbits
+    float* median;
+    /// projection of the centroid of each cell plus its median, NULL till set_center(). size of ncell x nbits
+    float* thresh;
+
+    /// draw a random nbits x d projection with orthonormal rows
+    void random_projection();
+};
+
+#endif // HAMMINGEMBED_H_INCLUDED
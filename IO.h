@@ -190,11 +190,14 @@ public:
 	@param d cols of the matrix
 	@param file file name of the matrix to write
 	@return void
+	@remark the matrix is written to 'file.tmp' first and then renamed to 'file'
 	*/
     static void writeMat(float* mat, int n, int d, std::string file)
     {
-        FILE* fout = fopen(file.c_str(), "wb");
-        chkFileErr(fout, file);
+        // write aside and rename, so that an interrupted write never leaves a truncated matrix
+        string tmp = file + ".tmp";
+        FILE* fout = fopen(tmp.c_str(), "wb");
+        chkFileErr(fout, tmp);
 
         fwrite(&n, sizeof(int), 1, fout);
         fwrite(&d, sizeof(int), 1, fout);
@@ -202,6 +205,7 @@ public:
         fwrite(mat, sizeof(float), n*d, fout);
 
         fclose(fout);
+        rename(tmp.c_str(), file.c_str());
     }
 
 	/**
@@ -215,8 +219,10 @@ public:
 	*/
     static void writeMat(int* mat, int n, int d, std::string file)
     {
-        FILE* fout = fopen(file.c_str(), "wb");
-        chkFileErr(fout, file);
+        // write aside and rename, so that an interrupted write never leaves a truncated matrix
+        string tmp = file + ".tmp";
+        FILE* fout = fopen(tmp.c_str(), "wb");
+        chkFileErr(fout, tmp);
 
         fwrite(&n, sizeof(int), 1, fout);
         fwrite(&d, sizeof(int), 1, fout);
@@ -224,6 +230,7 @@ public:
         fwrite(mat, sizeof(int), n*d, fout);
 
         fclose(fout);
+        rename(tmp.c_str(), file.c_str());
     }
 
 
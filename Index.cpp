@@ -2,7 +2,34 @@
 #include <fstream>
 using std::fstream;
 
-void Index::indexFiles(Vocab* voc, PQCluster* rvoc, string feat_dir, string file_extn, string idx_dir, int nt, int coarsek )
+void Index::indexFiles(Vocab* voc, ResidualCodec* rvoc, string feat_dir, string file_extn, string idx_dir, int nt, int coarsek, int refine_fmt, HammingEmbed* he)
+{
+    index_all(voc, NULL, rvoc, feat_dir, idx_dir, nt, coarsek, refine_fmt, he);
+}
+
+void Index::indexFiles(MultiVocab* mvoc, ResidualCodec* rvoc, string feat_dir, string file_extn, string idx_dir, int nt, int refine_fmt)
+{
+    index_all(NULL, mvoc, rvoc, feat_dir, idx_dir, nt, mvoc->num_leaf, refine_fmt, NULL);
+}
+
+int Index::entry_size(const ResidualCodec* rvoc)
+{
+    return rvoc->code_size() + (con.metric == METRIC_IP);
+}
+
+void Index::write_refine(const float* feature, int n, int d, int fmt, string idx_dir)
+{
+    printf("Storing the vectors in %s to re-rank the results.\n", CompactMat::fmt_name(fmt).c_str());
+    if(fmt == FMT_FP32)
+        IO::writeMat((float*)feature, n, d, idx_dir + "refine");
+    else
+    {
+        CompactMat mat(feature, n, d, fmt);
+        mat.write2Disk(idx_dir + "refine." + CompactMat::fmt_name(fmt));
+    }
+}
+
+void Index::index_all(Vocab* voc, MultiVocab* mvoc, ResidualCodec* rvoc, string feat_dir, string idx_dir, int nt, int voc_size, int refine_fmt, HammingEmbed* he)
 {
     // generate index directory and empty files.
     IO::mkdir(idx_dir);
@@ -10,11 +37,24 @@ void Index::indexFiles(Vocab* voc, PQCluster* rvoc, string feat_dir, string file
     string nl_file  = idx_dir + "nl"; // index object name file
     string idx_sz   = idx_dir + "voc_sz";   // index object size file
 
+    // the refine vectors and signatures of an earlier run follow its order of the entries, and the search
+    // only checks their count: remove them, this run writes its own if it has any
+    vector<string> stale = IO::getFileList(idx_dir, "refine", 0, 0);
+    for(unsigned int i = 0; i < stale.size(); i++)
+        IO::rm(stale[i]);
+    IO::rm(idx_dir + "sig");
 
     printf("Indexing files: \"%s\"\n", feat_dir.c_str());
     FILE* fout_idx = fopen(idx_file.c_str(), "wb");
     FILE* fout_nl  = fopen(nl_file.c_str(), "w");
     assert(fout_idx && fout_nl);
+    // one signature per entry, next to the index so that an index without them is still searched
+    FILE* fout_sig = NULL;
+    if(he != NULL)
+    {
+        fout_sig = fopen((idx_dir + "sig").c_str(), "wb");
+        IO::chkFileErr(fout_sig, idx_dir + "sig");
+    }
 
 
     int tot_ims = 0;
@@ -33,124 +73,193 @@ void Index::indexFiles(Vocab* voc, PQCluster* rvoc, string feat_dir, string file
     // write total number of index images to index file.
     fwrite(&tot_ims, sizeof(int), 1, fout_idx);
     fprintf(fout_nl, "%d\n", tot_ims);
+    if(fout_sig != NULL)
+        fwrite(&tot_ims, sizeof(int), 1, fout_sig);
 
 
-    index_args args = {dim, feature, namelist, voc, rvoc, fout_idx, fout_nl};
-    MultiThd::compute_tasks(tot_ims, nt, &index_task, &args);
+    // squared norms of the coarse centroids for the blocked nearest-centroid search
+    float* coarse_norms = NULL;
+    if(mvoc != NULL)
+    {
+        coarse_norms = new float[2*mvoc->k];
+        for(int h = 0; h < 2; h++)
+            Util::sq_norms(mvoc->centroid(h, 0), mvoc->k, mvoc->hd, mvoc->hd, coarse_norms + h*mvoc->k);
+    }
+    else if(voc->l == 1 && voc->cvec == NULL)
+    {
+        coarse_norms = new float[voc->k];
+        Util::sq_norms(voc->leaf(0), voc->k, dim, dim, coarse_norms);
+        // without the norms, the nearest centroid is the one of largest inner product
+        if(con.metric == METRIC_IP)
+            memset(coarse_norms, 0, sizeof(float)*voc->k);
+    }
+
+    int nsq = rvoc->code_size();
+    int es = entry_size(rvoc);
+    float* residual_buf = new float[nt*block*dim];
+    int* cell_buf = new int[nt*block];
+    unsigned int* code_buf = new unsigned int[nt*block*nsq];
+    unsigned int* rec_buf = new unsigned int[nt*block*(es+2)];
+    unsigned int* sig_buf = new unsigned int[nt*block];
+
+    int num_blocks = (tot_ims + block - 1) / block;
+    int* written = new int[num_blocks];
+    index_args args = {dim, feature, namelist, voc, mvoc, rvoc, he, fout_idx, fout_sig, fout_nl, 0, tot_ims, coarse_norms,
+                       residual_buf, cell_buf, code_buf, rec_buf, sig_buf, written, 0};
+    MultiThd::compute_tasks(num_blocks, nt, &index_task, &args);
     printf("\n");
 
+    if(refine_fmt >= 0)
+    {
+        // the ids of the index follow the order the blocks were written in, and so do the refine vectors
+        float* ordered = new float[(long)tot_ims*dim];
+        long row = 0;
+        for(int b = 0; b < num_blocks; b++)
+        {
+            int n = std::min(block, tot_ims - written[b]);
+            memcpy(ordered + row*dim, feature + (long)written[b]*dim, sizeof(float)*n*dim);
+            row += n;
+        }
+        write_refine(ordered, tot_ims, dim, refine_fmt, idx_dir);
+        delete[] ordered;
+    }
+    delete[] written;
+
+    delete[] coarse_norms;
+    delete[] residual_buf;
+    delete[] cell_buf;
+    delete[] code_buf;
+    delete[] rec_buf;
+    delete[] sig_buf;
+    delete[] feature;
+
     fclose(fout_idx);
     fclose(fout_nl);
+    if(fout_sig != NULL)
+        fclose(fout_sig);
     for(unsigned int i=0; i < namelist.size(); i++)
     {
         delete namelist[i];
     }
 
-    gen_idx_sz_file(idx_file, idx_sz, coarsek, rvoc->get_nsq());
+    gen_idx_sz_file(idx_file, idx_sz, voc_size, es);
 }
 
 
 void Index::index_task(void* args, int tid, int i, pthread_mutex_t& mutex)
 {
-
-    //std::cout << "enter index task fun..." << std::endl;
     index_args* arguments = (index_args*) args;
-    string filename = *(arguments->namelist[i]);
-    float* feature = i*arguments->dim+arguments->feature;
-    //string shortname = Util::parseFileName(filename);
-    string shortname = filename;
-    std::cout << "\nshortname:" << shortname << std::endl;
-
-    int m = 0, n = 1, d=0;
-    d = arguments->dim;
-
-    //std::cout << "m:" << m << "n:" << n << "d:" << d << std::endl;
-
-    unsigned int* quanti_result = new unsigned int;
-    int* residual_result = new int[arguments->rvoc->get_nsq()];
-
-    //std::cout << "quantize coarse vector..." << std::endl;
-    arguments->voc->quantize2leaf(feature, (int*)(quanti_result), n, m);
-
-    //std::cout << "calculate residual vectors..." << std::endl;
-    float* residual_vec = new float[n*(d)];  
-    for(int x=0;x<d;x++)
+    int d = arguments->dim;
+    ResidualCodec* rvoc = arguments->rvoc;
+    int nsq = rvoc->code_size();
+    int es = entry_size(rvoc);
+    int start = i*block;
+    int n = std::min(block, arguments->n - start);
+    float* feature = arguments->feature + start*d;
+
+    // buffers of this thread
+    float* residual = arguments->residual_buf + tid*block*d;
+    int* cells = arguments->cell_buf + tid*block;
+    unsigned int* codes = arguments->code_buf + tid*block*nsq;
+    unsigned int* rec = arguments->rec_buf + tid*block*(es+2);
+    unsigned int* sig = arguments->sig_buf + tid*block;
+
+    // coarse assignment of the block and residuals against the assigned centroids
+    if(arguments->mvoc != NULL)
     {
-        residual_vec[x] =*(feature+x) - *(arguments->voc->vec+*(quanti_result)+x);
+        MultiVocab* mvoc = arguments->mvoc;
+        int* cells1 = (int*)codes; // codes are not computed yet, borrow them for the second half
+        Util::nearest(feature, n, d, mvoc->centroid(0, 0), arguments->coarse_norms, mvoc->k, mvoc->hd, cells, NULL);
+        Util::nearest(feature + mvoc->hd, n, d, mvoc->centroid(1, 0), arguments->coarse_norms + mvoc->k, mvoc->k, mvoc->hd, cells1, NULL);
+        for(int j = 0; j < n; j++)
+        {
+            cells[j] = cells[j]*mvoc->k + cells1[j];
+            mvoc->residual(feature + j*d, cells[j], residual + j*d);
+        }
+    }
+    else
+    {
+        Vocab* voc = arguments->voc;
+        if(arguments->coarse_norms != NULL)
+            Util::nearest(feature, n, d, voc->leaf(0), arguments->coarse_norms, voc->k, d, cells, NULL);
+        else
+            voc->quantize2leaf(feature, cells, n, 0);
+
+        for(int j = 0; j < n; j++)
+            voc->residual(feature + j*d, cells[j], residual + j*d);
     }
 
-    //std::cout << "quantize residual vector..." << std::endl;
-    arguments->rvoc->quantize2leaf(residual_vec, residual_result, n);
+    // codes of the residuals of the whole block
+    rvoc->encode(residual, n, codes);
+    for(int j = 0; j < n && arguments->he != NULL; j++)
+        sig[j] = arguments->he->sign(residual + j*d, cells[j]);
+
+    // records in the layout of the index file: [number of entries = 1] [Entry: word id, code]
+    // with METRIC_IP, followed by 1/|c + b|: the centroid c is the feature minus its residual, and
+    // |c + b|^2 = |c|^2 + 2<c, b> + |b|^2 is read from the codec as for a query
+    float* center = (es > nsq) ? new float[d] : NULL;
+    float* prepared = (es > nsq) ? new float[(rvoc->query_bytes() + 3) / 4] : NULL;
+    for(int j = 0; j < n; j++)
+    {
+        unsigned int* r = rec + j*(es+2);
+        r[0] = 1;
+        r[1] = cells[j];
+        for(int x = 0; x < nsq; x++)
+            r[x+2] = codes[j*nsq + x];
+        if(center == NULL)
+            continue;
+        for(int x = 0; x < d; x++)
+            center[x] = feature[j*d + x] - residual[j*d + x];
+        rvoc->prepare(center, prepared);
+        float n2 = Util::dot(center, center, d) + 2*rvoc->ip(prepared, codes + j*nsq) + rvoc->norm2(codes + j*nsq);
+        float inv = (n2 > 0.0000001) ? 1.0f / sqrt(n2) : 0.0f;
+        memcpy(r + nsq + 2, &inv, sizeof(float));
+    }
+    delete[] center;
+    delete[] prepared;
 
-    //std::cout << "construct entry list..." << std::endl;
-    Entry* entrylist = new Entry;
-    entrylist->set(*(quanti_result), arguments->rvoc->get_nsq(), (unsigned int*)residual_result);
-    entrylist->print();
-    //std::cout << "write sync to idx file..." << std::endl`;
     /// write sync
     pthread_mutex_lock (&mutex);
-    fwrite(&n, sizeof(int), 1, arguments->fout_idx);
-    entrylist->write(arguments->fout_idx);
-
-
-    //std::cout << "write to nl..." << std::endl;
-    fprintf(arguments->fout_nl, "%s\n", shortname.c_str());
+    fwrite(rec, sizeof(unsigned int), n*(es+2), arguments->fout_idx);
+    if(arguments->fout_sig != NULL)
+        fwrite(sig, sizeof(unsigned int), n, arguments->fout_sig);
+    for(int j = 0; j < n; j++)
+        fprintf(arguments->fout_nl, "%s\n", arguments->namelist[start + j]->c_str());
+    arguments->written[arguments->num_written++] = start;
+    printf("\r%d ", start + n); fflush(stdout);
     pthread_mutex_unlock(&mutex);
     /// end of write sync
-
-    //std::cout << "delete new space..." << std::endl;
-    delete entrylist;
-    delete quanti_result;
-    delete[] residual_vec;
-
-    //std::cout << "prepare existing..." << std::endl;
-    if ( (i+1) % 10 == 0)
-    {
-        pthread_mutex_lock (&mutex);
-        printf("\r%d ", i+1); fflush(stdout);
-        pthread_mutex_unlock(&mutex);
-    }
-    //std::cout << "exist function Index.." << std::endl;
 }
 
-void Index::gen_idx_sz_file(string idx_file, string idx_sz, int voc_size, int nsq)
+void Index::gen_idx_sz_file(string idx_file, string idx_sz, int voc_size, int code_size)
 {
     // reconstruct the inverted index.
     FILE* fin_idx = fopen(idx_file.c_str(), "rb");
     IO::chkFileErr(fin_idx, idx_file);
 
-    vector< vector<Entry> > index(voc_size);
+    // only the sizes of the lists are kept, the codes of each entry are read into the same buffer
+    int* sz = new int[voc_size];
+    memset(sz, 0, sizeof(int)*voc_size);
+    unsigned int* code = new unsigned int[code_size];
 
     int num_entries, tot_ims;
     assert( 1 == fread(&tot_ims, sizeof(int), 1, fin_idx) );
 
-    Entry* entry = new Entry(nsq);
+    Entry entry(code_size);
     for(int i = 0; i < tot_ims; i++) // i-th image
     {
         assert( 1 == fread(&num_entries, sizeof(int), 1, fin_idx) );
         for(int j = 0; j < num_entries; j++) // j-th entry
         {
-            entry->read(fin_idx);
-            int word_id = entry->id;
-
-            entry->id = i;
-
-            index[word_id].push_back(*entry); // push_back will make a copy of entry
+            entry.read(fin_idx, code);
+            sz[entry.id]++;
         }
     }
     fclose(fin_idx);
 
-
-    int* sz = new int[voc_size];
-    for(unsigned int i = 0; i < voc_size; i++)
-        sz[i] = index[i].size();
-
     IO::writeMat(sz, voc_size, 1, idx_sz);
 
-    for(unsigned int i = 0; i < index.size(); i++)
-        index[i].clear();
-    index.clear();
-
+    delete[] code;
     delete[] sz;
 }
 
@@ -15,9 +15,11 @@
 #include <iostream>
 
 #include "Vocab.h"
+#include "MultiVocab.h"
 #include "IO.h"
 #include "entry.h"
-#include "PQCluster.h"
+#include "ResidualCodec.h"
+#include "HammingEmbed.h"
 #include "MultiThd.h"
 
 using std::string;
@@ -34,12 +36,38 @@ struct index_args
     vector<string*>& namelist;   
     /// vocabulary used to quantize feature
     Vocab* voc;                 
-    PQCluster* rvoc;
+    /// multi-index used to quantize feature instead of voc, NULL if not used
+    MultiVocab* mvoc;
+    /// codes of the residuals
+    ResidualCodec* rvoc;
+    /// Hamming embedding of the residuals, NULL if the entries have no signature
+    HammingEmbed* he;
     /// file to write the index
     FILE* fout_idx;             
+    /// file to write the signatures, in the order of the entries of the index. NULL without he
+    FILE* fout_sig;
     /// file to write the name list
     FILE* fout_nl;
     int     w;
+    /// number of features to index
+    int n;
+    /// squared norm of each coarse centroid (both halves for the multi-index), NULL for hierarchical voc
+    float* coarse_norms;
+
+    // per-thread buffers, 'block' rows for each thread
+    /// residuals of the block. size of nt x block x dim
+    float* residual_buf;
+    /// coarse cell of each feature of the block. size of nt x block
+    int* cell_buf;
+    /// codes of the block. size of nt x block x code_size
+    unsigned int* code_buf;
+    /// records of the block as written to the index file. size of nt x block x (entry_size+2)
+    unsigned int* rec_buf;
+    /// signatures of the block. size of nt x block
+    unsigned int* sig_buf;
+    /// first feature of each block, in the order the blocks are written. size of number of blocks
+    int* written;
+    int num_written;
 };
 
 
@@ -48,27 +76,59 @@ class Index
 {
 public:
 
+    /// number of features encoded together by one task
+    static const int block = 256;
+
     /**
     @brief index the files in directory of 'feat_dir' using vocabulary voc
     @param voc pointer to vocab using
+    @param rvoc codes of the residuals
     @param feat_dir directory name
     @param file_extn this function will index all files under 'feat_dir' which ends with 'file_extn'
     @param idx_dir output location of index files
     @param nt number of cpus to use
+    @param refine_fmt format of the vectors stored aside to re-rank the results, see CompactMat.h. -1 to store none
+    @param he Hamming embedding of the residuals, their signatures go to 'idx_dir'/sig. NULL to write none
     @return void
     */
 
-    static void indexFiles(Vocab* voc, PQCluster* rvoc, string feat_dir, string file_extn, string idx_dir, int nt, int coarsek );
+    static void indexFiles(Vocab* voc, ResidualCodec* rvoc, string feat_dir, string file_extn, string idx_dir, int nt, int coarsek, int refine_fmt, HammingEmbed* he);
+
+    /**
+    @brief index the files in directory of 'feat_dir' using the inverted multi-index mvoc
+    @param mvoc pointer to multi-index using
+    @remark the rest of parameters are the same as above. the index holds mvoc->num_leaf lists.
+    */
+    static void indexFiles(MultiVocab* mvoc, ResidualCodec* rvoc, string feat_dir, string file_extn, string idx_dir, int nt, int refine_fmt);
+
+	/**
+	with METRIC_IP the code is followed by 1/|c + b| as a float, c being the centroid of the cell of the entry
+	and b the reconstruction of its code, for the score to be the cosine with c + b
+	@brief number of unsigned ints of an entry of the index after its cell
+	*/
+    static int entry_size(const ResidualCodec* rvoc);
 private:
 
 	/**
-	@brief helper function for indexFiles. Index one file.
+	@brief shared implementation of indexFiles. exactly one of voc and mvoc is not NULL.
+	*/
+    static void index_all(Vocab* voc, MultiVocab* mvoc, ResidualCodec* rvoc, string feat_dir, string idx_dir, int nt, int voc_size, int refine_fmt, HammingEmbed* he);
+
+	/**
+	fp32 vectors go to 'idx_dir'/refine, in the layout of IO::writeMat, the others to 'idx_dir'/refine.<fmt>
+	written by CompactMat. row i is the i-th vector of the name list.
+	@brief store the normalized vectors of the index to re-rank the results
+	*/
+    static void write_refine(const float* feature, int n, int d, int fmt, string idx_dir);
+
+	/**
+	@brief helper function for indexFiles. Index the i-th block of features.
 	*/
     static void index_task(void* args, int tid, int i, pthread_mutex_t& mutex);
 
 	/**
 	@brief generate aux files for the index
 	*/
-    static void gen_idx_sz_file(string idx_file, string idx_sz, int voc_size, int nsq);
+    static void gen_idx_sz_file(string idx_file, string idx_sz, int voc_size, int code_size);
 };
 #endif // INDEX_H_INCLUDED
@@ -0,0 +1,283 @@
+/**
+@file Latency.h
+@brief This file defines the per-query latency instrumentation of the search: a cheap monotonic
+clock, HDR-style histograms, and the statistics of the search stages reported as JSON.
+*/
+
+#ifndef LATENCY_H_INCLUDED
+#define LATENCY_H_INCLUDED
+
+#include <string>
+#include <sstream>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <pthread.h>
+
+using std::string;
+
+/// stages of the search of one query
+enum
+{
+    STAGE_COARSE = 0,   ///< selection of the cells to scan
+    STAGE_TABLES,       ///< distance tables of the query residuals
+    STAGE_SCAN,         ///< scoring of the codes of the lists
+    STAGE_TOPK,         ///< selection of the best results
+    STAGE_RERANK,       ///< re-scoring of the best results with the refined vectors
+    STAGE_OUTPUT,       ///< writing of the results
+    STAGE_TOTAL,        ///< the whole query
+    NUM_STAGES
+};
+
+static const char* const stage_names[NUM_STAGES] = {"coarse", "tables", "scan", "topk", "rerank", "output", "total"};
+
+
+/// monotonic clock in nanoseconds
+inline long clock_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+/**
+Values below 32 have a bucket each, above that every power of 2 is split into 16 buckets, so a
+percentile is read within 1/16 of its value whatever the range, in a fixed 8 KB of counters.
+@brief HDR-style histogram of non-negative integers
+*/
+class LatencyHistogram
+{
+public:
+
+    LatencyHistogram()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        memset(count, 0, sizeof(count));
+        tot = 0;
+        sum = 0.0;
+        vmin = 0;
+        vmax = 0;
+    }
+
+    void add(long v)
+    {
+        if(v < 0)
+            v = 0;
+        count[bucket(v)]++;
+        if(tot == 0 || v < vmin)
+            vmin = v;
+        if(v > vmax)
+            vmax = v;
+        tot++;
+        sum += v;
+    }
+
+    void merge(const LatencyHistogram& h)
+    {
+        for(int b = 0; b < num_buckets; b++)
+            count[b] += h.count[b];
+        if(h.tot > 0 && (tot == 0 || h.vmin < vmin))
+            vmin = h.vmin;
+        if(h.vmax > vmax)
+            vmax = h.vmax;
+        tot += h.tot;
+        sum += h.sum;
+    }
+
+    long size() const { return tot; }
+    double mean() const { return tot > 0 ? sum / tot : 0.0; }
+    long max() const { return vmax; }
+
+    /// the value at percentile p (0..100): the highest value of its bucket, capped by the max
+    long percentile(double p) const
+    {
+        if(tot == 0)
+            return 0;
+        long rank = (long)(p / 100.0 * tot + 0.999999);
+        if(rank < 1)
+            rank = 1;
+        long seen = 0;
+        for(int b = 0; b < num_buckets; b++)
+        {
+            seen += count[b];
+            if(seen >= rank)
+                return std::min(highest(b), vmax);
+        }
+        return vmax;
+    }
+
+    /**
+    @brief JSON object with the count, mean, p50, p95, p99, p999 and max
+    @param scale the values are divided by it, e.g. 1000 for ns to us
+    */
+    string json(double scale) const
+    {
+        std::ostringstream os;
+        os.precision(6);
+        os << "{\"count\": " << tot
+           << ", \"mean\": " << mean() / scale
+           << ", \"p50\": " << percentile(50) / scale
+           << ", \"p95\": " << percentile(95) / scale
+           << ", \"p99\": " << percentile(99) / scale
+           << ", \"p999\": " << percentile(99.9) / scale
+           << ", \"max\": " << vmax / scale << "}";
+        return os.str();
+    }
+
+private:
+
+    static const int linear = 32;
+    static const int sub = 16;
+    static const int num_buckets = linear + (63 - 5 + 1) * sub;
+
+    long count[num_buckets];
+    long tot;
+    double sum;
+    long vmin, vmax;
+
+    static int bucket(long v)
+    {
+        if(v < linear)
+            return (int)v;
+        int msb = 63 - __builtin_clzl((unsigned long)v);
+        int m = (int)(v >> (msb - 4)); // the 5 leading bits, 16..31
+        return linear + (msb - 5) * sub + (m - sub);
+    }
+
+    static long highest(int b)
+    {
+        if(b < linear)
+            return b;
+        int msb = (b - linear) / sub + 5;
+        long m = (b - linear) % sub + sub;
+        return ((m + 1) << (msb - 4)) - 1;
+    }
+};
+
+
+/// timings and counters of one query
+struct query_trace
+{
+    /// time spent in each stage, in ns. -1 for the stages not measured
+    long t[NUM_STAGES];
+    /// number of inverted lists probed
+    long lists;
+    /// number of codes scored
+    long codes;
+    /// the query ran out of budget before all its cells were scanned
+    bool partial;
+
+    query_trace()
+    {
+        for(int s = 0; s < NUM_STAGES; s++)
+            t[s] = -1;
+        lists = 0;
+        codes = 0;
+        partial = false;
+    }
+
+    /// add the time since 'start' to stage s, and return the time now
+    long lap(int s, long start)
+    {
+        long now = clock_ns();
+        t[s] = (t[s] < 0 ? 0 : t[s]) + now - start;
+        return now;
+    }
+};
+
+
+/// latency and work statistics of the queries searched, safe to feed from several threads
+class SearchStats
+{
+public:
+
+    SearchStats() : partial(0)
+    {
+        pthread_mutex_init(&mutex, NULL);
+    }
+
+    ~SearchStats()
+    {
+        pthread_mutex_destroy(&mutex);
+    }
+
+    void add(const query_trace& tr)
+    {
+        pthread_mutex_lock(&mutex);
+        for(int s = 0; s < NUM_STAGES; s++)
+        {
+            if(tr.t[s] >= 0)
+                stage[s].add(tr.t[s]);
+        }
+        lists.add(tr.lists);
+        codes.add(tr.codes);
+        partial += tr.partial;
+        pthread_mutex_unlock(&mutex);
+    }
+
+    void clear()
+    {
+        pthread_mutex_lock(&mutex);
+        for(int s = 0; s < NUM_STAGES; s++)
+            stage[s].clear();
+        lists.clear();
+        codes.clear();
+        partial = 0;
+        pthread_mutex_unlock(&mutex);
+    }
+
+    /// mean number of lists probed per query
+    double mean_lists()
+    {
+        pthread_mutex_lock(&mutex);
+        double m = lists.mean();
+        pthread_mutex_unlock(&mutex);
+        return m;
+    }
+
+    /// number of queries cut by their budget
+    long num_partial()
+    {
+        pthread_mutex_lock(&mutex);
+        long n = partial;
+        pthread_mutex_unlock(&mutex);
+        return n;
+    }
+
+    /// the report: percentiles of each stage in microseconds, and of the counters per query
+    string json()
+    {
+        std::ostringstream os;
+        pthread_mutex_lock(&mutex);
+        os << "{\n  \"queries\": " << lists.size() << ",\n  \"stages_us\": {\n";
+        bool first = true;
+        for(int s = 0; s < NUM_STAGES; s++)
+        {
+            if(stage[s].size() == 0)
+                continue;
+            os << (first ? "" : ",\n") << "    \"" << stage_names[s] << "\": " << stage[s].json(1000.0);
+            first = false;
+        }
+        os << "\n  },\n";
+        os << "  \"lists_probed\": " << lists.json(1.0) << ",\n";
+        os << "  \"codes_scanned\": " << codes.json(1.0) << ",\n";
+        os << "  \"partial_queries\": " << partial << "\n}\n";
+        pthread_mutex_unlock(&mutex);
+        return os.str();
+    }
+
+private:
+
+    pthread_mutex_t mutex;
+    LatencyHistogram stage[NUM_STAGES];
+    LatencyHistogram lists;
+    LatencyHistogram codes;
+    long partial;
+};
+
+#endif // LATENCY_H_INCLUDED
@@ -0,0 +1,187 @@
+/**
+@file MPMCQueue.h
+@brief a bounded lock-free queue for many producers and many consumers, after the design of
+D. Vyukov: each slot carries a sequence number telling whether it is ready to be written or read,
+so producers and consumers only contend on their own position counter.
+*/
+
+#ifndef MPMCQUEUE_H_INCLUDED
+#define MPMCQUEUE_H_INCLUDED
+
+#include <cassert>
+#include <cerrno>
+#include <ctime>
+#include <semaphore.h>
+
+/**
+push and pop never block: push fails when the queue is full and pop when it is empty.
+The capacity is rounded up to a power of 2.
+@brief bounded lock-free MPMC queue of T, T being copyable
+*/
+template <class T>
+class MPMCQueue
+{
+public:
+
+    MPMCQueue(int capacity)
+    {
+        size = 2;
+        while(size < capacity)
+            size *= 2;
+        mask = size - 1;
+        slots = new slot[size];
+        for(int i = 0; i < size; i++)
+            slots[i].seq = i;
+        head = 0;
+        tail = 0;
+    }
+
+    ~MPMCQueue()
+    {
+        delete[] slots;
+    }
+
+    /// false if the queue is full
+    bool push(const T& v)
+    {
+        long pos = tail;
+        while(1)
+        {
+            slot* s = &slots[pos & mask];
+            long seq = __sync_fetch_and_add(&s->seq, 0); // acquire
+            long diff = seq - pos;
+            if(diff == 0) // free: take it if nobody did meanwhile
+            {
+                if(__sync_bool_compare_and_swap(&tail, pos, pos + 1))
+                {
+                    s->val = v;
+                    __sync_synchronize();
+                    s->seq = pos + 1; // ready to be read
+                    return true;
+                }
+                pos = tail;
+            }
+            else if(diff < 0) // still holds the value of the previous round
+                return false;
+            else
+                pos = tail;
+        }
+    }
+
+    /// false if the queue is empty
+    bool pop(T& v)
+    {
+        long pos = head;
+        while(1)
+        {
+            slot* s = &slots[pos & mask];
+            long seq = __sync_fetch_and_add(&s->seq, 0);
+            long diff = seq - (pos + 1);
+            if(diff == 0) // written: take it if nobody did meanwhile
+            {
+                if(__sync_bool_compare_and_swap(&head, pos, pos + 1))
+                {
+                    v = s->val;
+                    __sync_synchronize();
+                    s->seq = pos + size; // free for the next round
+                    return true;
+                }
+                pos = head;
+            }
+            else if(diff < 0)
+                return false;
+            else
+                pos = head;
+        }
+    }
+
+private:
+
+    struct slot
+    {
+        volatile long seq;
+        T val;
+    };
+
+    slot* slots;
+    long size;
+    long mask;
+    /// next position to read. kept on its own cache line, away from tail
+    char pad0[64];
+    volatile long head;
+    char pad1[64];
+    /// next position to write
+    volatile long tail;
+    char pad2[64];
+};
+
+
+/**
+The queue itself never blocks, the semaphore counts the items so that idle consumers sleep.
+@brief MPMCQueue with blocking pop
+*/
+template <class T>
+class BlockingQueue
+{
+public:
+
+    BlockingQueue(int capacity) : queue(capacity)
+    {
+        sem_init(&items, 0, 0);
+        sem_init(&space, 0, capacity);
+    }
+
+    ~BlockingQueue()
+    {
+        sem_destroy(&items);
+        sem_destroy(&space);
+    }
+
+    /// wait for room and push v
+    void push(const T& v)
+    {
+        while(sem_wait(&space) != 0) {}
+        // there is room, but the pop that made it may still be finishing
+        while(!queue.push(v)) {}
+        sem_post(&items);
+    }
+
+    /// wait for an item and pop it
+    void pop(T& v)
+    {
+        while(sem_wait(&items) != 0) {}
+        take(v);
+    }
+
+    /**
+    @brief wait for an item till 'deadline' (absolute, CLOCK_REALTIME)
+    @return false if none came in time
+    */
+    bool pop_until(T& v, const struct timespec& deadline)
+    {
+        while(sem_timedwait(&items, &deadline) != 0)
+        {
+            if(errno != EINTR)
+                return false;
+        }
+        take(v);
+        return true;
+    }
+
+private:
+
+    MPMCQueue<T> queue;
+    /// number of items in the queue
+    sem_t items;
+    /// number of free slots
+    sem_t space;
+
+    void take(T& v)
+    {
+        // the semaphore guarantees an item, but its push may still be finishing
+        while(!queue.pop(v)) {}
+        sem_post(&space);
+    }
+};
+
+#endif // MPMCQUEUE_H_INCLUDED
@@ -0,0 +1,171 @@
+/**
+@file Memory.h
+@brief This file defines the memory accounting of the search: the bytes held by each component of
+the engine (codebooks, lists, codes, names, scratch of the queries) and the report of the footprint.
+*/
+
+#ifndef MEMORY_H_INCLUDED
+#define MEMORY_H_INCLUDED
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+using std::string;
+
+/// components of the memory of the engine
+enum
+{
+    MEM_COARSE = 0,     ///< coarse codebook, fp32 or compact
+    MEM_GRAPH,          ///< HNSW links over the coarse centroids
+    MEM_PQ,             ///< residual PQ codebooks and their norms
+    MEM_LISTS,          ///< Entry arrays of the inverted lists: ids and code pointers
+    MEM_CODES,          ///< PQ codes of the entries
+    MEM_SIGS,           ///< Hamming signatures of the entries
+    MEM_NAMES,          ///< names of the indexed vectors
+    MEM_REFINE,         ///< vectors kept to re-rank the best results
+    MEM_OVERHEAD,       ///< malloc headers and rounding of the small blocks, e.g. one code per block
+    MEM_SCRATCH,        ///< buffers of the queries being searched
+    NUM_MEM
+};
+
+static const char* const mem_names[NUM_MEM] = {"coarse codebook", "hnsw graph", "pq codebooks", "lists",
+                                               "codes", "signatures", "names", "refine vectors", "malloc overhead", "scratch"};
+
+
+/**
+@brief bytes taken from the heap by a malloc of n bytes (glibc on 64 bits: 8 bytes of header, 16 aligned, 32 at least)
+*/
+inline long heap_bytes(long n)
+{
+    long b = (n + 8 + 15) & ~15L;
+    return b < 32 ? 32 : b;
+}
+
+/**
+@brief bytes of a string, with its buffer when it does not fit inside the object
+*/
+inline long string_bytes(const string& s)
+{
+    const char* p = s.data();
+    const char* obj = (const char*)&s;
+    if(p >= obj && p < obj + sizeof(string))
+        return sizeof(string);
+    return sizeof(string) + heap_bytes(s.capacity() + 1);
+}
+
+/**
+@brief resident set size of the process in bytes, read from /proc. 0 when it can not be read
+*/
+inline long process_rss()
+{
+    FILE* fin = fopen("/proc/self/status", "r");
+    if(fin == NULL)
+        return 0;
+    char line[256];
+    long kb = 0;
+    while(fgets(line, sizeof(line), fin))
+        if(strncmp(line, "VmRSS:", 6) == 0 && sscanf(line + 6, "%ld", &kb) == 1)
+            break;
+    fclose(fin);
+    return kb * 1024;
+}
+
+
+/**
+The counters are updated atomically, so that the workers of the shards and the threads
+searching can account their own allocations.
+@brief bytes held by each component, with the peak of each one
+*/
+class MemAccount
+{
+public:
+
+    MemAccount()
+    {
+        memset(cur, 0, sizeof(cur));
+        memset(peak, 0, sizeof(peak));
+    }
+
+    void add(int c, long bytes)
+    {
+        long v = __sync_add_and_fetch(&cur[c], bytes);
+        long p = peak[c];
+        while(v > p && !__sync_bool_compare_and_swap(&peak[c], p, v))
+            p = peak[c];
+    }
+
+    void sub(int c, long bytes)
+    {
+        __sync_sub_and_fetch(&cur[c], bytes);
+    }
+
+    /// a block of n bytes malloc'ed for component c, its header and rounding go to MEM_OVERHEAD
+    void alloc(int c, long n)
+    {
+        add(c, n);
+        add(MEM_OVERHEAD, heap_bytes(n) - n);
+    }
+
+    /// a block accounted by alloc() is freed
+    void release(int c, long n)
+    {
+        sub(c, n);
+        sub(MEM_OVERHEAD, heap_bytes(n) - n);
+    }
+
+    /// for components owned elsewhere and measured as a whole, like the codebooks
+    void set(int c, long bytes)
+    {
+        sub(c, cur[c]);
+        add(c, bytes);
+    }
+
+    long get(int c) const
+    {
+        return cur[c];
+    }
+
+    long get_peak(int c) const
+    {
+        return peak[c];
+    }
+
+    /// bytes held now by all the components, the scratch at its peak
+    long total() const
+    {
+        long tot = 0;
+        for(int c = 0; c < NUM_MEM; c++)
+            tot += (c == MEM_SCRATCH) ? peak[c] : cur[c];
+        return tot;
+    }
+
+    /**
+    @brief print the bytes of each component with its share of the total
+    @param n number of indexed vectors, to print the bytes per vector. ignored when 0
+    */
+    void print(long n) const
+    {
+        long tot = total();
+        printf("%-18s %14s %7s %10s\n", "memory", "bytes", "share", "per vector");
+        for(int c = 0; c < NUM_MEM; c++)
+        {
+            long b = (c == MEM_SCRATCH) ? peak[c] : cur[c];
+            printf("%-18s %14ld %6.1f%% %10.1f%s\n", mem_names[c], b, tot ? 100.0 * b / tot : 0.0,
+                   n ? (double)b / n : 0.0, (c == MEM_SCRATCH) ? " (peak)" : "");
+        }
+        printf("%-18s %14ld %6.1f%% %10.1f\n", "total", tot, 100.0, n ? (double)tot / n : 0.0);
+
+        // what the heap holds besides the accounted components: the libraries, and the leaks
+        long rss = process_rss();
+        if(rss > 0)
+            printf("%-18s %14ld, %ld not accounted\n", "process rss", rss, rss - tot);
+    }
+
+private:
+
+    long cur[NUM_MEM];
+    long peak[NUM_MEM];
+};
+
+#endif // MEMORY_H_INCLUDED
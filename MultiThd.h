@@ -1,5 +1,5 @@
 /**
-This implementation refers to some of the 
+This implementation refers to some of the
 implementations of multi-threading in YAEL: https://gforge.inria.fr/projects/yael/ from INRIA.
 @file MultiThd.h
 @brief provides utilities used for multi-threading (pthread based).
@@ -11,90 +11,344 @@ implementations of multi-threading in YAEL: https://gforge.inria.fr/projects/yae
 #define MUTITHD_MUTEX_H_INCLUDED
 
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
 #include <pthread.h>
 
+/// function that does one item of a task
+typedef void (*item_fun_t) (void *arg, int tid, int i, pthread_mutex_t& m);
+/// function that does the items [begin, end) of a task and returns their partial result
+typedef double (*range_fun_t) (void *arg, int tid, int begin, int end);
+
+
+/// chunks of a task still to be done by one thread. the owner takes from the front, thieves from the back
+struct chunk_deque
+{
+    pthread_mutex_t mutex;
+    /// chunks [begin, end) are left
+    int begin, end;
+};
+
 /// keeps the context for running multi-threading
 struct context_t
 {
-	/// the mutex
+    /// passed to the task functions, to protect shared outputs
     pthread_mutex_t mutex;
-    /// number of task, total number of task, thread id
-    int i, n, tid;
-    /// function that does one time computation
-    void (*task_fun) (void *arg, int tid, int i, pthread_mutex_t& m);
+    /// number of items, items per chunk, number of chunks
+    int n, chunk, num_chunks;
+    /// number of threads working on the task
+    int nthread;
+    /// function that does one item, when not NULL
+    item_fun_t item_fun;
+    /// function that does a range of items, when item_fun is NULL
+    range_fun_t range_fun;
     /// arguments used while computing
     void *task_arg;
+    /// partial result of each chunk of range_fun. size of num_chunks
+    double *partial;
+    /// one deque per thread. size of nthread
+    chunk_deque *deques;
 };
 
 
-/// provides utility for multi-threading programming
-class MultiThd
+/**
+Workers are created once and sleep between tasks, so a task costs a broadcast instead of
+creating and joining threads. Items are handed out by chunks: each thread starts with an even
+share of the chunks and, once its share is done, steals half of what is left to another one.
+@brief persistent pool of threads running one task at a time
+*/
+class ThreadPool
 {
 public:
-	/**
-	@brief interface to multi-threading computation
-	*/
-    static void compute_tasks (int n, int nthread, void (*task_fun) (void *arg, int tid, int i, pthread_mutex_t& m), void *task_arg)
+
+    /// the pool shared by the whole program. never destroyed: idle workers just end with the process
+    static ThreadPool* instance()
     {
-        // init context
-        context_t context;
-        context.i = 0; // i-th task
-        context.n = n; // number of task
-        context.tid = 0; // boosted thread number
-        context.task_fun = task_fun;
-        context.task_arg = task_arg;
-        pthread_mutex_init (&context.mutex, NULL);
+        static ThreadPool* pool = new ThreadPool();
+        return pool;
+    }
 
-        if(nthread==1)
-            start_routine(&context);
-        else
+    /**
+    @brief run ctx on nthread threads: the calling one is tid 0, workers are 1 ... nthread - 1
+    */
+    void run(context_t* ctx)
+    {
+        // tasks are run one at a time. a task started from inside a task runs on its caller alone
+        if(in_task() || ctx->nthread == 1)
         {
-            pthread_t *threads = new pthread_t[nthread];
+            ctx->nthread = 1;
+            init_deques(ctx);
+            work(ctx, 0);
+            free_deques(ctx);
+            return;
+        }
 
-            for (int i = 0; i < nthread; i++)
-                pthread_create (&threads[i], NULL, &start_routine, &context);
+        pthread_mutex_lock(&submit);
+        grow(ctx->nthread - 1);
+        init_deques(ctx);
 
-            /* all computing */
+        pthread_mutex_lock(&mutex);
+        task = ctx;
+        running = ctx->nthread - 1;
+        generation++;
+        pthread_cond_broadcast(&wake);
+        pthread_mutex_unlock(&mutex);
 
-            for (int i = 0; i < nthread; i++)
-                pthread_join (threads[i], NULL);
+        work(ctx, 0);
 
-            delete[] threads;
-        }
+        pthread_mutex_lock(&mutex);
+        while(running > 0)
+            pthread_cond_wait(&done, &mutex);
+        task = NULL;
+        pthread_mutex_unlock(&mutex);
+
+        free_deques(ctx);
+        pthread_mutex_unlock(&submit);
     }
 
 private:
 
-	/**
-	scheduler of the whole computation. 
-	distribute tasks to different threads one by one.
-	*/
-    static void *start_routine (void *cp)
+    /// argument of a worker thread
+    struct worker_arg
     {
-        // get context
-        context_t * context = (struct context_t*)cp;
+        ThreadPool* pool;
         int tid;
-        pthread_mutex_lock (&context->mutex);
-        tid = context->tid++;
-        pthread_mutex_unlock (&context->mutex);
+    };
 
-        while(1) // keep computing till no more item in list
+    /// serializes the tasks
+    pthread_mutex_t submit;
+    /// protects task, running and generation
+    pthread_mutex_t mutex;
+    /// signals a new task
+    pthread_cond_t wake;
+    /// signals that the workers are done with the task
+    pthread_cond_t done;
+    /// the task running, NULL between tasks
+    context_t* task;
+    /// number of workers still on the task
+    int running;
+    /// counts the tasks, so that a worker runs each one once
+    int generation;
+    std::vector<pthread_t> workers;
+
+    ThreadPool()
+    {
+        pthread_mutex_init(&submit, NULL);
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&wake, NULL);
+        pthread_cond_init(&done, NULL);
+        task = NULL;
+        running = 0;
+        generation = 0;
+    }
+
+    /// true inside a worker, or inside the calling thread while it works on a task
+    static bool& in_task()
+    {
+        static __thread bool flag = false;
+        return flag;
+    }
+
+    /// called with submit locked
+    void grow(int num_workers)
+    {
+        while((int)workers.size() < num_workers)
         {
-            int item;
-            pthread_mutex_lock (&context->mutex);
-            item = context->i++;
-            pthread_mutex_unlock (&context->mutex);
-            if (item >= context->n) // no more item to do
-                break;
-            else
-                printf("\rtid:%d assign task %d of %d total task.",tid, item, context->n);
-                //fflush(stdout);
-                context->task_fun (context->task_arg, tid, item, context->mutex);
+            worker_arg* a = new worker_arg;
+            a->pool = this;
+            a->tid = workers.size() + 1;
+            pthread_t th;
+            if(pthread_create(&th, NULL, &worker_routine, a) != 0)
+            {
+                printf("error: can not create thread %d.\n", a->tid);
+                exit(1);
+            }
+            workers.push_back(th);
         }
+    }
+
+    static void* worker_routine(void* p)
+    {
+        worker_arg* a = (worker_arg*)p;
+        ThreadPool* pool = a->pool;
+        in_task() = true;
 
+        int seen = 0;
+        while(1)
+        {
+            pthread_mutex_lock(&pool->mutex);
+            while(pool->task == NULL || pool->generation == seen)
+                pthread_cond_wait(&pool->wake, &pool->mutex);
+            seen = pool->generation;
+            context_t* ctx = pool->task;
+            pthread_mutex_unlock(&pool->mutex);
+
+            if(a->tid >= ctx->nthread) // not needed for this task
+                continue;
+
+            pool->work(ctx, a->tid);
+
+            pthread_mutex_lock(&pool->mutex);
+            if(--pool->running == 0)
+                pthread_cond_signal(&pool->done);
+            pthread_mutex_unlock(&pool->mutex);
+        }
         return NULL;
     }
 
+    static void init_deques(context_t* ctx)
+    {
+        ctx->deques = new chunk_deque[ctx->nthread];
+        for(int t = 0; t < ctx->nthread; t++)
+        {
+            pthread_mutex_init(&ctx->deques[t].mutex, NULL);
+            ctx->deques[t].begin = (long)ctx->num_chunks * t / ctx->nthread;
+            ctx->deques[t].end = (long)ctx->num_chunks * (t+1) / ctx->nthread;
+        }
+    }
+
+    static void free_deques(context_t* ctx)
+    {
+        for(int t = 0; t < ctx->nthread; t++)
+            pthread_mutex_destroy(&ctx->deques[t].mutex);
+        delete[] ctx->deques;
+    }
+
+    /// next chunk of thread tid, stolen if its own deque is empty. -1 when the task is done
+    static int next_chunk(context_t* ctx, int tid)
+    {
+        chunk_deque& own = ctx->deques[tid];
+        pthread_mutex_lock(&own.mutex);
+        int c = (own.begin < own.end) ? own.begin++ : -1;
+        pthread_mutex_unlock(&own.mutex);
+        if(c >= 0)
+            return c;
+
+        for(int s = 1; s < ctx->nthread; s++)
+        {
+            chunk_deque& victim = ctx->deques[(tid + s) % ctx->nthread];
+            pthread_mutex_lock(&victim.mutex);
+            int left = victim.end - victim.begin;
+            int b = victim.end - (left + 1) / 2;
+            int e = victim.end;
+            if(left > 0)
+                victim.end = b;
+            pthread_mutex_unlock(&victim.mutex);
+            if(left <= 0)
+                continue;
+
+            // keep the first stolen chunk, the rest can be stolen again
+            pthread_mutex_lock(&own.mutex);
+            own.begin = b + 1;
+            own.end = e;
+            pthread_mutex_unlock(&own.mutex);
+            return b;
+        }
+        return -1;
+    }
+
+    static void work(context_t* ctx, int tid)
+    {
+        bool& flag = in_task();
+        bool was_in_task = flag;
+        flag = true;
+
+        int c;
+        while((c = next_chunk(ctx, tid)) >= 0)
+        {
+            int begin = c * ctx->chunk;
+            int end = std::min(begin + ctx->chunk, ctx->n);
+            if(ctx->item_fun != NULL)
+            {
+                for(int i = begin; i < end; i++)
+                    ctx->item_fun(ctx->task_arg, tid, i, ctx->mutex);
+            }
+            else
+                ctx->partial[c] = ctx->range_fun(ctx->task_arg, tid, begin, end);
+        }
+
+        flag = was_in_task;
+    }
+};
+
+
+/// provides utility for multi-threading programming
+class MultiThd
+{
+public:
+	/**
+	@brief interface to multi-threading computation, runs task_fun on each of the n items
+	*/
+    static void compute_tasks (int n, int nthread, item_fun_t task_fun, void *task_arg)
+    {
+        parallel_for(n, nthread, task_fun, task_arg, 0);
+    }
+
+    /**
+    @brief run task_fun on items 0 ... n-1 with nthread threads of the pool
+    @param task_fun called as task_fun(task_arg, tid, i, mutex). tid is in [0, nthread) and
+    the mutex is shared by all the calls of this task
+    @param chunk number of items handed out at a time. 0 picks one from n and nthread
+    */
+    static void parallel_for (int n, int nthread, item_fun_t task_fun, void *task_arg, int chunk)
+    {
+        context_t context;
+        init_context(context, n, nthread, chunk, task_arg);
+        context.item_fun = task_fun;
+        run(context);
+    }
+
+    /**
+    Partial results are summed in the order of the ranges, so that the result does not
+    depend on which thread did which range.
+    @brief sum of range_fun over a partition of items 0 ... n-1, with nthread threads of the pool
+    @param range_fun called as range_fun(task_arg, tid, begin, end) on disjoint ranges
+    @param chunk size of the ranges. 0 picks one from n and nthread
+    */
+    static double parallel_reduce (int n, int nthread, range_fun_t range_fun, void *task_arg, int chunk)
+    {
+        context_t context;
+        init_context(context, n, nthread, chunk, task_arg);
+        context.range_fun = range_fun;
+        context.partial = new double[context.num_chunks];
+        run(context);
+
+        double sum = 0.0;
+        for(int c = 0; c < context.num_chunks; c++)
+            sum += context.partial[c];
+        delete[] context.partial;
+        return sum;
+    }
+
+private:
+
+    static void init_context (context_t& context, int n, int nthread, int chunk, void *task_arg)
+    {
+        assert(nthread >= 1);
+        if(chunk <= 0) // about 8 chunks per thread, to leave something to steal
+            chunk = std::max(1, n / (nthread * 8));
+        context.n = n;
+        context.chunk = chunk;
+        context.num_chunks = (n + chunk - 1) / chunk;
+        context.nthread = std::max(1, std::min(nthread, context.num_chunks));
+        context.item_fun = NULL;
+        context.range_fun = NULL;
+        context.task_arg = task_arg;
+        context.partial = NULL;
+        context.deques = NULL;
+    }
+
+    static void run (context_t& context)
+    {
+        if(context.n <= 0)
+            return;
+        pthread_mutex_init (&context.mutex, NULL);
+        ThreadPool::instance()->run(&context);
+        pthread_mutex_destroy (&context.mutex);
+    }
+
 };
 
 #endif // MUTITHD_MUTEX_H_INCLUDED
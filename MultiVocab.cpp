@@ -0,0 +1,191 @@
+/**
+@file MultiVocab.cpp
+@brief this file implements the inverted multi-index defined in MultiVocab.h
+*/
+#include <queue>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#include "MultiVocab.h"
+
+using std::vector;
+using std::priority_queue;
+
+
+/// a cell of the multi-index on the multi-sequence front: position i in sorted list of half 0, position j in half 1
+struct ms_cell
+{
+    float val;
+    int i;
+    int j;
+
+    ms_cell(float v, int i_l, int j_l) : val(v), i(i_l), j(j_l) {}
+
+    /// reversed so that priority_queue pops the closest cell first
+    bool operator < (const ms_cell& rhs) const
+    {
+        return val > rhs.val;
+    }
+};
+
+/// keeps a distance to one centroid of a half, for sorting
+struct half_dist
+{
+    float val;
+    int idx;
+
+    bool operator < (const half_dist& rhs) const
+    {
+        return val < rhs.val;
+    }
+};
+
+
+MultiVocab::MultiVocab(int k_assign, int dim)
+{
+    assert(dim % 2 == 0);
+    k = k_assign;
+    d = dim;
+    hd = dim / 2;
+    num_leaf = k * k;
+
+    half[0] = new Vocab(k, 1, hd);
+    half[1] = new Vocab(k, 1, hd);
+}
+
+MultiVocab::~MultiVocab()
+{
+    delete half[0];
+    delete half[1];
+}
+
+
+void MultiVocab::quantize2leaf(float* v, int* out, int n, int m)
+{
+    for(int p = 0; p < n; p++)
+    {
+        int best[2];
+        for(int h = 0; h < 2; h++)
+        {
+            float dist_best = 1e30f;
+            best[h] = 0;
+            for(int i = 0; i < k; i++)
+            {
+                float dist = Util::dist_l2_sq(v + p*(d+m) + m + h*hd, centroid(h, i), hd);
+                if(dist < dist_best)
+                {
+                    dist_best = dist;
+                    best[h] = i;
+                }
+            }
+        }
+        out[p] = best[0]*k + best[1];
+    }
+}
+
+
+void MultiVocab::quantize2leaf(float* v, int* out, int n, int m, int ma)
+{
+    for(int p = 0; p < n; p++)
+    {
+        int got = multi_sequence(v + p*(d+m) + m, NULL, 0, ma, out + p*ma, NULL);
+        assert(got == ma);
+    }
+}
+
+
+void MultiVocab::sorted_dists(const float* v, int h, float* val, int* idx)
+{
+    vector<half_dist> dists(k);
+    for(int i = 0; i < k; i++)
+    {
+        dists[i].val = Util::dist_l2_sq(v + h*hd, centroid(h, i), hd);
+        dists[i].idx = i;
+    }
+    std::sort(dists.begin(), dists.end());
+
+    for(int i = 0; i < k; i++)
+    {
+        val[i] = dists[i].val;
+        idx[i] = dists[i].idx;
+    }
+}
+
+
+int MultiVocab::multi_sequence(const float* v, const int* cell_sz, int budget, int max_cells, int* cells, float* dists)
+{
+    float* val0 = new float[k];
+    float* val1 = new float[k];
+    int* idx0 = new int[k];
+    int* idx1 = new int[k];
+    sorted_dists(v, 0, val0, idx0);
+    sorted_dists(v, 1, val1, idx1);
+
+    // (i, j) is pushed by (i, j-1), or by (i-1, 0) when j = 0. the parent is never farther
+    // than the child, so cells are popped in increasing distance and each one exactly once.
+    priority_queue<ms_cell> front;
+    front.push(ms_cell(val0[0] + val1[0], 0, 0));
+
+    int num = 0;
+    int collected = 0;
+    max_cells = std::min(max_cells, num_leaf);
+    while(!front.empty() && num < max_cells)
+    {
+        ms_cell c = front.top();
+        front.pop();
+
+        if(c.j + 1 < k)
+            front.push(ms_cell(val0[c.i] + val1[c.j+1], c.i, c.j+1));
+        if(c.j == 0 && c.i + 1 < k)
+            front.push(ms_cell(val0[c.i+1] + val1[0], c.i+1, 0));
+
+        int cell = idx0[c.i]*k + idx1[c.j];
+        if(cell_sz != NULL && cell_sz[cell] == 0) // nothing to scan there
+            continue;
+
+        cells[num] = cell;
+        if(dists != NULL)
+            dists[num] = c.val;
+        num++;
+
+        if(cell_sz != NULL)
+        {
+            collected += cell_sz[cell];
+            if(collected >= budget)
+                break;
+        }
+    }
+
+    delete[] val0;
+    delete[] val1;
+    delete[] idx0;
+    delete[] idx1;
+
+    return num;
+}
+
+
+void MultiVocab::residual(const float* v, int cell, float* out)
+{
+    const float* c0 = centroid(0, cell / k);
+    const float* c1 = centroid(1, cell % k);
+    for(int i = 0; i < hd; i++)
+    {
+        out[i]      = v[i]      - c0[i];
+        out[hd + i] = v[hd + i] - c1[i];
+    }
+}
+
+
+void MultiVocab::loadFromDisk(string dir)
+{
+    half[0]->loadFromDisk(dir + "imi0.");
+    half[1]->loadFromDisk(dir + "imi1.");
+}
+
+void MultiVocab::write2Disk(string dir)
+{
+    half[0]->write2Disk(dir + "imi0.");
+    half[1]->write2Disk(dir + "imi1.");
+}
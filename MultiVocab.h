@@ -0,0 +1,115 @@
+/**
+@file MultiVocab.h
+@brief This file defines the inverted multi-index coarse quantizer: two coarse codebooks on the
+two halves of the feature, whose product gives k x k cells.
+*/
+
+#ifndef MULTIVOCAB_H_INCLUDED
+#define MULTIVOCAB_H_INCLUDED
+
+#include <string>
+
+#include "Vocab.h"
+
+using std::string;
+
+
+/**
+Cell (i, j) of the multi-index is made of the i-th centroid of the first half and the j-th
+centroid of the second half. Its flat id is i*k + j, so it can be used wherever a word id of
+Vocab is used (index lists, voc_sz, ...).
+@brief inverted multi-index coarse quantizer
+*/
+class MultiVocab
+{
+public:
+
+    /// coarse codebooks for the first and second half of the feature. each one is k x (d/2)
+    Vocab* half[2];
+    /// number of centroids per half
+    int k;
+    /// dimension of feature
+    int d;
+    /// dimension of each half
+    int hd;
+    /// number of cells: k x k
+    int num_leaf;
+
+	/**
+	@brief constructor for the multi-index
+	@param k_assign number of centroids per half
+	@param dim dimension of feature
+	*/
+    MultiVocab(int k_assign, int dim);
+
+    ~MultiVocab();
+
+    /**
+    @brief quantize a set of (n) vector v into its nearest cell
+    @param v vector to quantize. size of n x (d+m)
+    @param out keeps the quantization result. size of n x 1
+    @param n number of features to quantize
+    @param m skip the first m column of v.
+    */
+    void quantize2leaf(float* v, int* out, int n, int m);
+
+	/**
+	@brief quantize a set of features to their 'ma' nearest cells, in increasing distance order
+	@param v vector to quantize. size of n x (d+m)
+    @param out keeps the quantization result. size of n x ma
+    @param n number of features to quantize
+    @param m skip the first m column of v.
+    @param ma multiple assignments factor
+	*/
+    void quantize2leaf(float* v, int* out, int n, int m, int ma);
+
+    /**
+    Multi-sequence algorithm: cells are visited in increasing distance to v until either the
+    lists of the visited cells hold 'budget' entries or 'max_cells' non-empty cells are visited.
+    @brief get the cells to visit for a single vector
+    @param v vector to quantize. size of 1 x d
+    @param cell_sz number of entries of each cell. size of k x k. when NULL, every cell counts as non-empty and budget is ignored.
+    @param budget number of candidates to collect
+    @param max_cells maximal number of cells to return
+    @param cells keeps the visited cells. size of max_cells x 1
+    @param dists keeps the squared distance of v to each visited cell, can be NULL. size of max_cells x 1
+    @return number of cells kept in 'cells'
+    */
+    int multi_sequence(const float* v, const int* cell_sz, int budget, int max_cells, int* cells, float* dists);
+
+    /**
+    @brief residual of v against the centroid of 'cell': out = v - c(cell)
+    */
+    void residual(const float* v, int cell, float* out);
+
+    /**
+    @brief pointer to the centroid of the first (h = 0) or the second (h = 1) half
+    */
+    float* centroid(int h, int i) { return half[h]->vec + half[h]->sp[1] + i*hd; }
+
+    /// bytes used by both codebooks in memory
+    long bytes() const { return half[0]->bytes() + half[1]->bytes(); }
+
+    /**
+    @brief load both codebooks of the multi-index from 'dir'
+    */
+    void loadFromDisk(string dir);
+
+    /**
+    @brief write both codebooks of the multi-index to 'dir'
+    */
+    void write2Disk(string dir);
+
+private:
+
+    /**
+    @brief squared distances from half 'h' of v to the k centroids of that half, sorted increasingly
+    @param v vector to quantize. size of 1 x d
+    @param h which half
+    @param val keeps the sorted distances. size of k x 1
+    @param idx keeps the centroid id of each sorted distance. size of k x 1
+    */
+    void sorted_dists(const float* v, int h, float* val, int* idx);
+};
+
+#endif // MULTIVOCAB_H_INCLUDED
@@ -0,0 +1,211 @@
+/**
+@file Numa.h
+@brief provides utilities to place threads and memory on the NUMA nodes of the machine.
+Nodes are read from /sys/devices/system/node, and memory is placed by first touch: pages
+go to the node of the thread that writes them first.
+*/
+
+#ifndef NUMA_H_INCLUDED
+#define NUMA_H_INCLUDED
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+
+using std::string;
+using std::vector;
+
+
+/// topology of the machine and thread binding
+class Numa
+{
+public:
+
+    /// number of NUMA nodes of the machine, 1 if it is not NUMA or the topology can not be read
+    static int num_nodes()
+    {
+        DIR* dp = opendir("/sys/devices/system/node/");
+        if(!dp)
+            return 1;
+        int n = 0;
+        struct dirent* dirp;
+        while((dirp = readdir(dp)) != NULL)
+        {
+            int id;
+            if(sscanf(dirp->d_name, "node%d", &id) == 1)
+                n++;
+        }
+        closedir(dp);
+        return std::max(n, 1);
+    }
+
+    /**
+    @brief cpus of a node, parsed from its cpulist, e.g. "0-15,32-47"
+    @return empty if the node does not exist
+    */
+    static vector<int> cpus_of(int node)
+    {
+        vector<int> cpus;
+        char file[128];
+        sprintf(file, "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* fin = fopen(file, "r");
+        if(!fin)
+            return cpus;
+
+        int a, b;
+        char sep;
+        while(fscanf(fin, "%d", &a) == 1)
+        {
+            b = a;
+            if(fscanf(fin, "%c", &sep) == 1 && sep == '-')
+            {
+                if(fscanf(fin, "%d", &b) != 1)
+                    break;
+                if(fscanf(fin, "%c", &sep) != 1)
+                    sep = '\n';
+            }
+            for(int c = a; c <= b; c++)
+                cpus.push_back(c);
+            if(sep != ',')
+                break;
+        }
+        fclose(fin);
+        return cpus;
+    }
+
+    /**
+    @brief bind the calling thread to the cpus of 'node'
+    @return false if the node does not exist or the binding failed. the thread is left free then
+    */
+    static bool bind(int node)
+    {
+        vector<int> cpus = cpus_of(node);
+        if(cpus.empty())
+            return false;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for(unsigned int i = 0; i < cpus.size(); i++)
+            CPU_SET(cpus[i], &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) == 0;
+    }
+};
+
+
+/**
+Everything the worker runs, including the allocations, happens on the node it is bound to.
+@brief a persistent thread bound to one NUMA node, running one job at a time
+*/
+class NodeWorker
+{
+public:
+
+    /// node the worker runs on
+    int node;
+    /// whether binding to the node succeeded
+    bool bound;
+
+    /// start the thread and bind it to 'node'
+    NodeWorker(int node_l)
+    {
+        node = node_l;
+        bound = false;
+        job = NULL;
+        job_arg = NULL;
+        busy = false;
+        stop = false;
+        started = false;
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+        if(pthread_create(&thread, NULL, &routine, this) != 0)
+        {
+            printf("error: can not create the worker of node %d.\n", node);
+            exit(1);
+        }
+
+        // wait for the binding result
+        pthread_mutex_lock(&mutex);
+        while(!started)
+            pthread_cond_wait(&cond, &mutex);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    ~NodeWorker()
+    {
+        pthread_mutex_lock(&mutex);
+        stop = true;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+        pthread_join(thread, NULL);
+        pthread_mutex_destroy(&mutex);
+        pthread_cond_destroy(&cond);
+    }
+
+    /// start fun(arg) on the worker. returns at once, see wait()
+    void submit(void (*fun)(void* arg), void* arg)
+    {
+        pthread_mutex_lock(&mutex);
+        while(busy)
+            pthread_cond_wait(&cond, &mutex);
+        job = fun;
+        job_arg = arg;
+        busy = true;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    /// wait until the job submitted last is done
+    void wait()
+    {
+        pthread_mutex_lock(&mutex);
+        while(busy)
+            pthread_cond_wait(&cond, &mutex);
+        pthread_mutex_unlock(&mutex);
+    }
+
+private:
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    /// signals a new job, the end of a job and stop
+    pthread_cond_t cond;
+    void (*job)(void* arg);
+    void* job_arg;
+    bool busy;
+    bool stop;
+    bool started;
+
+    static void* routine(void* p)
+    {
+        NodeWorker* w = (NodeWorker*)p;
+        bool bound = Numa::bind(w->node);
+
+        pthread_mutex_lock(&w->mutex);
+        w->bound = bound;
+        w->started = true;
+        pthread_cond_broadcast(&w->cond);
+        while(1)
+        {
+            while(!w->busy && !w->stop)
+                pthread_cond_wait(&w->cond, &w->mutex);
+            if(w->stop)
+                break;
+            pthread_mutex_unlock(&w->mutex);
+
+            w->job(w->job_arg);
+
+            pthread_mutex_lock(&w->mutex);
+            w->busy = false;
+            pthread_cond_broadcast(&w->cond);
+        }
+        pthread_mutex_unlock(&w->mutex);
+        return NULL;
+    }
+};
+
+#endif // NUMA_H_INCLUDED
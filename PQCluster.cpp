@@ -9,6 +9,9 @@
 #include "PQCluster.h"
 //#include <cmath>
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
 #include "entry.h"
 #include "util.h"
 #include "IO.h"
@@ -19,6 +22,8 @@ PQCluster::PQCluster(int nsqbits_l, int nsq_l, int d)
     ds = d/nsq_l;
     nsq = nsq_l;
     clusters = new float[ks*ds*nsq_l];
+    norms = new float[ks*nsq_l];
+    cclusters = NULL;
 }
 
 
@@ -42,6 +47,7 @@ void PQCluster::loadFromDisk(string centroids_dir)
         memcpy(clusters + ks*ds*i, tmpmat, row*col*sizeof(float));
         delete[] tmpmat;
     }
+    Util::sq_norms(clusters, ks*nsq, ds, ds, norms);
 }
 
 unsigned int PQCluster::get_nsq()
@@ -76,6 +82,206 @@ void PQCluster::quantize_once(float* vec, int* out, int nsq_num)
     }
 }
 
+void PQCluster::encode(const float* residual, int n, unsigned int* codes)
+{
+    int d = ds*nsq;
+    int* out = new int[n];
+    for(int i = 0; i < nsq; i++) // each subquantizer over the whole block
+    {
+        if(cclusters != NULL)
+            cclusters->nearest(residual + i*ds, n, d, i*ks, ks, out, NULL);
+        else
+            Util::nearest(residual + i*ds, n, d, subvec(i), norms + i*ks, ks, ds, out, NULL);
+        for(int j = 0; j < n; j++)
+            codes[j*nsq + i] = out[j];
+    }
+    delete[] out;
+}
+
+void PQCluster::ip_table(const float* q, float* table) const
+{
+    for(int i = 0; i < nsq; i++)
+    {
+        for(int j = 0; j < ks; j++)
+        {
+            if(cclusters != NULL)
+                table[i*ks + j] = cclusters->dot(q + i*ds, i*ks + j);
+            else
+            {
+                const float* c = clusters + (i*ks + j)*ds;
+                float s = 0.0f;
+                for(int x = 0; x < ds; x++)
+                    s += q[i*ds + x]*c[x];
+                table[i*ks + j] = s;
+            }
+        }
+    }
+}
+
+float PQCluster::ip(const void* prepared, const unsigned int* code) const
+{
+    const float* table = (const float*)prepared;
+    float s = 0.0f;
+    for(int i = 0; i < nsq; i++)
+        s += table[i*ks + code[i]];
+    return s;
+}
+
+float PQCluster::norm2(const unsigned int* code) const
+{
+    float s = 0.0f;
+    for(int i = 0; i < nsq; i++)
+        s += norms[i*ks + code[i]];
+    return s;
+}
+
+void PQCluster::table_code(const float* table, bool by_ip, unsigned int* code)
+{
+    for(int i = 0; i < nsq; i++)
+    {
+        const float* t = table + i*ks;
+        const float* nm = norms + i*ks;
+        int best = 0;
+        float best_val = by_ip ? -t[0] : nm[0] - 2*t[0];
+        for(int j = 1; j < ks; j++)
+        {
+            // |q - c|^2 = |q|^2 - 2<q,c> + |c|^2, |q|^2 is the same for all
+            float val = by_ip ? -t[j] : nm[j] - 2*t[j];
+            if(val < best_val)
+            {
+                best_val = val;
+                best = j;
+            }
+        }
+        code[i] = best;
+    }
+}
+
+/// change of the polysemous cost when centroids a and b swap their codes: only their pairs with the others change
+static double swap_delta(const vector<int>& perm, const vector<float>& dist, int ks, int a, int b)
+{
+    double delta = 0.0;
+    for(int k = 0; k < ks; k++)
+    {
+        if(k == a || k == b)
+            continue;
+        int ha = __builtin_popcount(perm[a] ^ perm[k]), hb = __builtin_popcount(perm[b] ^ perm[k]);
+        double ga = ha - dist[a*ks + k], gb = hb - dist[b*ks + k];
+        double na = hb - dist[a*ks + k], nb = ha - dist[b*ks + k];
+        delta += na*na + nb*nb - ga*ga - gb*gb;
+    }
+    return delta;
+}
+
+void PQCluster::polysemous_order(int i, int iters)
+{
+    int nbits = 0;
+    while((1 << nbits) < ks)
+        nbits++;
+    if(iters <= 0)
+        iters = 500*ks;
+
+    // distances between the centroids, scaled so that their mean is the mean Hamming distance between two codes
+    float* c = subvec(i);
+    vector<float> dist((long)ks*ks);
+    double sum = 0.0;
+    for(int a = 0; a < ks; a++)
+        for(int b = 0; b < ks; b++)
+        {
+            dist[a*ks + b] = sqrt(Util::dist_l2_sq(c + a*ds, c + b*ds, ds));
+            sum += dist[a*ks + b];
+        }
+    double scale = (sum > 0) ? 0.5*nbits*ks*ks / sum : 0.0;
+    for(long j = 0; j < (long)ks*ks; j++)
+        dist[j] *= scale;
+
+    // perm[a] is the code of centroid a. the cost is the squared gap between Hamming and scaled distances
+    vector<int> perm(ks);
+    double cost = 0.0;
+    for(int a = 0; a < ks; a++)
+        perm[a] = a;
+    for(int a = 0; a < ks; a++)
+        for(int b = a + 1; b < ks; b++)
+        {
+            double g = __builtin_popcount(perm[a] ^ perm[b]) - dist[a*ks + b];
+            cost += g*g;
+        }
+    double cost0 = cost;
+
+    // the temperature starts at the mean change of a few random swaps and falls linearly to 0
+    unsigned int seed = 12345 + i;
+    double temp = 0.0;
+    for(int t = 0; t < 100; t++)
+    {
+        int a = rand_r(&seed) % ks, b = rand_r(&seed) % ks;
+        temp += fabs(swap_delta(perm, dist, ks, a, b)) / 100;
+    }
+    for(int t = 0; t < iters; t++)
+    {
+        int a = rand_r(&seed) % ks, b = rand_r(&seed) % ks;
+        if(a == b)
+            continue;
+        double delta = swap_delta(perm, dist, ks, a, b);
+        double T = temp * (1.0 - (double)t / iters);
+        if(delta < 0 || (T > 0 && rand_r(&seed) < RAND_MAX * exp(-delta / T)))
+        {
+            std::swap(perm[a], perm[b]);
+            cost += delta;
+        }
+    }
+
+    // centroid a goes to row perm[a]
+    float* sorted = new float[ks*ds];
+    for(int a = 0; a < ks; a++)
+        memcpy(sorted + perm[a]*ds, c + a*ds, sizeof(float)*ds);
+    memcpy(c, sorted, sizeof(float)*ks*ds);
+    delete[] sorted;
+    printf("subquantizer %d: polysemous cost %.4g -> %.4g\n", i, cost0, cost);
+}
+
+void PQCluster::compress(int fmt)
+{
+    if(fmt == FMT_FP32)
+        return;
+    cclusters = new CompactMat(clusters, nsq*ks, ds, fmt);
+    delete[] clusters;
+    clusters = NULL;
+    compact_norms();
+}
+
+void PQCluster::compact_norms()
+{
+    // norms of the centroids as they are stored, so that they agree with ip_table
+    float* row = new float[ds];
+    for(int i = 0; i < nsq*ks; i++)
+    {
+        cclusters->decode(i, row);
+        Util::sq_norms(row, 1, ds, ds, norms + i);
+    }
+    delete[] row;
+}
+
+bool PQCluster::loadCompact(string centroids_dir, int fmt)
+{
+    string file = centroids_dir + "vocab." + CompactMat::fmt_name(fmt);
+    CompactMat* mat = CompactMat::loadFromDisk(file);
+    if(mat == NULL)
+        return false;
+
+    printf("Loading vocabulary: '%s'...\n", file.c_str());
+    assert(mat->n == nsq*ks && mat->d == ds && mat->fmt == fmt);
+    cclusters = mat;
+    delete[] clusters;
+    clusters = NULL;
+    compact_norms();
+    return true;
+}
+
+void PQCluster::writeCompact(string centroids_dir)
+{
+    cclusters->write2Disk(centroids_dir + "vocab." + CompactMat::fmt_name(cclusters->fmt));
+}
+
 void PQCluster::print_clusters()
 {
     for(int x=0; x < nsq; x++)
@@ -92,7 +298,19 @@ void PQCluster::print_clusters()
     }
 }
 
+long PQCluster::bytes() const
+{
+    long b = (long)nsq*ks*sizeof(float);
+    if(clusters != NULL)
+        b += (long)nsq*ks*ds*sizeof(float);
+    if(cclusters != NULL)
+        b += cclusters->bytes();
+    return b;
+}
+
 PQCluster::~PQCluster()
 {
     delete[] clusters;
+    delete[] norms;
+    delete cclusters;
 }
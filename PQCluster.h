@@ -11,14 +11,20 @@
 
 #include <iostream>
 #include <string>
+#include <cstring>
+#include "CompactMat.h"
+#include "ResidualCodec.h"
 using namespace std;
-class PQCluster
+class PQCluster : public ResidualCodec
 {
 private:
     float* clusters;
+    float* norms; // squared norm of each centroid, size of nsq*ks. set by loadFromDisk.
+    CompactMat* cclusters; // centroids in reduced precision. when set, clusters is released.
     int nsq;
     int ks; // number of centroids for subquantizer.
     int ds; // dimension of the subvectors to quantize.
+    void compact_norms(); // norms from cclusters
 public:
     PQCluster(int nsqbits, int nsq, int d);
     float* subvec(int i);
@@ -26,6 +32,47 @@ public:
     void loadFromDisk(string centroids_dir);
     void quantize2leaf(float* voc, int* result, int n);
     void quantize_once(float* vec, int* out, int nsq_num);
+    // pq codes of a block of n residuals (n x d): codes is n x nsq. needs the norms set by loadFromDisk.
+    void encode(const float* residual, int n, unsigned int* codes);
+    // inner products of each subvector of q (size of d) with the centroids of its subquantizer. table is nsq x ks
+    void ip_table(const float* q, float* table) const;
+    // the ResidualCodec of the pq codes: a code is nsq ints, and a query is prepared into its ip_table
+    int kind() const { return CODEC_PQ; }
+    int code_size() const { return nsq; }
+    int query_bytes() const { return nsq*ks*sizeof(float); }
+    void prepare(const float* q, void* out) const { ip_table(q, (float*)out); }
+    float ip(const void* prepared, const unsigned int* code) const;
+    float norm2(const unsigned int* code) const;
+    // renumber the centroids of subquantizer i by simulated annealing over iters swaps, so that the Hamming
+    // distance between two codes follows the distance between their centroids. 0 iters for a default
+    void polysemous_order(int i, int iters);
+    // the code of the query whose ip_table is 'table': nearest centroid of each subvector, or largest inner product with by_ip
+    void table_code(const float* table, bool by_ip, unsigned int* code);
+    // number of bits that differ between two codes of nsq subquantizers
+    static int hamming(const unsigned int* a, const unsigned int* b, int nsq)
+    {
+        // the codes take few bits of their ints, two subquantizers are compared per 64-bit word
+        int dist = 0, x = 0;
+        for(; x + 1 < nsq; x += 2)
+        {
+            unsigned long long u, v;
+            memcpy(&u, a + x, sizeof(u));
+            memcpy(&v, b + x, sizeof(v));
+            dist += __builtin_popcountll(u ^ v);
+        }
+        if(x < nsq)
+            dist += __builtin_popcount(a[x] ^ b[x]);
+        return dist;
+    }
+    // keep the centroids in reduced precision (see CompactMat.h) and release the fp32 ones
+    void compress(int fmt);
+    // load the centroids in reduced precision from centroids_dir/vocab.<fmt>. false if there is no such file
+    bool loadCompact(string centroids_dir, int fmt);
+    // write the reduced precision centroids to centroids_dir/vocab.<fmt>
+    void writeCompact(string centroids_dir);
+    const float* get_norms(){return norms;}
+    // bytes used by the centroids and their norms in memory
+    long bytes() const;
     void print_clusters();
     unsigned int get_nsq();
     int get_ds(){return ds;}
@@ -39,6 +39,7 @@ CParamReader::CParamReader (string paramFileName)
 void CParamReader::ReadParamFile (string paramFileName)
 {
     string seps = "=", var;
+    fileName = paramFileName;
     FILE* fin = fopen(paramFileName.c_str(), "r");
     //FILE* fin = fopen("/Users/nebula/mylab/copyDetection/xcode_search/IVFADC/sample.config", "r");
     if (!fin)
@@ -108,6 +109,30 @@ float CParamReader::GetFlt (std::string param)
     }
 }
 
+/// get a string from config file, or 'def' when it is not defined
+string CParamReader::GetStr (string param, string def)
+{
+    if ( params.find(param) != params.end() )
+        return params[param];
+    return def;
+}
+
+/// get an interger from config file, or 'def' when it is not defined
+int CParamReader::GetInt (std::string param, int def)
+{
+    if ( params.find(param) != params.end() )
+        return atoi(params[param].c_str());
+    return def;
+}
+
+/// get a float from config file, or 'def' when it is not defined
+float CParamReader::GetFlt (std::string param, float def)
+{
+    if ( params.find(param) != params.end() )
+        return atof(params[param].c_str());
+    return def;
+}
+
 /// print all paramters loaded from the config file
 void CParamReader::print()
 {
@@ -117,3 +142,48 @@ void CParamReader::print()
 
     printf("\n"); fflush(stdout);
 }
+
+/// write the config file read, with the values of 'changes', to paramFileName
+void CParamReader::WriteParamFile (string paramFileName, const map<string, string>& changes)
+{
+    string seps = "=";
+    FILE* fin = fopen(fileName.c_str(), "r");
+    FILE* fout = fopen(paramFileName.c_str(), "w");
+    if (!fin || !fout)
+    {
+        printf("error: can not write %s from %s.\n", paramFileName.c_str(), fileName.c_str());
+        exit(1);
+    }
+
+    const int max_len = 2000;
+    char* buffer = new char[max_len];
+    map<string, string> left = changes;
+
+    while ( fgets(buffer, max_len, fin) )
+    {
+        string line(buffer), rest(buffer);
+        if (line[line.length()-1] != '\n')
+            line += "\n";   // every value is read up to its end of line
+        if(line[0] == '\n' || line[0] == '#')
+        {
+            fputs(line.c_str(), fout);
+            continue;
+        }
+
+        string var = Util::trim(Util::strtok(rest, seps));
+        map<string, string>::iterator it = left.find(var);
+        if (it == left.end())
+            fputs(line.c_str(), fout);
+        else
+        {
+            fprintf(fout, "%s = %s\n", var.c_str(), it->second.c_str());
+            left.erase(it);
+        }
+    }
+    for (map<string, string>::iterator it = left.begin(); it != left.end(); it++)
+        fprintf(fout, "%s = %s\n", it->first.c_str(), it->second.c_str());
+
+    delete[] buffer;
+    fclose(fin);
+    fclose(fout);
+}
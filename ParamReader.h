@@ -40,6 +40,9 @@ class CParamReader
 	///parameter <key,value> table
 	map<string, string> params;
 
+	/// the config file read
+	string fileName;
+
 public:
 
 	/// destructor
@@ -66,8 +69,24 @@ public:
 	/// gen a float from config file
 	float GetFlt (std::string param);
 
+	/// get a string from config file, or 'def' when it is not defined
+	string GetStr (string param, string def);
+
+	/// get an interger from config file, or 'def' when it is not defined
+	int GetInt (std::string param, int def);
+
+	/// get a float from config file, or 'def' when it is not defined
+	float GetFlt (std::string param, float def);
+
 	/// print all paramters loaded from the config file
 	void print();
+
+	/**
+	The lines of the file read are copied with their comments, the values of the keys in 'changes'
+	are replaced and the keys it does not define are added at the end.
+	@brief write the config file read, with the values of 'changes', to paramFileName
+	*/
+	void WriteParamFile (string paramFileName, const map<string, string>& changes);
 };
 
 #endif
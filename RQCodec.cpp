@@ -0,0 +1,166 @@
+/**
+@file RQCodec.cpp
+@brief this file implements the residual quantizer defined in RQCodec.h
+*/
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#include "RQCodec.h"
+#include "util.h"
+#include "IO.h"
+
+using std::vector;
+
+
+RQCodec::RQCodec(int nsqbits, int nsq_l, int d_l, int beam_l)
+{
+    nsq = nsq_l;
+    ks = 1 << nsqbits;
+    d = d_l;
+    beam = std::max(beam_l, 1);
+    clusters = new float[(long)nsq*ks*d];
+    norms = new float[nsq*ks];
+    memset(clusters, 0, sizeof(float)*nsq*ks*d);
+    memset(norms, 0, sizeof(float)*nsq*ks);
+}
+
+RQCodec::~RQCodec()
+{
+    delete[] clusters;
+    delete[] norms;
+}
+
+float* RQCodec::stage(int i)
+{
+    return clusters + (long)i*ks*d;
+}
+
+void RQCodec::write2Disk(string dir, int i)
+{
+    IO::writeMat(stage(i), ks, d, dir + "rq.l" + Util::num2str(i));
+}
+
+bool RQCodec::loadFromDisk(string dir)
+{
+    printf("Loading vocabulary: '%s'...\n", dir.c_str());
+    for(int i = 0; i < nsq; i++)
+    {
+        string file = dir + "rq.l" + Util::num2str(i);
+        if(!IO::f_exists(file))
+            return false;
+        int row, col;
+        float* mat = IO::loadFMat(file, row, col, -1);
+        bool ok = (row == ks && col == d);
+        if(ok)
+            memcpy(stage(i), mat, sizeof(float)*ks*d);
+        delete[] mat;
+        if(!ok)
+            return false;
+    }
+    set_norms();
+    return true;
+}
+
+void RQCodec::set_norms()
+{
+    Util::sq_norms(clusters, nsq*ks, d, d, norms);
+}
+
+float RQCodec::subtract_stage(float* residual, int n, int i)
+{
+    Util::sq_norms(stage(i), ks, d, d, norms + i*ks);
+    int* out = new int[n];
+    Util::nearest(residual, n, d, stage(i), norms + i*ks, ks, d, out, NULL);
+    double err = 0.0;
+    for(long j = 0; j < n; j++)
+    {
+        const float* c = stage(i) + (long)out[j]*d;
+        for(int x = 0; x < d; x++)
+        {
+            residual[j*d + x] -= c[x];
+            err += residual[j*d + x] * residual[j*d + x];
+        }
+    }
+    delete[] out;
+    return (n > 0) ? (float)(err / n) : 0.0f;
+}
+
+void RQCodec::encode(const float* residual, int n, unsigned int* codes)
+{
+    int cs = code_size();
+    // the partial codes kept after each stage, what they leave of the residual and its squared norm
+    vector<float> left(beam*d), next_left(beam*d), err(beam), next_err(beam);
+    vector<unsigned int> part(beam*nsq), next_part(beam*nsq);
+    vector<float> ip(beam*ks);
+    vector< std::pair<float, int> > cand(beam*ks);
+
+    for(long i = 0; i < n; i++)
+    {
+        const float* r = residual + i*d;
+        memcpy(&left[0], r, sizeof(float)*d);
+        err[0] = Util::dot(r, r, d);
+        int nb = 1;
+        for(int m = 0; m < nsq; m++)
+        {
+            // |l - c|^2 = |l|^2 - 2<l, c> + |c|^2 for every partial code l and centroid c of the stage
+            Util::inner_products(&left[0], nb, d, stage(m), ks, d, &ip[0]);
+            for(int b = 0; b < nb; b++)
+                for(int j = 0; j < ks; j++)
+                    cand[b*ks + j] = std::make_pair(err[b] - 2*ip[b*ks + j] + norms[m*ks + j], b*ks + j);
+            int keep = std::min(beam, nb*ks);
+            std::partial_sort(cand.begin(), cand.begin() + keep, cand.begin() + nb*ks);
+            for(int t = 0; t < keep; t++)
+            {
+                int b = cand[t].second / ks, j = cand[t].second % ks;
+                memcpy(&next_part[t*nsq], &part[b*nsq], sizeof(unsigned int)*m);
+                next_part[t*nsq + m] = j;
+                const float* c = stage(m) + (long)j*d;
+                for(int x = 0; x < d; x++)
+                    next_left[t*d + x] = left[b*d + x] - c[x];
+                next_err[t] = cand[t].first;
+            }
+            left.swap(next_left);
+            part.swap(next_part);
+            err.swap(next_err);
+            nb = keep;
+        }
+
+        // the best code is the first one kept, its reconstruction is r minus what it leaves
+        unsigned int* code = codes + i*cs;
+        memcpy(code, &part[0], sizeof(unsigned int)*nsq);
+        float bn2 = 0.0f;
+        for(int x = 0; x < d; x++)
+            bn2 += (r[x] - left[x]) * (r[x] - left[x]);
+        memcpy(code + nsq, &bn2, sizeof(float));
+    }
+}
+
+void RQCodec::prepare(const float* q, void* out) const
+{
+    // the centroids of all the stages are one nsq*ks x d matrix
+    Util::inner_products(q, 1, d, clusters, nsq*ks, d, (float*)out);
+}
+
+float RQCodec::ip(const void* prepared, const unsigned int* code) const
+{
+    const float* table = (const float*)prepared;
+    float s = 0.0f;
+    for(int m = 0; m < nsq; m++)
+        s += table[m*ks + code[m]];
+    return s;
+}
+
+float RQCodec::norm2(const unsigned int* code) const
+{
+    float bn2;
+    memcpy(&bn2, code + nsq, sizeof(float));
+    return bn2;
+}
+
+long RQCodec::bytes() const
+{
+    return (long)nsq*ks*(d + 1)*sizeof(float);
+}
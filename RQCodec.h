@@ -0,0 +1,83 @@
+/**
+@file RQCodec.h
+@brief This file defines the residual quantization of the residuals: a stack of codebooks over the
+whole vector, each one coding what the previous ones left.
+*/
+
+#ifndef RQCODEC_H_INCLUDED
+#define RQCODEC_H_INCLUDED
+
+#include <string>
+
+#include "ResidualCodec.h"
+
+using std::string;
+
+
+/**
+A residual r is approximated by b = C_0[c_0] + ... + C_{nsq-1}[c_{nsq-1}], each codebook C_m holding
+ks centroids of dimension d. Stage m of the training runs k-means on what stages 0..m-1 left of the
+training residuals. The codes are chosen by a beam search: after each stage only the beam partial
+codes nearest to r are extended, which finds better codes than taking the nearest centroid stage by stage.
+<q, b> is the sum of the entries of a table of nsq x ks inner products, as for PQ. |b|^2 also has
+the cross terms <C_m[c_m], C_n[c_n]> between stages, so it is computed at encoding and stored after
+the nsq codes.
+@brief residual quantizer of the residuals
+*/
+class RQCodec : public ResidualCodec
+{
+public:
+
+    /**
+    @brief constructor. the codebooks are empty until they are trained or loaded
+    @param nsqbits bits of the code of a stage
+    @param nsq number of stages
+    @param beam number of partial codes kept by encode() after each stage
+    */
+    RQCodec(int nsqbits, int nsq, int d, int beam);
+
+    ~RQCodec();
+
+    /// the codebook of stage i, to train in place. size of ks x d
+    float* stage(int i);
+
+    /// write the codebook of stage i to dir/rq.l<i>
+    void write2Disk(string dir, int i);
+
+    /// load the codebooks written by write2Disk. false if one of them is missing or has another size
+    bool loadFromDisk(string dir);
+
+    /// squared norms of the centroids, once the codebooks are written through stage()
+    void set_norms();
+
+    /**
+    @brief subtract from each residual its nearest centroid of stage i, as the training of stage i+1 needs
+    @param residual what the previous stages left of n residuals. n x d, updated in place
+    @return the mean squared norm of what is left
+    */
+    float subtract_stage(float* residual, int n, int i);
+
+    int kind() const { return CODEC_RQ; }
+    int code_size() const { return nsq + 1; }
+    void encode(const float* residual, int n, unsigned int* codes);
+    int query_bytes() const { return nsq*ks*sizeof(float); }
+    void prepare(const float* q, void* out) const;
+    float ip(const void* prepared, const unsigned int* code) const;
+    float norm2(const unsigned int* code) const;
+    long bytes() const;
+
+    int get_ks() const { return ks; }
+
+private:
+
+    int nsq;
+    int ks;
+    int d;
+    int beam;
+    /// the codebooks of the stages. size of nsq x ks x d
+    float* clusters;
+    /// squared norm of each centroid. size of nsq x ks
+    float* norms;
+};
+
+#endif // RQCODEC_H_INCLUDED
@@ -0,0 +1,91 @@
+/**
+@file ResidualCodec.h
+@brief This file defines the interface of the codes that the inverted lists keep of the residuals:
+product quantization (PQCluster.h), 8-bit scalar quantization (SQCodec.h) or residual quantization (RQCodec.h).
+*/
+
+#ifndef RESIDUALCODEC_H_INCLUDED
+#define RESIDUALCODEC_H_INCLUDED
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+using std::string;
+
+/// codecs of the residuals, see Config::codec
+enum
+{
+    CODEC_PQ = 0,   ///< product quantization, nsq codes of nsqbits
+    CODEC_SQ8 = 1,  ///< one byte per dimension
+    CODEC_RQ = 2    ///< nsq stages of nsqbits over the whole residual
+};
+
+
+/**
+An entry of a list keeps code_size() unsigned ints. Its score against a query residual q needs
+<q, b> and |b|^2, b being the reconstruction of its code: prepare() computes once per query and
+cell what ip() needs of q, and ip() and norm2() are then called per entry.
+@brief codes of the residuals of the coarse quantizer
+*/
+class ResidualCodec
+{
+public:
+
+    virtual ~ResidualCodec() {}
+
+    /// one of CODEC_*. the scan of the lists has its own loop for CODEC_PQ
+    virtual int kind() const = 0;
+
+    /// number of unsigned ints of the code of a residual, as the index stores it
+    virtual int code_size() const = 0;
+
+    /**
+    @brief codes of a block of residuals
+    @param residual the residuals. size of n x d
+    @param codes keeps the codes. size of n x code_size()
+    */
+    virtual void encode(const float* residual, int n, unsigned int* codes) = 0;
+
+    /// bytes of what prepare() keeps of a query
+    virtual int query_bytes() const = 0;
+
+    /**
+    @brief what ip() needs of a query residual
+    @param q the query residual. size of d
+    @param out size of query_bytes(), aligned on 16 bytes
+    */
+    virtual void prepare(const float* q, void* out) const = 0;
+
+    /// <q, b> between the query residual q prepared by prepare() and the reconstruction b of 'code'
+    virtual float ip(const void* prepared, const unsigned int* code) const = 0;
+
+    /// |b|^2 of the reconstruction b of 'code'
+    virtual float norm2(const unsigned int* code) const = 0;
+
+    /// bytes used by the codebooks in memory
+    virtual long bytes() const = 0;
+
+    /// CODEC_* of its name in the config: pq, sq8 or rq
+    static int parse(string name)
+    {
+        if(name == "pq")
+            return CODEC_PQ;
+        if(name == "sq8")
+            return CODEC_SQ8;
+        if(name == "rq")
+            return CODEC_RQ;
+        printf("error: unknown codec %s, expected pq, sq8 or rq.\n", name.c_str());
+        exit(1);
+    }
+
+    /// name of a CODEC_* in the config
+    static string name(int codec)
+    {
+        if(codec == CODEC_SQ8)
+            return "sq8";
+        return (codec == CODEC_RQ) ? "rq" : "pq";
+    }
+};
+
+#endif // RESIDUALCODEC_H_INCLUDED
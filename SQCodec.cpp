@@ -0,0 +1,164 @@
+/**
+@file SQCodec.cpp
+@brief this file implements the 8-bit scalar quantizer defined in SQCodec.h
+*/
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include "SQCodec.h"
+#include "IO.h"
+
+/// dimensions whose integer products are summed in an int: 32767 x 255 x 256 is below 2^31
+static const int sq_block = 256;
+
+
+SQCodec::SQCodec(int d_l)
+{
+    d = d_l;
+    vmin = new float[d];
+    scale = new float[d];
+    memset(vmin, 0, sizeof(float)*d);
+    for(int j = 0; j < d; j++)
+        scale[j] = 1.0f;
+}
+
+SQCodec::~SQCodec()
+{
+    delete[] vmin;
+    delete[] scale;
+}
+
+void SQCodec::train(const float* residual, int n)
+{
+    float* vmax = new float[d];
+    for(int j = 0; j < d; j++)
+    {
+        vmin[j] = 1e30f;
+        vmax[j] = -1e30f;
+    }
+    for(long i = 0; i < n; i++)
+        for(int j = 0; j < d; j++)
+        {
+            vmin[j] = std::min(vmin[j], residual[i*d + j]);
+            vmax[j] = std::max(vmax[j], residual[i*d + j]);
+        }
+    for(int j = 0; j < d; j++)
+    {
+        if(n == 0)
+            vmin[j] = vmax[j] = 0.0f;
+        scale[j] = (vmax[j] > vmin[j]) ? (vmax[j] - vmin[j]) / 255 : 1.0f;
+    }
+    delete[] vmax;
+    printf("8-bit scalar quantizer trained on %d residuals.\n", n);
+}
+
+void SQCodec::write2Disk(string dir)
+{
+    float* mat = new float[2*d];
+    memcpy(mat, vmin, sizeof(float)*d);
+    memcpy(mat + d, scale, sizeof(float)*d);
+    IO::writeMat(mat, 2, d, dir + "sq8");
+    delete[] mat;
+}
+
+bool SQCodec::loadFromDisk(string dir)
+{
+    if(!IO::f_exists(dir + "sq8"))
+        return false;
+    printf("Loading vocabulary: '%s'...\n", (dir + "sq8").c_str());
+    int row, col;
+    float* mat = IO::loadFMat(dir + "sq8", row, col, -1);
+    bool ok = (row == 2 && col == d);
+    if(ok)
+    {
+        memcpy(vmin, mat, sizeof(float)*d);
+        memcpy(scale, mat + d, sizeof(float)*d);
+    }
+    delete[] mat;
+    return ok;
+}
+
+void SQCodec::encode(const float* residual, int n, unsigned int* codes)
+{
+    int cs = code_size();
+    for(long i = 0; i < n; i++)
+    {
+        const float* r = residual + i*d;
+        unsigned int* code = codes + i*cs;
+        unsigned char* c = (unsigned char*)code;
+        memset(code, 0, sizeof(unsigned int)*cs);
+        float bn2 = 0.0f;
+        for(int j = 0; j < d; j++)
+        {
+            float v = floor((r[j] - vmin[j]) / scale[j] + 0.5f);
+            c[j] = (unsigned char)std::max(0.0f, std::min(255.0f, v));
+            float b = vmin[j] + scale[j]*c[j];
+            bn2 += b*b;
+        }
+        memcpy(code + cs - 1, &bn2, sizeof(float));
+    }
+}
+
+int SQCodec::query_bytes() const
+{
+    // <q, min> and the step of the integer weights, padded to 16 bytes, then a 16-bit weight per dimension
+    return 4*sizeof(float) + d*sizeof(short);
+}
+
+void SQCodec::prepare(const float* q, void* out) const
+{
+    float* head = (float*)out;
+    short* w = (short*)(head + 4);
+    float base = 0.0f, top = 0.0f;
+    for(int j = 0; j < d; j++)
+    {
+        base += q[j]*vmin[j];
+        top = std::max(top, (float)fabs(q[j]*scale[j]));
+    }
+    // q_j scale_j ~ step x w_j, the largest of them taking the whole range of a short
+    float step = (top > 0) ? top / 32767 : 1.0f;
+    for(int j = 0; j < d; j++)
+        w[j] = (short)floor(q[j]*scale[j] / step + 0.5f);
+    head[0] = base;
+    head[1] = step;
+    head[2] = head[3] = 0.0f;
+}
+
+float SQCodec::ip(const void* prepared, const unsigned int* code) const
+{
+    const float* head = (const float*)prepared;
+    const short* w = (const short*)(head + 4);
+    const unsigned char* c = (const unsigned char*)code;
+    long acc = 0;
+    for(int j0 = 0; j0 < d; j0 += sq_block)
+    {
+        int end = std::min(d, j0 + sq_block), j = j0;
+        // four independent sums, the products of a 16-bit weight and a byte do not wait for each other
+        int s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+        for(; j + 4 <= end; j += 4)
+        {
+            s0 += w[j] * c[j];
+            s1 += w[j+1] * c[j+1];
+            s2 += w[j+2] * c[j+2];
+            s3 += w[j+3] * c[j+3];
+        }
+        for(; j < end; j++)
+            s0 += w[j] * c[j];
+        acc += (long)s0 + s1 + s2 + s3;
+    }
+    return head[0] + head[1] * acc;
+}
+
+float SQCodec::norm2(const unsigned int* code) const
+{
+    float bn2;
+    memcpy(&bn2, code + code_size() - 1, sizeof(float));
+    return bn2;
+}
+
+long SQCodec::bytes() const
+{
+    return 2L*d*sizeof(float);
+}
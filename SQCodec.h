@@ -0,0 +1,61 @@
+/**
+@file SQCodec.h
+@brief This file defines the 8-bit scalar quantization of the residuals: one byte per dimension,
+scored with integer arithmetic on the stored bytes.
+*/
+
+#ifndef SQCODEC_H_INCLUDED
+#define SQCODEC_H_INCLUDED
+
+#include <string>
+
+#include "ResidualCodec.h"
+
+using std::string;
+
+
+/**
+Dimension j of a residual r is coded by c_j = round((r_j - min_j) / scale_j) in [0, 255], min_j and
+scale_j being learned from the range of the training residuals. The d bytes are packed four per
+unsigned int, and the code ends with |b|^2 of the reconstruction b_j = min_j + scale_j c_j.
+<q, b> = sum q_j min_j + sum (q_j scale_j) c_j: prepare() rounds q_j scale_j to 16-bit integers,
+so that the second sum is a dot product of integers run on the codes as they are stored.
+@brief 8-bit scalar quantizer of the residuals
+*/
+class SQCodec : public ResidualCodec
+{
+public:
+
+    /// constructor. the quantizer is empty until train() or loadFromDisk()
+    SQCodec(int d);
+
+    ~SQCodec();
+
+    /// learn min_j and scale_j from the range of n residuals (n x d)
+    void train(const float* residual, int n);
+
+    /// write min and scale to dir/sq8
+    void write2Disk(string dir);
+
+    /// load the quantizer written by write2Disk. false if there is none of dimension d
+    bool loadFromDisk(string dir);
+
+    int kind() const { return CODEC_SQ8; }
+    int code_size() const { return (d + 3) / 4 + 1; }
+    void encode(const float* residual, int n, unsigned int* codes);
+    int query_bytes() const;
+    void prepare(const float* q, void* out) const;
+    float ip(const void* prepared, const unsigned int* code) const;
+    float norm2(const unsigned int* code) const;
+    long bytes() const;
+
+private:
+
+    int d;
+    /// smallest value of each dimension. size of d
+    float* vmin;
+    /// step between two codes of each dimension. size of d
+    float* scale;
+};
+
+#endif // SQCODEC_H_INCLUDED
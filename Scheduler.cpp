@@ -0,0 +1,384 @@
+/**
+@file Scheduler.cpp
+@brief this file implements the micro-batching scheduler defined in Scheduler.h
+*/
+#include <cstdio>
+#include <map>
+#include <algorithm>
+
+#include "Scheduler.h"
+#include "SearchEngine.h"
+#include "config.h"
+#include "util.h"
+
+/// queries waiting for a batch, at most
+static const int intake_capacity = 4096;
+/// cell tasks waiting for a worker, at most
+static const int task_capacity = 65536;
+
+/// the queries of one search() call
+struct sched_request
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    /// queries not answered yet
+    int left;
+};
+
+/// a query on its way through the scheduler
+struct sched_query
+{
+    const float* q;
+    int topk;
+    /// submission time, in microseconds
+    double t_submit;
+    /// the lists and codes scanned for q, its coarse and total time. the codes are counted under mutex
+    query_trace trace;
+    long start_ns;
+    /// the cells to scan, the residuals of q against them, its distances to them and its signatures for them, set by the batcher
+    vector<int> cells;
+    vector<float> residuals;
+    vector<float> cell_dists;
+    vector<unsigned int> sigs;
+    /// cells not scanned yet
+    volatile int pending;
+    /// best results of the scanned cells, under mutex
+    vector<Result> res;
+    pthread_mutex_t mutex;
+    sched_request* req;
+    vector<Result>* out;
+};
+
+/// one cell to scan for the queries of a batch probing it
+struct cell_task
+{
+    int cell;
+    vector<sched_query*> queries;
+    /// position of the cell in the probe of each query
+    vector<int> probes;
+};
+
+static bool better(const Result& a, const Result& b)
+{
+    return a.score < b.score;
+}
+
+/// keep the best topk of res, best first
+static void keep_topk(vector<Result>& res, int topk)
+{
+    int n = std::min(std::max(topk, 0), (int)res.size());
+    std::partial_sort(res.begin(), res.begin() + n, res.end(), better);
+    res.erase(res.begin() + n, res.end());
+}
+
+static bool larger_list(const std::pair<int, cell_task*>& a, const std::pair<int, cell_task*>& b)
+{
+    return a.first > b.first;
+}
+
+/// bounds 1, 2, 4 ... up to 'top'
+static vector<double> pow2_bounds(double top)
+{
+    vector<double> bounds;
+    for(double b = 1; b < top; b *= 2)
+        bounds.push_back(b);
+    bounds.push_back(top);
+    return bounds;
+}
+
+
+BatchScheduler::BatchScheduler(SearchEngine* engine_l, int dim, int batch_max_l, int wait_us_l, int nt)
+    : intake(intake_capacity), tasks(task_capacity)
+{
+    engine = engine_l;
+    d = dim;
+    batch_max = std::max(batch_max_l, 1);
+    wait_us = std::max(wait_us_l, 0);
+    nt = std::max(nt, 1);
+
+    pthread_mutex_init(&stats_mutex, NULL);
+    batch_size = histogram(pow2_bounds(batch_max));
+    wait_time = histogram(pow2_bounds(1 << 20));
+
+    pthread_create(&batcher, NULL, &batcher_routine, this);
+    workers.resize(nt);
+    for(int i = 0; i < nt; i++)
+        pthread_create(&workers[i], NULL, &worker_routine, this);
+    printf("Batching up to %d queries for %d us, %d workers.\n", batch_max, wait_us, nt);
+}
+
+BatchScheduler::~BatchScheduler()
+{
+    intake.push(NULL); // the batcher stops the workers once its last batch is queued
+    pthread_join(batcher, NULL);
+    for(unsigned int i = 0; i < workers.size(); i++)
+        pthread_join(workers[i], NULL);
+    printf("%s", stats().c_str());
+    pthread_mutex_destroy(&stats_mutex);
+}
+
+
+void BatchScheduler::search(const float* data, int n, int topk, vector< vector<Result> >& out)
+{
+    out.assign(n, vector<Result>());
+    if(n == 0)
+        return;
+
+    sched_request req;
+    pthread_mutex_init(&req.mutex, NULL);
+    pthread_cond_init(&req.cond, NULL);
+    req.left = n;
+
+    sched_query* queries = new sched_query[n];
+    double now = Util::now_us();
+    for(int i = 0; i < n; i++)
+    {
+        sched_query* q = &queries[i];
+        q->q = data + (long)i*d;
+        q->topk = topk;
+        q->t_submit = now;
+        q->start_ns = clock_ns();
+        q->pending = 0;
+        pthread_mutex_init(&q->mutex, NULL);
+        q->req = &req;
+        q->out = &out[i];
+        intake.push(q);
+    }
+
+    pthread_mutex_lock(&req.mutex);
+    while(req.left > 0)
+        pthread_cond_wait(&req.cond, &req.mutex);
+    pthread_mutex_unlock(&req.mutex);
+
+    for(int i = 0; i < n; i++)
+        pthread_mutex_destroy(&queries[i].mutex);
+    delete[] queries;
+    pthread_mutex_destroy(&req.mutex);
+    pthread_cond_destroy(&req.cond);
+}
+
+
+string BatchScheduler::stats()
+{
+    std::ostringstream os;
+    pthread_mutex_lock(&stats_mutex);
+    long batches = 0, queries = 0;
+    for(unsigned int b = 0; b < batch_size.count.size(); b++)
+        batches += batch_size.count[b];
+    for(unsigned int b = 0; b < wait_time.count.size(); b++)
+        queries += wait_time.count[b];
+
+    os << batches << " batches, " << queries << " queries\n";
+    os << "batch size:\n";
+    for(unsigned int b = 0; b < batch_size.count.size(); b++)
+    {
+        if(batch_size.count[b] == 0)
+            continue;
+        if(b < batch_size.bounds.size())
+            os << "  <= " << batch_size.bounds[b] << ": " << batch_size.count[b] << "\n";
+        else
+            os << "  more: " << batch_size.count[b] << "\n";
+    }
+    os << "wait time (us):\n";
+    for(unsigned int b = 0; b < wait_time.count.size(); b++)
+    {
+        if(wait_time.count[b] == 0)
+            continue;
+        if(b < wait_time.bounds.size())
+            os << "  <= " << wait_time.bounds[b] << ": " << wait_time.count[b] << "\n";
+        else
+            os << "  more: " << wait_time.count[b] << "\n";
+    }
+    pthread_mutex_unlock(&stats_mutex);
+    return os.str();
+}
+
+
+void* BatchScheduler::batcher_routine(void* arg)
+{
+    BatchScheduler* sched = (BatchScheduler*)arg;
+    vector<sched_query*> batch;
+    bool more = true;
+    while(more)
+    {
+        more = sched->gather(batch);
+        if(!batch.empty())
+            sched->dispatch(batch);
+    }
+    for(unsigned int i = 0; i < sched->workers.size(); i++)
+        sched->tasks.push(NULL);
+    return NULL;
+}
+
+void* BatchScheduler::worker_routine(void* arg)
+{
+    BatchScheduler* sched = (BatchScheduler*)arg;
+    while(1)
+    {
+        cell_task* task;
+        sched->tasks.pop(task);
+        if(task == NULL)
+            break;
+        sched->run_task(task);
+        delete task;
+    }
+    return NULL;
+}
+
+
+bool BatchScheduler::gather(vector<sched_query*>& batch)
+{
+    batch.clear();
+    sched_query* q;
+    intake.pop(q);
+    if(q == NULL)
+        return false;
+    batch.push_back(q);
+
+    // the batch closes when full, or wait_us after its first query came
+    double deadline_us = Util::now_us() + wait_us;
+    struct timespec deadline;
+    deadline.tv_sec = (time_t)(deadline_us / 1000000);
+    deadline.tv_nsec = (long)((deadline_us - deadline.tv_sec * 1000000.0) * 1000);
+    if(deadline.tv_nsec >= 1000000000)
+        deadline.tv_nsec = 999999999;
+
+    while((int)batch.size() < batch_max && intake.pop_until(q, deadline))
+    {
+        if(q == NULL)
+            return false;
+        batch.push_back(q);
+    }
+    return true;
+}
+
+
+void BatchScheduler::dispatch(vector<sched_query*>& batch)
+{
+    int nq = batch.size();
+    double now = Util::now_us();
+    pthread_mutex_lock(&stats_mutex);
+    batch_size.add(nq);
+    for(int i = 0; i < nq; i++)
+        wait_time.add(now - batch[i]->t_submit);
+    pthread_mutex_unlock(&stats_mutex);
+
+    // the queries of a batch come from different requests
+    float* data = new float[(long)nq*d];
+    for(int i = 0; i < nq; i++)
+        memcpy(data + (long)i*d, batch[i]->q, sizeof(float)*d);
+    vector<int>* cells = new vector<int>[nq];
+    vector<float>* residuals = new vector<float>[nq];
+    vector<float>* cell_dists = new vector<float>[nq];
+    long start = clock_ns();
+    engine->probe_batch(data, nq, cells, residuals, cell_dists);
+    long coarse = clock_ns() - start; // every query of the batch waits for the whole of it
+    delete[] data;
+
+    // every cell is scanned once for all the queries probing it
+    std::map<int, cell_task*> by_cell;
+    for(int i = 0; i < nq; i++)
+    {
+        sched_query* q = batch[i];
+        q->cells.swap(cells[i]);
+        q->residuals.swap(residuals[i]);
+        q->cell_dists.swap(cell_dists[i]);
+        if(engine->he != NULL)
+        {
+            q->sigs.resize(q->cells.size());
+            engine->query_sigs(q->q, &q->cells[0], q->cells.size(), &q->sigs[0]);
+        }
+        q->pending = q->cells.size();
+        q->trace.t[STAGE_COARSE] = coarse;
+        q->trace.lists = q->cells.size();
+        for(unsigned int g = 0; g < q->cells.size(); g++)
+        {
+            cell_task*& task = by_cell[q->cells[g]];
+            if(task == NULL)
+            {
+                task = new cell_task;
+                task->cell = q->cells[g];
+            }
+            task->queries.push_back(q);
+            task->probes.push_back(g);
+        }
+    }
+    delete[] cells;
+    delete[] residuals;
+    delete[] cell_dists;
+
+    // nothing to scan
+    for(int i = 0; i < nq; i++)
+    {
+        if(batch[i]->pending == 0)
+        {
+            batch[i]->pending = 1;
+            cell_done(batch[i]);
+        }
+    }
+
+    // the largest lists first, so that the workers end at about the same time
+    vector< std::pair<int, cell_task*> > order;
+    for(std::map<int, cell_task*>::iterator it = by_cell.begin(); it != by_cell.end(); it++)
+        order.push_back(std::make_pair(engine->cell_size(it->first), it->second));
+    std::stable_sort(order.begin(), order.end(), larger_list);
+    for(unsigned int t = 0; t < order.size(); t++)
+        tasks.push(order[t].second);
+}
+
+
+void BatchScheduler::run_task(cell_task* task)
+{
+    int nr = task->queries.size();
+    float* res = new float[(long)nr*d];
+    float* dists = new float[nr];
+    unsigned int* sigs = (engine->he != NULL) ? new unsigned int[nr] : NULL;
+    for(int r = 0; r < nr; r++)
+    {
+        memcpy(res + (long)r*d, &task->queries[r]->residuals[task->probes[r]*d], sizeof(float)*d);
+        dists[r] = task->queries[r]->cell_dists[task->probes[r]];
+        if(sigs != NULL)
+            sigs[r] = task->queries[r]->sigs[task->probes[r]];
+    }
+
+    vector<Result>* ret = new vector<Result>[nr];
+    engine->scan_cell(task->cell, res, dists, sigs, nr, ret);
+    delete[] res;
+    delete[] dists;
+    delete[] sigs;
+    int codes = engine->cell_size(task->cell);
+
+    for(int r = 0; r < nr; r++)
+    {
+        sched_query* q = task->queries[r];
+        keep_topk(ret[r], engine->rerank_depth(q->topk));
+        pthread_mutex_lock(&q->mutex);
+        q->res.insert(q->res.end(), ret[r].begin(), ret[r].end());
+        q->trace.codes += codes;
+        pthread_mutex_unlock(&q->mutex);
+        cell_done(q);
+    }
+    delete[] ret;
+}
+
+
+void BatchScheduler::cell_done(sched_query* q)
+{
+    if(__sync_sub_and_fetch(&q->pending, 1) > 0)
+        return;
+
+    // the last cell: no other thread touches q anymore
+    long t = clock_ns();
+    engine->rerank(q->q, q->res, q->topk);
+    if(engine->rerank_depth(q->topk) > q->topk)
+        q->trace.lap(STAGE_RERANK, t);
+    q->out->swap(q->res);
+    q->trace.t[STAGE_TOTAL] = clock_ns() - q->start_ns;
+    engine->stats.add(q->trace);
+
+    sched_request* req = q->req; // q may be released as soon as the request is done
+    pthread_mutex_lock(&req->mutex);
+    if(--req->left == 0)
+        pthread_cond_signal(&req->cond);
+    pthread_mutex_unlock(&req->mutex);
+}
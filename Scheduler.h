@@ -0,0 +1,115 @@
+/**
+@file Scheduler.h
+@brief This file defines the micro-batching scheduler of the search server. Queries coming one by
+one from the connections are gathered into small batches, which are assigned to coarse cells at
+once and scanned cell by cell: each list is read once for all the queries of the batch probing it.
+*/
+
+#ifndef SCHEDULER_H_INCLUDED
+#define SCHEDULER_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "MPMCQueue.h"
+#include "result.h"
+
+using std::string;
+using std::vector;
+
+class SearchEngine;
+struct sched_query;
+struct cell_task;
+
+
+/// counts of values falling into bins
+struct histogram
+{
+    /// upper bound (inclusive) of each bin but the last, which takes everything above
+    vector<double> bounds;
+    vector<long> count;
+
+    histogram() {}
+    histogram(const vector<double>& bounds_l) : bounds(bounds_l), count(bounds_l.size() + 1, 0) {}
+
+    void add(double v)
+    {
+        unsigned int b = 0;
+        while(b < bounds.size() && v > bounds[b])
+            b++;
+        count[b]++;
+    }
+};
+
+
+/**
+A batch is closed when it holds batch_max queries, or when its first query has waited wait_us
+microseconds. Its cells are then handed to the workers through a lock-free queue, largest list
+first. The coarse and total time of each query, and the lists and codes it scanned, are added to
+the statistics of the engine: the stages in between are shared by the batch.
+@brief gathers queries into micro-batches and scans them with a set of workers
+*/
+class BatchScheduler
+{
+public:
+
+    /**
+    @param engine the engine to search with, with its index loaded
+    @param dim dimension of the queries
+    @param batch_max the most queries in a batch
+    @param wait_us the longest a query waits for its batch to fill, in microseconds
+    @param nt number of workers scanning the cells
+    */
+    BatchScheduler(SearchEngine* engine, int dim, int batch_max, int wait_us, int nt);
+
+    /// stop the batcher and the workers
+    ~BatchScheduler();
+
+    /**
+    @brief search n queries, blocking till all are answered. safe to call from several threads
+    @param data the queries, normalized. n x d
+    @param out out[i] keeps the topk results of query i, best first
+    */
+    void search(const float* data, int n, int topk, vector< vector<Result> >& out);
+
+    /// batch size and queueing time histograms, as text
+    string stats();
+
+private:
+
+    SearchEngine* engine;
+    int d;
+    int batch_max;
+    int wait_us;
+    /// queries submitted, not yet in a batch. NULL stops the batcher
+    BlockingQueue<sched_query*> intake;
+    /// cells of the running batches to scan. NULL stops a worker
+    BlockingQueue<cell_task*> tasks;
+    pthread_t batcher;
+    vector<pthread_t> workers;
+
+    /// protects the histograms
+    pthread_mutex_t stats_mutex;
+    /// number of queries per batch
+    histogram batch_size;
+    /// time from submission to the closing of the batch, in microseconds
+    histogram wait_time;
+
+    static void* batcher_routine(void* arg);
+    static void* worker_routine(void* arg);
+
+    /// gather the next batch, waiting for its first query. false on stop
+    bool gather(vector<sched_query*>& batch);
+
+    /// assign the batch to cells and queue its cell tasks
+    void dispatch(vector<sched_query*>& batch);
+
+    /// scan one cell for its queries
+    void run_task(cell_task* task);
+
+    /// one cell less to scan for q. the last one keeps its topk and wakes the caller
+    void cell_done(sched_query* q);
+};
+
+#endif // SCHEDULER_H_INCLUDED
@@ -9,11 +9,13 @@
 #include <vector>
 #include <set>
 #include <algorithm>
+#include <functional>
 
 #include "Vocab.h"
 #include "IO.h"
 #include "result.h"
 #include "SearchEngine.h"
+#include "Index.h"
 
 
 using std::string;
@@ -44,6 +46,8 @@ struct norm_args
     int size_voc;
     float* idf;
     float* word_hist;
+    /// codes of the entry being read, under the mutex. size of nsq
+    unsigned int* code;
 
     // out
     float* norm;
@@ -53,17 +57,34 @@ struct norm_args
 extern Config con;
 
 /// init variables
-SearchEngine::SearchEngine(Vocab* vocab, PQCluster* rvocab)
+SearchEngine::SearchEngine(Vocab* vocab, ResidualCodec* rvocab)
 {
     this->voc = vocab;
+    this->mvoc = NULL;
     this->rvoc = rvocab;
+    init(voc->num_leaf);
+}
+
+/// init variables, searching with the inverted multi-index
+SearchEngine::SearchEngine(MultiVocab* mvocab, ResidualCodec* rvocab)
+{
+    this->voc = NULL;
+    this->mvoc = mvocab;
+    this->rvoc = rvocab;
+    init(mvoc->num_leaf);
+}
 
-    size_voc = voc->num_leaf;
+/// shared part of the constructors
+void SearchEngine::init(int voc_size)
+{
+    size_voc = voc_size;
 
     num_entries = new int[size_voc];
     memset(num_entries, 0, sizeof(int)*size_voc);
+    mem.alloc(MEM_LISTS, sizeof(int)*size_voc);
 
     index = new Entry*[size_voc];
+    mem.alloc(MEM_LISTS, sizeof(Entry*)*size_voc);
     for(int i = 0; i < size_voc; i++)
         index[i] = NULL;
 
@@ -71,15 +92,48 @@ SearchEngine::SearchEngine(Vocab* vocab, PQCluster* rvocab)
     idf = NULL;
     norm = NULL;
     im_db.clear();
+    refined = false;
+    cell_rmax = NULL;
+    he = NULL;
+    sigs = NULL;
+    pthread_mutex_init(&shard_mutex, NULL);
 }
 
 ///deletes things newed
 SearchEngine::~SearchEngine()
 {
-    for(int i = 0; i < voc->num_leaf; i++)
+    for(int i = 0; i < size_voc; i++)
+    {
         delete[] index[i];
+        if(sigs != NULL)
+            delete[] sigs[i];
+    }
     delete[] index;
+    delete[] sigs;
     delete[] num_entries;
+    for(unsigned int s = 0; s < shards.size(); s++)
+    {
+        delete shards[s]->worker;
+        for(int i = 0; i < size_voc; i++)
+        {
+            delete[] shards[s]->index[i];
+            delete[] shards[s]->codes[i];
+            if(shards[s]->sigs != NULL)
+                delete[] shards[s]->sigs[i];
+        }
+        delete[] shards[s]->index;
+        delete[] shards[s]->num_entries;
+        delete[] shards[s]->codes;
+        delete[] shards[s]->sigs;
+        delete shards[s];
+    }
+    pthread_mutex_destroy(&shard_mutex);
+    for(unsigned int p = 0; p < refine.size(); p++)
+    {
+        delete[] refine[p].vec;
+        delete refine[p].cvec;
+    }
+    delete[] cell_rmax;
     delete[] idf;
     delete[] norm;
     im_db.clear();
@@ -95,10 +149,249 @@ void SearchEngine::loadIndexes(string dir)
 {
     idxList = IO::getFolders(dir);
     cout << dir << " " << idxList.size() << endl;
+    refined = con.rerank > 0;
+    // the entries are filtered with all the indexes or none
+    for(unsigned int i = 0; i < idxList.size() && he != NULL; i++)
+    {
+        if(IO::f_exists(idxList[i] + "/sig"))
+            continue;
+        printf("no signatures in %s, the entries are not filtered.\n", idxList[i].c_str());
+        he = NULL;
+    }
+    if(he != NULL)
+    {
+        init_embedding();
+        sigs = new unsigned int*[size_voc];
+        mem.alloc(MEM_SIGS, sizeof(unsigned int*)*size_voc);
+        for(int i = 0; i < size_voc; i++)
+            sigs[i] = NULL;
+    }
     for(unsigned int i = 0; i < idxList.size(); i++) // load all indexes under dir
+    {
+        int first = tot_ims;
         loadSingleIndex(idxList[i]);
+        if(refined && !loadRefine(idxList[i], first, tot_ims - first))
+        {
+            printf("no refine vectors in %s, the results are not re-ranked.\n", idxList[i].c_str());
+            refined = false;
+        }
+    }
+    // the results are re-ranked with all the indexes or none
+    if(!refined)
+    {
+        for(unsigned int p = 0; p < refine.size(); p++)
+        {
+            delete[] refine[p].vec;
+            delete refine[p].cvec;
+        }
+        refine.clear();
+        mem.set(MEM_REFINE, 0);
+    }
+    if(con.prune)
+        init_bounds();
     // update other fields: idf, norms
     //update();
+    print_memory();
+}
+
+/// compute cell_rmax from the loaded lists
+void SearchEngine::init_bounds()
+{
+    cell_rmax = new float[size_voc];
+    mem.alloc(MEM_LISTS, sizeof(float)*size_voc);
+    for(int i = 0; i < size_voc; i++)
+    {
+        float bn2_max = 0.0f;
+        for(int j = 0; j < num_entries[i]; j++)
+            bn2_max = std::max(bn2_max, rvoc->norm2(index[i][j].residual_id));
+        cell_rmax[i] = sqrt(bn2_max);
+    }
+}
+
+/// set the thresholds of he for the centroids of voc
+void SearchEngine::init_embedding()
+{
+    int d = con.dim;
+    float* zero = new float[d];
+    float* center = new float[d];
+    memset(zero, 0, sizeof(float)*d);
+    for(int i = 0; i < size_voc; i++)
+    {
+        // the centroid in the format it is kept in, as the residuals of the index were computed
+        voc->residual(zero, i, center);
+        for(int j = 0; j < d; j++)
+            center[j] = -center[j];
+        he->set_center(i, center);
+    }
+    delete[] zero;
+    delete[] center;
+}
+
+/**
+@brief signatures of query q for its cells, to compare with those of the entries. nothing is done without he
+@param q the query, normalized. size of d
+@param out keeps the signature of q for each cell. size of ncell
+*/
+void SearchEngine::query_sigs(const float* q, const int* cells, int ncell, unsigned int* out)
+{
+    if(he == NULL)
+        return;
+    // the query is projected once, each cell only moves the thresholds
+    float pq[32];
+    he->project(q, pq);
+    for(int g = 0; g < ncell; g++)
+        out[g] = he->sign_projected(pq, cells[g]);
+}
+
+/**
+@brief whether no entry of 'cell' can score better than 'bound', with con.prune
+@param q_residual raw residual of the query against the centroid of the cell. size of d
+*/
+bool SearchEngine::pruned(int cell, const float* q_residual, float bound)
+{
+    if(cell_rmax == NULL)
+        return false;
+    // the score of an entry is |q - b|^2 >= (|q| - |b|)^2, and |b| is at most cell_rmax in the list
+    float qn2;
+    Util::sq_norms(q_residual, 1, con.dim, con.dim, &qn2);
+    float gap = sqrt(qn2) - cell_rmax[cell];
+    return gap > 0 && gap*gap > bound;
+}
+
+/// keep the depth best of ret, and return the score of the worst of them. 1e30 while there are fewer
+float SearchEngine::keep_best(vector<Result*>& ret, int depth)
+{
+    if((int)ret.size() < depth || depth <= 0)
+        return 1e30f;
+    std::nth_element(ret.begin(), ret.begin() + depth - 1, ret.end(), Result::compare);
+    ret.resize(depth);
+    return ret[depth - 1]->score;
+}
+
+/// load the refine vectors of the index of 'dir', its first vector has id 'first'. false when there are none
+bool SearchEngine::loadRefine(string dir, int first, int n)
+{
+    refine_part part = {first, n, NULL, NULL};
+    if(IO::f_exists(dir + "/refine"))
+    {
+        int row, col;
+        part.vec = IO::loadFMat(dir + "/refine", row, col, -1);
+        assert(row == n && col == con.dim);
+        mem.alloc(MEM_REFINE, sizeof(float)*n*col);
+    }
+    else
+    {
+        const int fmts[3] = {FMT_FP16, FMT_BF16, FMT_INT8};
+        for(int f = 0; f < 3 && part.cvec == NULL; f++)
+            part.cvec = CompactMat::loadFromDisk(dir + "/refine." + CompactMat::fmt_name(fmts[f]));
+        if(part.cvec == NULL)
+            return false;
+        assert(part.cvec->n == n && part.cvec->d == con.dim);
+        mem.alloc(MEM_REFINE, part.cvec->bytes());
+    }
+    refine.push_back(part);
+    return true;
+}
+
+/// squared distance between q and the refine vector of 'id', 1 - <q, v> with METRIC_IP
+float SearchEngine::refine_dist(const float* q, int id)
+{
+    // the last index whose first id is not above id
+    int lo = 0, hi = refine.size() - 1;
+    while(lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        if(refine[mid].first <= id)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    const refine_part& part = refine[lo];
+    if(con.metric == METRIC_IP)
+        return 1.0f - ((part.cvec != NULL) ? part.cvec->dot(q, id - part.first)
+                                           : Util::dot(q, part.vec + (long)(id - part.first)*con.dim, con.dim));
+    if(part.cvec != NULL)
+        return part.cvec->dist_l2_sq(q, id - part.first);
+
+    int d = con.dim;
+    const float* v = part.vec + (long)(id - part.first)*d;
+    float dist = 0.0f;
+    for(int j = 0; j < d; j++)
+        dist += (q[j] - v[j])*(q[j] - v[j]);
+    return dist;
+}
+
+/// number of ADC results to keep for rerank(): con.rerank when every index has its refine vectors, else topk
+int SearchEngine::rerank_depth(int topk)
+{
+    return refined ? std::max(topk, con.rerank) : topk;
+}
+
+static bool result_less(const Result& a, const Result& b)
+{
+    return a.score < b.score;
+}
+
+/**
+@brief score the best rerank_depth(topk) results of res again with the refine vectors, and keep the topk best of them
+@param q the query, normalized. size of d
+@param res the results of ADC, in any order. comes out with the topk best, best first
+*/
+void SearchEngine::rerank(const float* q, vector<Result>& res, int topk)
+{
+    int m = std::min(rerank_depth(topk), (int)res.size());
+    std::partial_sort(res.begin(), res.begin() + m, res.end(), result_less);
+    res.erase(res.begin() + m, res.end());
+    if(refined)
+    {
+        for(int j = 0; j < m; j++)
+            res[j].score = refine_dist(q, res[j].im_id);
+        std::sort(res.begin(), res.end(), result_less);
+    }
+    res.erase(res.begin() + std::min(topk, m), res.end());
+}
+
+/// rerank() on the results of a query_ctx, which come out with the topk best first and nothing else
+void SearchEngine::rerank(const float* q, vector<Result*>& ret, int topk)
+{
+    int m = std::min(rerank_depth(topk), (int)ret.size());
+    std::partial_sort(ret.begin(), ret.begin() + m, ret.end(), Result::compare);
+    ret.resize(m);
+    if(refined)
+    {
+        for(int j = 0; j < m; j++)
+            ret[j]->score = refine_dist(q, ret[j]->im_id);
+        std::sort(ret.begin(), ret.end(), Result::compare);
+    }
+    ret.resize(std::min(topk, m));
+}
+
+/**
+@brief print the memory held by each component, per indexed vector, and the largest lists
+@param top number of lists printed
+*/
+void SearchEngine::print_memory(int top)
+{
+    // the codebooks are loaded before the engine is built, and can be replaced while it lives
+    mem.set(MEM_COARSE, (mvoc != NULL) ? mvoc->bytes() : voc->bytes());
+    mem.set(MEM_GRAPH, (voc != NULL && voc->graph != NULL) ? voc->graph->bytes() : 0);
+    mem.set(MEM_PQ, rvoc->bytes() + ((he != NULL) ? he->bytes() : 0));
+    mem.print(tot_ims);
+
+    vector< std::pair<int, int> > lists; // (entries, cell)
+    long tot = 0;
+    for(int i = 0; i < size_voc; i++)
+    {
+        lists.push_back(std::make_pair(num_entries[i], i));
+        tot += num_entries[i];
+    }
+    top = std::min(top, size_voc);
+    std::partial_sort(lists.begin(), lists.begin() + top, lists.end(), std::greater< std::pair<int, int> >());
+    long entry_bytes = sizeof(Entry) + sizeof(unsigned int)*(Index::entry_size(rvoc) + (sigs != NULL));
+    printf("largest lists of %ld entries:\n", tot);
+    for(int i = 0; i < top; i++)
+        printf("  cell %8d: %10d entries, %12ld bytes, %5.1f%% of the entries\n", lists[i].second, lists[i].first,
+               lists[i].first * entry_bytes, tot ? 100.0 * lists[i].first / tot : 0.0);
 }
 
 /**
@@ -129,89 +422,691 @@ void SearchEngine::search_dir(string dir, string out_file, string out_file2, int
     }
     std::cout << "normalize finished..." << std::endl;
 
-    // quantize descriptors to coarse codebook
-    // enrtylist is the coarse quantize result list
-    int len;
-    Entry* entrylist = voc->quantizeFile(data, len, con.nt, con.ma, con.dim, n);
+    int* cells = new int[max_cells()];
+    float* cell_dists = new float[max_cells()];
+    unsigned int* q_sigs = (he != NULL) ? new unsigned int[max_cells()] : NULL;
+    vector<float> residuals;
 
-    vector<Result*> ret;
+    query_ctx ctx;
+    vector<Result*>& ret = ctx.ret;
+    stats.clear();
     for(unsigned int i = 0; i < n; i++)//loop for every query im in directory
     {
         //std::cout << "i: " << i << std::endl;
+        query_trace trace;
+        long start = clock_ns(), t = start;
+        query_budget budget = budget_of(start);
+        query_budget* limit = budget.limited() ? &budget : NULL;
         string filename = *(query_db[i]);
         fprintf(fout_result, "%s", filename.c_str());
 
-        // result entry for coarse search.
-        // for each res in entry list, get res vec accroding to inverted index.
-        // iterator vectors in the word cell.
-        // word_pos is the start word cell position for query i.
-        int word_pos = i*con.ma;
-        for(int g=0; g < (con.ma); g++)
+        int ncell = probe(data+i*d, cells, cell_dists, residuals);
+        query_sigs(data+i*d, cells, ncell, q_sigs);
+        t = trace.lap(STAGE_COARSE, t);
+        if(shards.empty())
         {
-            int coa_word_id = entrylist[word_pos+g].id;
-            float* coarse_res = voc->vec+(d*coa_word_id);
-            float tmp_dist = Util::dist_l2_sq(coarse_res, data+i*d, d);
-
-            fprintf(fout_coarse_result, "%d  coarse_word: %d  distance: %.4f    %s ", i+1, coa_word_id, tmp_dist, filename.c_str());
-            //std::cout << i+1 << " " << " coa_word: " << coa_word_id << "  " << filename  << "  ";
-            for(int f=0; f < num_entries[coa_word_id]; f++)
+            // iterator vectors in the word cell, nearest cell first
+            for(int g=0; g < ncell; g++)
             {
-                // read result entries number. 
-                Result* tmp = new Result;
-                Entry res_tmp = (index[coa_word_id][f]);
-                //std::cout << im_db[res_tmp.id] << " ";
-
-
-                // output coarse quantize result.
-
-                fprintf(fout_coarse_result, "%s ", (im_db[res_tmp.id]).c_str());
-
-                // get result vector's residual vector.
-                float* res_residual = new float[rvoc->get_nsq()*rvoc->get_ds()];
-                int counter = 0;
-                for(int x=0; x < rvoc->get_nsq(); x++)
-                {
-                    float* subcenter = rvoc->subvec(x)+(rvoc->get_ds()*res_tmp.residual_id[x]);
-                    for(int e = 0; e < rvoc->get_ds(); e++)
-                    {
-                        res_residual[counter++] = subcenter[e];
-                    }
-                }
-
-
-                Util::normalize(entrylist[word_pos+g].residual_vec, d);
-                Util::normalize(res_residual, d);
-                tmp->score = Util::dist_l2_sq(entrylist[word_pos+g].residual_vec, res_residual, d);
-                //std::cout << "score: " << tmp->score << std::endl;
-                tmp->im_id = res_tmp.id; 
-                ret.push_back(tmp);
-
+                if(con.prune && pruned(cells[g], &residuals[g*d], keep_best(ret, rerank_depth(topk))))
+                    continue;
+                fprintf(fout_coarse_result, "%d  coarse_word: %d  distance: %.4f    %s ", i+1, cells[g], cell_dists[g], filename.c_str());
+                scan_list(index[cells[g]], num_entries[cells[g]], &residuals[g*d], cell_dists[g], (sigs != NULL) ? sigs[cells[g]] : NULL,
+                          (q_sigs != NULL) ? q_sigs[g] : 0, ctx, fout_coarse_result, &trace, limit);
+                fprintf(fout_coarse_result, "\n");
             }
-            //std::cout << "\n";
-            fprintf(fout_coarse_result, "\n");
+            t = clock_ns();
+        }
+        else
+        {
+            // the shards are scanned at the same time, the names of the scanned entries are not kept
+            for(int g=0; g < ncell; g++)
+                fprintf(fout_coarse_result, "%d  coarse_word: %d  distance: %.4f    %s\n", i+1, cells[g], cell_dists[g], filename.c_str());
+            if(ncell > 0)
+                scan_shards(cells, &residuals[0], cell_dists, q_sigs, ncell, rerank_depth(topk), ctx, limit);
+            t = trace_shards(trace, ncell, t);
+        }
+        trace.partial = !budget.complete;
+        if(refined)
+        {
+            rerank(data+i*d, ret, topk);
+            t = trace.lap(STAGE_RERANK, t);
         }
 
         std::sort(ret.begin(), ret.end(), Result::compare);
+        t = trace.lap(STAGE_TOPK, t);
         for(vector<Result*>::iterator it = ret.begin(); it != min(ret.end(), ret.begin()+topk); it++)
         {
             fprintf(fout_result, " %s %.6f ", (im_db[(*it)->im_id]).c_str(), (*it)->score);
         }
+        // the results of a query cut by its budget are the best of the codes scanned
+        if(trace.partial)
+            fprintf(fout_result, " partial");
         fprintf(fout_result, "\n");
 
-        for(unsigned int j = 0; j < ret.size(); j++)
-            delete ret[j];
-        ret.clear();
+        ctx.reset();
+        trace.lap(STAGE_OUTPUT, t);
+        trace.t[STAGE_TOTAL] = clock_ns() - start;
+        stats.add(trace);
     } // end for i
 
-    delete[] entrylist;
+    delete[] cells;
+    delete[] cell_dists;
+    delete[] q_sigs;
 
+    delete[] data;
+    for(unsigned int i = 0; i < query_db.size(); i++)
+        delete query_db[i];
     printf("\n");
 
+    string report = out_file + ".latency.json";
+    FILE* fout_report = fopen(report.c_str(), "w");
+    IO::chkFileErr(fout_report, report);
+    fprintf(fout_report, "%s", stats.json().c_str());
+    fclose(fout_report);
+    printf("Latency report written to %s\n", report.c_str());
+
     fclose(fout_coarse_result);
     fclose(fout_result);
 }
 
 
+/**
+@brief search the topk nearest indexed vectors of one query. safe to call from several threads
+@param q the query, normalized. size of d
+@param topk number of results to keep
+@param out keeps the results, best first
+@return false when the budget of the query (con.scan_budget, con.deadline_us) ran out before all its cells were scanned
+*/
+bool SearchEngine::search(const float* q, int topk, vector<Result>& out)
+{
+    int d = con.dim;
+    query_ctx ctx;
+    vector<Result*>& ret = ctx.ret;
+    int* cells = ctx.arena.alloc<int>(max_cells());
+    float* cell_dists = ctx.arena.alloc<float>(max_cells());
+    vector<float> residuals;
+    query_trace trace;
+    long start = clock_ns(), t = start;
+    query_budget budget = budget_of(start);
+    query_budget* limit = budget.limited() ? &budget : NULL;
+
+    int ncell = probe(q, cells, cell_dists, residuals);
+    unsigned int* q_sigs = (he != NULL) ? ctx.arena.alloc<unsigned int>(ncell) : NULL;
+    query_sigs(q, cells, ncell, q_sigs);
+    t = trace.lap(STAGE_COARSE, t);
+    // the cells are scanned nearest first, so that the budget is spent on the most likely ones
+    if(shards.empty())
+    {
+        for(int g=0; g < ncell; g++)
+        {
+            if(con.prune && pruned(cells[g], &residuals[g*d], keep_best(ret, rerank_depth(topk))))
+                continue;
+            scan_list(index[cells[g]], num_entries[cells[g]], &residuals[g*d], cell_dists[g], (sigs != NULL) ? sigs[cells[g]] : NULL,
+                      (q_sigs != NULL) ? q_sigs[g] : 0, ctx, NULL, &trace, limit);
+        }
+        t = clock_ns();
+    }
+    else
+    {
+        if(ncell > 0)
+            scan_shards(cells, &residuals[0], cell_dists, q_sigs, ncell, rerank_depth(topk), ctx, limit);
+        t = trace_shards(trace, ncell, t);
+    }
+    trace.partial = !budget.complete;
+    if(refined)
+    {
+        rerank(q, ret, topk);
+        t = trace.lap(STAGE_RERANK, t);
+    }
+
+    long scratch = ctx.arena.reserved() + sizeof(Result*)*ret.capacity() + sizeof(float)*residuals.capacity();
+    mem.add(MEM_SCRATCH, scratch);
+
+    int n = std::min(topk, (int)ret.size());
+    std::partial_sort(ret.begin(), ret.begin() + n, ret.end(), Result::compare);
+    out.clear();
+    for(int j = 0; j < n; j++)
+        out.push_back(*ret[j]);
+    trace.lap(STAGE_TOPK, t);
+    mem.sub(MEM_SCRATCH, scratch);
+    trace.t[STAGE_TOTAL] = clock_ns() - start;
+    stats.add(trace);
+    return budget.complete;
+}
+
+/**
+@brief count the lists probed and the codes scanned on the shards, and their time since 'start' as scan time
+@return the time now
+*/
+long SearchEngine::trace_shards(query_trace& trace, int ncell, long start)
+{
+    // the shards build their tables and scan in parallel, their time is not split
+    trace.lists += ncell;
+    for(unsigned int s = 0; s < shards.size(); s++)
+        trace.codes += (ncell > 0) ? shards[s]->scanned : 0;
+    return trace.lap(STAGE_SCAN, start);
+}
+
+/// the budget of a query started at 'start', from con.scan_budget and con.deadline_us
+query_budget SearchEngine::budget_of(long start)
+{
+    return query_budget(con.scan_budget, con.deadline_us > 0 ? start + con.deadline_us*1000 : 0);
+}
+
+/// the most cells probe() can return
+int SearchEngine::max_cells()
+{
+    // every cell visited by the multi-index holds at least one of the imi_budget candidates
+    return (mvoc == NULL) ? con.ma : std::min(size_voc, con.imi_budget);
+}
+
+/**
+@brief select the cells to scan for query q
+@param q the query. size of d
+@param cells keeps the cells, nearest first. size of max_cells()
+@param cell_dists keeps the squared distance of q to each cell. size of max_cells()
+@param residuals keeps the normalized residual of q against each cell. ncell x d
+@return ncell, number of cells to scan
+*/
+int SearchEngine::probe(const float* q, int* cells, float* cell_dists, vector<float>& residuals)
+{
+    int d = con.dim;
+    int ncell;
+    bool by_ip = (con.metric == METRIC_IP);
+    if(mvoc == NULL)
+    {
+        // the inner products with all the centroids are as cheap as the scan by l2
+        if(by_ip)
+            voc->quantize2leaf_batch(q, 1, con.ma, cells, cell_dists);
+        else
+        {
+            voc->quantize2leaf((float*)q, cells, 1, 0, con.ma);
+            for(int g=0; g < con.ma; g++)
+                cell_dists[g] = voc->dist2leaf(q, cells[g]);
+        }
+        ncell = adaptive_cells(cell_dists, con.ma);
+        residuals.resize(ncell*d);
+        for(int g=0; g < ncell && !by_ip; g++)
+            voc->residual(q, cells[g], &residuals[g*d]);
+    }
+    else
+    {
+        // visit the cells of the multi-index nearest first, till imi_budget candidates are collected
+        // there is no multi-index with METRIC_IP, see main.cpp
+        ncell = mvoc->multi_sequence(q, num_entries, con.imi_budget, max_cells(), cells, cell_dists);
+        residuals.resize(ncell*d);
+        for(int g=0; g < ncell; g++)
+            mvoc->residual(q, cells[g], &residuals[g*d]);
+    }
+    // with METRIC_IP, every cell is scored with the query itself
+    if(by_ip)
+    {
+        for(int g=0; g < ncell; g++)
+            memcpy(&residuals[g*d], q, sizeof(float)*d);
+        return ncell;
+    }
+    // the full score is computed on the raw residuals
+    for(int g=0; g < ncell && !con.adc_full; g++)
+        Util::normalize(&residuals[g*d], d);
+    return ncell;
+}
+
+
+/**
+@brief score every entry of an inverted list against the query residual
+@param list the entries to score
+@param n number of entries
+@param q_residual normalized residual of the query against the centroid of the list, the query itself with METRIC_IP. size of d
+@param cell_dist distance of the query to the centroid of the list, see probe(). the scores start from it with METRIC_IP
+@param sigs the signatures of the entries, NULL to score all of them. size of n
+@param q_sig signature of the query for the list. entries more than con.ht bits away from it are skipped
+@param ret the scored entries are appended to ret
+@param fout_coarse_result names of scanned entries are written here, unless NULL
+@param trace the time of the table and of the scan is added to it, unless NULL
+@param budget only the entries it allows are scanned, unless NULL
+*/
+void SearchEngine::scan_list(const Entry* list, int n, const float* q_residual, float cell_dist, const unsigned int* sigs, unsigned int q_sig,
+                             query_ctx& ctx, FILE* fout_coarse_result, query_trace* trace, query_budget* budget)
+{
+    if(budget != NULL && (n = budget->take(n)) == 0)
+        return;
+    long start = (trace != NULL) ? clock_ns() : 0;
+    int d = con.dim;
+    // pq codes are scored by the loop below, the other codecs through ResidualCodec
+    PQCluster* pq = (rvoc->kind() == CODEC_PQ) ? static_cast<PQCluster*>(rvoc) : NULL;
+    int nsq = rvoc->code_size();
+    int ks = (pq != NULL) ? pq->get_ks() : 0;
+    bool by_ip = (con.metric == METRIC_IP);
+    float qn2 = 0.0f;
+    if(!by_ip)
+        Util::sq_norms(q_residual, 1, d, d, &qn2);
+
+    // the score is the distance between the normalized query residual q and the normalized
+    // reconstruction b: |q|^2 - 2<q,b>/|b| + 1. <q,b> and |b|^2 both add up over the
+    // subquantizers, so they are read from tables instead of reconstructing b.
+    // with METRIC_IP the score is 1 - <q, c + b> / |c + b| for the query q itself: its table is the
+    // same for all the cells, and 1/|c + b| is stored after the code at index time.
+    void* prepared = by_ip ? ctx.table : NULL;
+    if(prepared == NULL)
+    {
+        prepared = ctx.arena.alloc<char>(rvoc->query_bytes());
+        rvoc->prepare(q_residual, prepared);
+        if(by_ip)
+            ctx.table = prepared;
+    }
+    const float* table = (pq != NULL) ? (const float*)prepared : NULL;
+    // with polysemous codebooks, the codes near the one of the query have their centroids near it too
+    unsigned int* q_code = NULL;
+    if(con.poly_ht > 0 && pq != NULL)
+    {
+        q_code = ctx.arena.alloc<unsigned int>(nsq);
+        pq->table_code(table, by_ip, q_code);
+    }
+    const float* norms = (pq != NULL) ? pq->get_norms() : NULL;
+    if(trace != NULL)
+        start = trace->lap(STAGE_TABLES, start);
+
+    Result* res = ctx.arena.alloc<Result>(n);
+    int f;
+    for(f=0; f < n; f++)
+    {
+        // a long list is cut when the deadline passes in the middle of it
+        if(budget != NULL && (f & 1023) == 1023 && budget->expired())
+            break;
+
+        // the signatures are read in a row, most entries stop at them without touching their codes
+        if(sigs != NULL && __builtin_popcount(sigs[f] ^ q_sig) > con.ht)
+            continue;
+        if(q_code != NULL && PQCluster::hamming(list[f].residual_id, q_code, nsq) > con.poly_ht)
+            continue;
+
+        // read result entries number. 
+        Result* tmp = res + f;
+        const Entry& res_tmp = list[f];
+
+        // output coarse quantize result.
+        if(fout_coarse_result != NULL)
+            fprintf(fout_coarse_result, "%s ", (im_db[res_tmp.id]).c_str());
+
+        float ip = 0.0f, bn2 = 0.0f;
+        if(pq == NULL)
+        {
+            ip = rvoc->ip(prepared, res_tmp.residual_id);
+            if(!by_ip)
+                bn2 = rvoc->norm2(res_tmp.residual_id);
+        }
+        else if(by_ip)
+        {
+            for(int x=0; x < nsq; x++)
+                ip += table[x*ks + res_tmp.residual_id[x]];
+        }
+        else
+        {
+            for(int x=0; x < nsq; x++)
+            {
+                int c = x*ks + res_tmp.residual_id[x];
+                ip += table[c];
+                bn2 += norms[c];
+            }
+        }
+        tmp->score = by_ip ? ip_score(cell_dist, ip, res_tmp.residual_id + nsq) : adc_score(qn2, ip, bn2);
+        tmp->im_id = res_tmp.id; 
+        ctx.ret.push_back(tmp);
+    }
+    if(trace != NULL)
+    {
+        trace->lap(STAGE_SCAN, start);
+        trace->lists++;
+        trace->codes += f;
+    }
+}
+
+/**
+@brief scan_list for several query residuals at once: each entry is read once for all of them
+@param residuals the normalized query residuals against the centroid of the list. nr x d
+@param ret ret[r] gets the scored entries of residual r. size of nr
+*/
+void SearchEngine::scan_list_multi(const Entry* list, int n, const float* residuals, const float* cell_dists, const unsigned int* sigs,
+                                   const unsigned int* q_sigs, int nr, vector<Result>* ret)
+{
+    int d = con.dim;
+    PQCluster* pq = (rvoc->kind() == CODEC_PQ) ? static_cast<PQCluster*>(rvoc) : NULL;
+    int nsq = rvoc->code_size();
+    int ks = (pq != NULL) ? pq->get_ks() : 0;
+    const float* norms = (pq != NULL) ? pq->get_norms() : NULL;
+
+    bool by_ip = (con.metric == METRIC_IP);
+    float* qn2 = new float[nr];
+    // what the codec prepared of each residual, 16-byte aligned. for pq, its table of nsq x ks floats
+    int qb = (rvoc->query_bytes() + 15) & ~15;
+    float* tables = new float[(long)nr*qb/sizeof(float)];
+    unsigned int* q_codes = (con.poly_ht > 0 && pq != NULL) ? new unsigned int[nr*nsq] : NULL;
+    Util::sq_norms(residuals, nr, d, d, qn2);
+    for(int r = 0; r < nr; r++)
+    {
+        rvoc->prepare(residuals + r*d, (char*)tables + (long)r*qb);
+        if(q_codes != NULL)
+            pq->table_code((const float*)((char*)tables + (long)r*qb), by_ip, q_codes + r*nsq);
+        ret[r].reserve(ret[r].size() + n);
+    }
+
+    for(int f = 0; f < n; f++)
+    {
+        const unsigned int* code = list[f].residual_id;
+        // the norm is summed by the first query that keeps the entry, none when the filters reject it
+        float bn2 = by_ip ? 0.0f : -1.0f;
+        for(int r = 0; r < nr; r++)
+        {
+            if(sigs != NULL && __builtin_popcount(sigs[f] ^ q_sigs[r]) > con.ht)
+                continue;
+            if(q_codes != NULL && PQCluster::hamming(code, q_codes + r*nsq, nsq) > con.poly_ht)
+                continue;
+            if(pq == NULL)
+            {
+                if(bn2 < 0.0f)
+                    bn2 = rvoc->norm2(code);
+                float ip = rvoc->ip((char*)tables + (long)r*qb, code);
+                ret[r].push_back(Result(list[f].id, by_ip ? ip_score(cell_dists[r], ip, code + nsq) : adc_score(qn2[r], ip, bn2)));
+                continue;
+            }
+            if(bn2 < 0.0f)
+            {
+                bn2 = 0.0f;
+                for(int x = 0; x < nsq; x++)
+                    bn2 += norms[x*ks + code[x]];
+            }
+            const float* table = (const float*)((char*)tables + (long)r*qb);
+            float ip = 0.0f;
+            for(int x = 0; x < nsq; x++)
+                ip += table[x*ks + code[x]];
+            ret[r].push_back(Result(list[f].id, by_ip ? ip_score(cell_dists[r], ip, code + nsq) : adc_score(qn2[r], ip, bn2)));
+        }
+    }
+
+    delete[] qn2;
+    delete[] tables;
+    delete[] q_codes;
+}
+
+/**
+@brief scan the list of 'cell' for several query residuals, on all the shards when the index is split
+*/
+void SearchEngine::scan_cell(int cell, const float* residuals, const float* cell_dists, const unsigned int* q_sigs, int nr, vector<Result>* ret)
+{
+    if(shards.empty())
+        scan_list_multi(index[cell], num_entries[cell], residuals, cell_dists, (sigs != NULL && q_sigs != NULL) ? sigs[cell] : NULL, q_sigs, nr, ret);
+    for(unsigned int s = 0; s < shards.size(); s++)
+        scan_list_multi(shards[s]->index[cell], shards[s]->num_entries[cell], residuals, cell_dists,
+                        (shards[s]->sigs != NULL && q_sigs != NULL) ? shards[s]->sigs[cell] : NULL, q_sigs, nr, ret);
+}
+
+/// number of entries in the list of 'cell'
+int SearchEngine::cell_size(int cell)
+{
+    return num_entries[cell];
+}
+
+/**
+@brief probe() for a batch of queries. the coarse assignment of the whole batch is done at once
+@param q the queries, normalized. nq x d
+@param cells cells[i] keeps the cells of query i, nearest first. size of nq
+@param residuals residuals[i] keeps the normalized residuals of query i against its cells. size of nq
+@param cell_dists cell_dists[i] keeps the distances of query i to its cells. size of nq
+*/
+void SearchEngine::probe_batch(const float* q, int nq, vector<int>* cells, vector<float>* residuals, vector<float>* cell_dists)
+{
+    int d = con.dim;
+    if(mvoc != NULL) // the multi-sequence is run per query
+    {
+        int* buf = new int[max_cells()];
+        float* dists = new float[max_cells()];
+        for(int i = 0; i < nq; i++)
+        {
+            int ncell = probe(q + i*d, buf, dists, residuals[i]);
+            cells[i].assign(buf, buf + ncell);
+            cell_dists[i].assign(dists, dists + ncell);
+        }
+        delete[] buf;
+        delete[] dists;
+        return;
+    }
+
+    int ma = con.ma;
+    int* out = new int[nq*ma];
+    float* dists = new float[nq*ma];
+    voc->quantize2leaf_batch(q, nq, ma, out, dists);
+    for(int i = 0; i < nq; i++)
+    {
+        int ncell = adaptive_cells(dists + i*ma, ma);
+        cells[i].assign(out + i*ma, out + i*ma + ncell);
+        cell_dists[i].assign(dists + i*ma, dists + i*ma + ncell);
+        residuals[i].resize(ncell*d);
+        for(int g = 0; g < ncell; g++)
+        {
+            // with METRIC_IP every cell is scored with the query itself, see probe()
+            if(con.metric == METRIC_IP)
+            {
+                memcpy(&residuals[i][g*d], q + i*d, sizeof(float)*d);
+                continue;
+            }
+            voc->residual(q + i*d, out[i*ma + g], &residuals[i][g*d]);
+            if(!con.adc_full)
+                Util::normalize(&residuals[i][g*d], d);
+        }
+    }
+    delete[] out;
+    delete[] dists;
+}
+
+
+/**
+@brief number of cells to scan with adaptive probing, see con.probe_ratio
+@param cell_dists squared distances of the query to the candidate cells, nearest first. size of ncell
+@param ncell number of candidate cells
+@return the number of the nearest cells to scan, between probe_min and ncell
+*/
+int SearchEngine::adaptive_cells(const float* cell_dists, int ncell)
+{
+    if(con.probe_ratio <= 0)
+        return ncell;
+    // a query near a single centroid stops early, a query between several of them keeps them all
+    float limit = con.probe_ratio * cell_dists[0];
+    int n = std::min(std::max(con.probe_min, 1), ncell);
+    while(n < ncell && cell_dists[n] <= limit)
+        n++;
+    return n;
+}
+
+
+/**
+@brief split the loaded index across the NUMA nodes of the machine
+@param num_shards number of shards, usually the number of nodes
+*/
+void SearchEngine::shard_index(int num_shards)
+{
+    int nodes = Numa::num_nodes();
+    printf("Splitting the index into %d shards over %d NUMA nodes.\n", num_shards, nodes);
+    for(int s = 0; s < num_shards; s++)
+    {
+        index_shard* shard = new index_shard;
+        shard->engine = this;
+        shard->id = s;
+        shard->num_shards = num_shards;
+        shard->budget = NULL;
+        shard->scanned = 0;
+        shard->worker = new NodeWorker(s % nodes);
+        shards.push_back(shard);
+        shard->worker->submit(&shard_build_job, shard);
+    }
+
+    for(int s = 0; s < num_shards; s++)
+    {
+        shards[s]->worker->wait();
+        long tot = 0;
+        for(int i = 0; i < size_voc; i++)
+            tot += shards[s]->num_entries[i];
+        printf("shard %d: node %d%s, %ld entries\n", s, shards[s]->worker->node,
+               shards[s]->worker->bound ? "" : " (not bound)", tot);
+    }
+
+    // the shards keep their own copy, the lists of the loading thread are released
+    mem.sub(MEM_CODES, code_arena.reserved());
+    code_arena.release();
+    for(int i = 0; i < size_voc; i++)
+    {
+        if(index[i] != NULL)
+            mem.release(MEM_LISTS, sizeof(Entry)*num_entries[i]);
+        delete[] index[i];
+        index[i] = NULL;
+        if(sigs != NULL && sigs[i] != NULL)
+        {
+            mem.release(MEM_SIGS, sizeof(unsigned int)*num_entries[i]);
+            delete[] sigs[i];
+            sigs[i] = NULL;
+        }
+    }
+    print_memory();
+}
+
+/// job of a shard worker: copy the entries of its shard out of the loaded index
+void SearchEngine::shard_build_job(void* arg)
+{
+    index_shard* shard = (index_shard*) arg;
+    SearchEngine* engine = shard->engine;
+    int size_voc = engine->size_voc;
+    int nsq = Index::entry_size(engine->rvoc);
+
+    shard->index = new Entry*[size_voc];
+    shard->num_entries = new int[size_voc];
+    shard->codes = new unsigned int*[size_voc];
+    engine->mem.alloc(MEM_LISTS, (sizeof(Entry*) + sizeof(int) + sizeof(unsigned int*))*size_voc);
+    shard->sigs = NULL;
+    if(engine->sigs != NULL)
+    {
+        shard->sigs = new unsigned int*[size_voc];
+        engine->mem.alloc(MEM_SIGS, sizeof(unsigned int*)*size_voc);
+    }
+    for(int i = 0; i < size_voc; i++)
+    {
+        const Entry* list = engine->index[i];
+        int cnt = 0;
+        for(int j = 0; j < engine->num_entries[i]; j++)
+            cnt += ((int)(list[j].id % shard->num_shards) == shard->id);
+
+        shard->num_entries[i] = cnt;
+        shard->index[i] = NULL;
+        shard->codes[i] = NULL;
+        if(shard->sigs != NULL)
+            shard->sigs[i] = NULL;
+        if(cnt == 0)
+            continue;
+
+        // written by this thread first, so the pages are placed on its node
+        shard->index[i] = new Entry[cnt];
+        shard->codes[i] = new unsigned int[cnt*nsq];
+        engine->mem.alloc(MEM_LISTS, sizeof(Entry)*cnt);
+        engine->mem.alloc(MEM_CODES, sizeof(unsigned int)*cnt*nsq);
+        if(shard->sigs != NULL)
+        {
+            shard->sigs[i] = new unsigned int[cnt];
+            engine->mem.alloc(MEM_SIGS, sizeof(unsigned int)*cnt);
+        }
+        int f = 0;
+        for(int j = 0; j < engine->num_entries[i]; j++)
+        {
+            if((int)(list[j].id % shard->num_shards) != shard->id)
+                continue;
+            unsigned int* code = shard->codes[i] + f*nsq;
+            memcpy(code, list[j].residual_id, sizeof(unsigned int)*nsq);
+            shard->index[i][f].set(list[j].id, nsq, code);
+            if(shard->sigs != NULL)
+                shard->sigs[i][f] = engine->sigs[i][j];
+            f++;
+        }
+    }
+}
+
+/**
+@brief scan the cells of a query on every shard, each on its node, and append the best topk of each shard to ret
+*/
+void SearchEngine::scan_shards(const int* cells, const float* residuals, const float* cell_dists, const unsigned int* q_sigs, int ncell, int topk,
+                               query_ctx& ctx, query_budget* budget)
+{
+    // the shards hold about the same share of every list, and so get the same share of the codes
+    int ns = shards.size();
+    vector<query_budget> parts(ns, query_budget(0, 0));
+    if(budget != NULL)
+        for(int s = 0; s < ns; s++)
+        {
+            parts[s].codes = (budget->codes < 0) ? -1 : (budget->codes + s) / ns;
+            parts[s].deadline = budget->deadline;
+        }
+
+    // a shard worker runs one query at a time
+    pthread_mutex_lock(&shard_mutex);
+    for(unsigned int s = 0; s < shards.size(); s++)
+    {
+        index_shard* shard = shards[s];
+        shard->cells = cells;
+        shard->residuals = residuals;
+        shard->cell_dists = cell_dists;
+        shard->q_sigs = q_sigs;
+        shard->ncell = ncell;
+        shard->topk = topk;
+        shard->budget = (budget != NULL) ? &parts[s] : NULL;
+        shard->worker->submit(&shard_scan_job, shard);
+    }
+
+    // merge: the best topk of the union are among the best topk of each shard. they are copied
+    // to the arena of the query, the shard reuses its own for the next query once unlocked
+    for(unsigned int s = 0; s < shards.size(); s++)
+    {
+        index_shard* shard = shards[s];
+        shard->worker->wait();
+        if(budget != NULL && !parts[s].complete)
+            budget->complete = false;
+        int k = shard->ctx.ret.size();
+        Result* res = ctx.arena.alloc<Result>(k);
+        for(int j = 0; j < k; j++)
+        {
+            res[j] = *shard->ctx.ret[j];
+            ctx.ret.push_back(res + j);
+        }
+    }
+    pthread_mutex_unlock(&shard_mutex);
+}
+
+/// job of a shard worker: scan the cells of the query on its shard
+void SearchEngine::shard_scan_job(void* arg)
+{
+    index_shard* shard = (index_shard*) arg;
+    SearchEngine* engine = shard->engine;
+    int d = con.dim;
+    shard->ctx.reset();
+    query_trace trace;
+    for(int g = 0; g < shard->ncell; g++)
+    {
+        int cell = shard->cells[g];
+        // the best results of the shard are worse than those of the whole index: the bound holds
+        if(con.prune && engine->pruned(cell, shard->residuals + g*d, keep_best(shard->ctx.ret, shard->topk)))
+            continue;
+        bool filter = shard->sigs != NULL && shard->q_sigs != NULL;
+        engine->scan_list(shard->index[cell], shard->num_entries[cell], shard->residuals + g*d, shard->cell_dists[g],
+                          filter ? shard->sigs[cell] : NULL, filter ? shard->q_sigs[g] : 0, shard->ctx, NULL, &trace, shard->budget);
+    }
+    // the entries skipped by their signature are scanned too
+    shard->scanned = trace.codes;
+
+    vector<Result*>& ret = shard->ctx.ret;
+    if((int)ret.size() > shard->topk)
+    {
+        std::partial_sort(ret.begin(), ret.begin() + shard->topk, ret.end(), Result::compare);
+        ret.resize(shard->topk);
+    }
+}
+
+
 /**
 @brief load one index located under directory 'idx_dir'
 @param dir specific directory which contains one index
@@ -230,12 +1125,15 @@ void SearchEngine::loadSingleIndex(string dir)
     int tot_ims_old = tot_ims, tot_ims_new;
     assert( 1 == fscanf(fin_nl, "%u", &tot_ims_new));
     tot_ims += tot_ims_new;  // update tot_ims
+    mem.sub(MEM_NAMES, sizeof(string)*im_db.capacity());
     for(int i = 0; i < tot_ims_new; i++)
     {
         assert( 1 == fscanf(fin_nl, "%s", buffer) );
         string tmpStr(buffer);
         im_db.push_back(tmpStr);
+        mem.add(MEM_NAMES, string_bytes(im_db.back()) - sizeof(string));
     }
+    mem.add(MEM_NAMES, sizeof(string)*im_db.capacity());
     fclose(fin_nl);
 
 
@@ -260,40 +1158,93 @@ void SearchEngine::loadSingleIndex(string dir)
             std::copy(index[i], index[i] + num_entries[i], tmp);
             delete[] index[i];
             index[i] = tmp;
+            mem.release(MEM_LISTS, sizeof(Entry)*num_entries[i]);
+        }
+        mem.alloc(MEM_LISTS, sizeof(Entry)*(num_entries_new[i] + num_entries[i]));
+
+        // the signatures follow the entries of the list
+        if(sigs != NULL)
+        {
+            unsigned int* tmp = new unsigned int[num_entries_new[i] + num_entries[i]];
+            if(num_entries[i] > 0)
+            {
+                memcpy(tmp, sigs[i], sizeof(unsigned int)*num_entries[i]);
+                mem.release(MEM_SIGS, sizeof(unsigned int)*num_entries[i]);
+            }
+            delete[] sigs[i];
+            sigs[i] = tmp;
+            mem.alloc(MEM_SIGS, sizeof(unsigned int)*(num_entries_new[i] + num_entries[i]));
         }
     }
 
 
+    // the codes of each list of this index are read into one block of the arena
+    int nsq = Index::entry_size(rvoc);
+    long reserved = code_arena.reserved();
+    unsigned int** list_codes = new unsigned int*[size_voc];
+    for(int i = 0; i < size_voc; i++)
+        list_codes[i] = (num_entries_new[i] > 0) ? code_arena.alloc<unsigned int>((long)num_entries_new[i]*nsq) : NULL;
+    mem.add(MEM_CODES, code_arena.reserved() - reserved);
+
     // load index
     FILE* fin_idx = fopen((dir + "/idx").c_str(), "rb");
     IO::chkFileErr(fin_idx, dir + "/idx");
 
     assert( 1 == fread(&tot_ims_new, sizeof(int), 1, fin_idx) );
     assert(tot_ims_new == tot_ims - tot_ims_old);
+    // an index of another codec or metric has entries of another size, see Index::entry_size()
+    struct stat st;
+    if(stat((dir + "/idx").c_str(), &st) != 0 || st.st_size != (long)sizeof(int)*(1 + (long)tot_ims_new*(nsq + 2)))
+    {
+        printf("error: the entries of %s are not of %d words, index it again with the codec and metric of the search.\n", dir.c_str(), nsq);
+        exit(1);
+    }
 
-    Entry* entry = new Entry(con.nsq);
+    // one signature per entry, in the order of the entries of idx
+    FILE* fin_sig = NULL;
+    if(sigs != NULL)
+    {
+        int n_sig;
+        fin_sig = fopen((dir + "/sig").c_str(), "rb");
+        IO::chkFileErr(fin_sig, dir + "/sig");
+        assert( 1 == fread(&n_sig, sizeof(int), 1, fin_sig) );
+        assert(n_sig == tot_ims_new);
+    }
+
+    Entry* entry = new Entry(nsq);
+    unsigned int* code = new unsigned int[nsq];
     for(int i = tot_ims_old; i < tot_ims_new + tot_ims_old; i++)
     {
         int n; // number of points on image-i
         assert( 1 == fread(&n, sizeof(int), 1, fin_idx) );
         for(int j = 0; j < n; j++)
         {
-            entry->read(fin_idx);
+            entry->read(fin_idx, code);
 
             int word_id = entry->id;
+            assert(list_codes[word_id] != NULL);
+            memcpy(list_codes[word_id], code, sizeof(unsigned int)*nsq);
+            entry->residual_id = list_codes[word_id];
+            list_codes[word_id] += nsq;
             entry->id = i;
 
+            if(fin_sig != NULL)
+                assert( 1 == fread(&sigs[word_id][num_entries[word_id]], sizeof(unsigned int), 1, fin_sig) );
             index[word_id][num_entries[word_id]++] = *entry;
 
         }
         printf("\r%d", i+1);
     }
     delete entry;
+    delete[] code;
+    delete[] list_codes;
     printf("\n");
 
     delete[] num_entries_new;
 
     fclose(fin_idx);
+    if(fin_sig != NULL)
+        fclose(fin_sig);
 }
 
 /**
@@ -313,6 +1264,7 @@ void SearchEngine::update()
     norm = new float[tot_ims];
 
     float* word_hist = new float[size_voc * con.nt]; // allocate memory for each thread
+    unsigned int* code = new unsigned int[con.nsq];
     int processed = 0; // counts the processed "norm of image"
     for(unsigned int i = 0; i < idxList.size(); i++)
     {
@@ -322,7 +1274,7 @@ void SearchEngine::update()
         assert( 1 == fread(&n, sizeof(int), 1, fin_idx));
 
 
-        norm_args arg = {fin_idx, processed, size_voc, idf, word_hist, norm};
+        norm_args arg = {fin_idx, processed, size_voc, idf, word_hist, code, norm};
         MultiThd::compute_tasks(n, con.nt, &norm_task, &arg);
 
         fclose(fin_idx);
@@ -332,6 +1284,7 @@ void SearchEngine::update()
     printf("\n");
 
     delete[] word_hist;
+    delete[] code;
 }
 
 /// helper function of update. this function init idf[i]
@@ -364,7 +1317,7 @@ void SearchEngine::norm_task(void* args, int tid, int i, pthread_mutex_t& mutex)
     float* hist = argument->word_hist + tid * argument->size_voc;
     memset(hist, 0, sizeof(float) * argument->size_voc);
 
-    Entry* entry = new Entry();
+    Entry* entry = new Entry(con.nsq);
     int m; // number of points on the processing image
 
     // read information of "image_processing"
@@ -373,7 +1326,7 @@ void SearchEngine::norm_task(void* args, int tid, int i, pthread_mutex_t& mutex)
     assert( 1 == fread(&m, sizeof(int), 1, argument->fin_idx));
     for(int j = 0; j < m; j++) // j-th point
     {
-        entry->read(argument->fin_idx);
+        entry->read(argument->fin_idx, argument->code);
         hist[entry->id] += argument->idf[entry->id];
     }
     pthread_mutex_unlock(&mutex);
@@ -413,17 +1366,3 @@ float SearchEngine::getNorm(Entry* entrylist, int n)
 
     return sqrt(q_norm);
 }
-
-/**
-@brief get number of ones in the binary form of an interger
-@param x the interger to evaluate
-@return number of ones in binary format of x
-*/
-inline int SearchEngine::num_of_ones(int x)
-{
-    x -= ((x>>1)&013333333333)+((x>>2)&01111111111);
-    x = ((x>>3)+x)&030707070707;
-    x += x>>18;
-    return ((x>>12)+(x>>6)+x)&63;
-}
-
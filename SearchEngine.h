@@ -13,14 +13,134 @@
 #include <algorithm>
 
 #include "PQCluster.h"
+#include "HammingEmbed.h"
 #include "Vocab.h"
+#include "MultiVocab.h"
 #include "IO.h"
+#include "Numa.h"
+#include "Latency.h"
+#include "Memory.h"
+#include "Arena.h"
 #include "result.h"
 
 
 using std::string;
 using std::vector;
 
+class SearchEngine;
+
+/// vectors stored by one index to re-rank the results, see Index::write_refine
+struct refine_part
+{
+    /// id of the first vector of the index, and number of vectors
+    int first, n;
+    /// the vectors in fp32, or in reduced precision when cvec is not NULL. n x d
+    float* vec;
+    CompactMat* cvec;
+};
+
+/// storage of one query: its buffers and its scored entries come from the arena and are released together by reset()
+struct query_ctx
+{
+    Arena arena;
+    /// the scored entries, pointing into the arena
+    vector<Result*> ret;
+    /// with METRIC_IP, the query as prepared by the codec (the ADC table for PQ), shared by all its cells.
+    /// NULL till the first cell is scanned
+    void* table;
+
+    query_ctx() : arena(256 << 10), table(NULL) {}
+
+    void reset()
+    {
+        arena.reset();
+        ret.clear();
+        table = NULL;
+    }
+};
+
+/// limits of the scan of one query, see con.scan_budget and con.deadline_us
+struct query_budget
+{
+    /// codes that may still be scanned, -1 for no limit
+    long codes;
+    /// clock_ns() past which no more code is scanned, 0 for none
+    long deadline;
+    /// false once a code of the probed cells is left unscanned
+    bool complete;
+
+    query_budget(long max_codes, long deadline_ns) : codes(max_codes > 0 ? max_codes : -1), deadline(deadline_ns), complete(true) {}
+
+    /// there is a limit to enforce
+    bool limited() const
+    {
+        return codes >= 0 || deadline > 0;
+    }
+
+    /// number of the n codes of the next list to scan: all of them, the part left in the budget, or none
+    int take(int n)
+    {
+        if(n == 0 || expired())
+            return 0;
+        if(codes >= 0)
+        {
+            if(codes < n)
+            {
+                n = codes;
+                complete = false;
+            }
+            codes -= n;
+        }
+        return n;
+    }
+
+    /// the deadline has passed: nothing more is scanned
+    bool expired()
+    {
+        if(deadline > 0 && clock_ns() >= deadline)
+        {
+            complete = false;
+            return true;
+        }
+        return false;
+    }
+};
+
+/// inverted lists of the images of one NUMA node, with the job of the query being searched
+struct index_shard
+{
+    SearchEngine* engine;
+    /// the shard keeps the images whose id % num_shards == id
+    int id, num_shards;
+    /// thread bound to the node of the shard. the lists are allocated and scanned by it
+    NodeWorker* worker;
+    /// lists of the shard. size_voc x num_entries[i]
+    Entry** index;
+    /// size_voc x 1. keeps # of entries in each word of the shard
+    int* num_entries;
+    /// codes of the entries of each list, index[i][j].residual_id points into codes[i]
+    unsigned int** codes;
+    /// signatures of the entries of each list, NULL without Hamming embedding
+    unsigned int** sigs;
+
+    // job of the query
+    /// cells to scan, the normalized query residual against each of them and the distance to their centroids
+    const int* cells;
+    const float* residuals;
+    const float* cell_dists;
+    /// signature of the query for each cell, NULL without Hamming embedding
+    const unsigned int* q_sigs;
+    int ncell;
+    /// number of results to keep
+    int topk;
+    /// the share of the shard in the budget of the query, NULL for none
+    query_budget* budget;
+    /// the topk best entries of the shard are left in ctx.ret
+    query_ctx ctx;
+    /// number of codes scanned for the query
+    long scanned;
+};
+
 
 /// this class defines the online search procedure
 class SearchEngine
@@ -29,7 +149,13 @@ public:
 
 	/// pointer to the vocabulary using
     Vocab* voc;
-    PQCluster* rvoc;
+    /// pointer to the multi-index using instead of voc, NULL if not used
+    MultiVocab* mvoc;
+    /// codes of the residuals kept by the lists
+    ResidualCodec* rvoc;
+    /// Hamming embedding of the residuals, set before loadIndexes() to skip the entries whose signature is far
+    /// from the one of the query. NULL for none
+    HammingEmbed* he;
 
 	/// keeps different index directories. This implementaion can load multiple indexes when searching.
     vector<string> idxList;
@@ -39,15 +165,24 @@ public:
     vector<string> im_db;
     /// voc_size x 1. keeps # of entries in each word
     int* num_entries;
+    /// voc_size x num_entries_of_word_i. signatures of the entries, in the order of index[i]. NULL without he
+    unsigned int** sigs;
     /// total number of images indexed
     int tot_ims;
     /// voc_size x 1
     float* idf;
     /// im_size x 1
     float* norm;
+    /// per-stage latency and work of the queries searched by search_dir() and search()
+    SearchStats stats;
+    /// bytes held by the codebooks, the lists and the queries being searched
+    MemAccount mem;
 
 	/// init variables
-    SearchEngine(Vocab* vocab, PQCluster* rvocab);
+    SearchEngine(Vocab* vocab, ResidualCodec* rvocab);
+
+	/// init variables, searching with the inverted multi-index
+    SearchEngine(MultiVocab* mvocab, ResidualCodec* rvocab);
 
 	///deletes things newed
     ~SearchEngine();
@@ -60,6 +195,20 @@ public:
     */
     void loadIndexes(string dir);
 
+    /**
+    @brief print the memory held by each component, per indexed vector, and the largest lists
+    @param top number of lists printed
+    */
+    void print_memory(int top = 5);
+
+    /**
+    The images are dealt round-robin to the shards and shard s is placed on node s % nodes.
+    Queries then scan the shards in parallel, each on its own node, and merge their top results.
+    @brief split the loaded index across the NUMA nodes of the machine
+    @param num_shards number of shards, usually the number of nodes
+    */
+    void shard_index(int num_shards);
+
 	/**
 	@brief search all feature files (images) inside a directory
 	@param dir directory of features to search
@@ -70,12 +219,183 @@ public:
 	*/
     void search_dir(string dir, string out_file, string out_file2, int topk);
 
+	/**
+	@brief search the topk nearest indexed vectors of one query. safe to call from several threads
+	@param q the query, normalized. size of d
+	@param topk number of results to keep
+	@param out keeps the results, best first
+	@return false when the budget of the query (con.scan_budget, con.deadline_us) ran out before all its cells were scanned
+	*/
+    bool search(const float* q, int topk, vector<Result>& out);
+
+
+	/**
+	@brief probe() for a batch of queries. the coarse assignment of the whole batch is done at once
+	@param q the queries, normalized. nq x d
+	@param cells cells[i] keeps the cells of query i, nearest first. size of nq
+	@param residuals residuals[i] keeps the normalized residuals of query i against its cells. size of nq
+	@param cell_dists cell_dists[i] keeps the distances of query i to its cells. size of nq
+	*/
+    void probe_batch(const float* q, int nq, vector<int>* cells, vector<float>* residuals, vector<float>* cell_dists);
+
+	/**
+	@brief scan the list of 'cell' for several query residuals, on all the shards when the index is split
+	@param residuals the normalized query residuals against the centroid of the cell. nr x d
+	@param cell_dists the distance of each query to the centroid of the cell. size of nr
+	@param q_sigs the signature of each query for the cell, see query_sigs(). NULL without he
+	@param ret ret[r] gets the scored entries of residual r. size of nr
+	*/
+    void scan_cell(int cell, const float* residuals, const float* cell_dists, const unsigned int* q_sigs, int nr, vector<Result>* ret);
+
+	/**
+	@brief signatures of query q for its cells, to compare with those of the entries. nothing is done without he
+	@param q the query, normalized. size of d
+	@param out keeps the signature of q for each cell. size of ncell
+	*/
+    void query_sigs(const float* q, const int* cells, int ncell, unsigned int* out);
+
+    /// number of entries in the list of 'cell'
+    int cell_size(int cell);
+
+    /// the most cells probe() can return
+    int max_cells();
+
+    /// number of ADC results to keep for rerank(): con.rerank when every index has its refine vectors, else topk
+    int rerank_depth(int topk);
+
+    /**
+    @brief score the best rerank_depth(topk) results of res again with the refine vectors, and keep the topk best of them
+    @param q the query, normalized. size of d
+    @param res the results of ADC, in any order. comes out with the topk best, best first
+    */
+    void rerank(const float* q, vector<Result>& res, int topk);
 
 private:
 
 	/// size of vocabulary using
     int size_voc;
 
+	/// shared part of the constructors
+    void init(int voc_size);
+
+	/**
+	@brief score every entry of an inverted list against the query residual
+	@param list the entries to score
+	@param n number of entries
+	@param q_residual normalized residual of the query against the centroid of the list, the query itself with METRIC_IP. size of d
+	@param cell_dist distance of the query to the centroid of the list, see probe(). the scores start from it with METRIC_IP
+	@param sigs the signatures of the entries, NULL to score all of them. size of n
+	@param q_sig signature of the query for the list. entries more than con.ht bits away from it are skipped
+	@param ctx the scored entries are appended to ctx.ret, they and the table are taken from ctx.arena
+	@param fout_coarse_result names of scanned entries are written here, unless NULL
+	@param trace the time of the table and of the scan is added to it, unless NULL
+	@param budget only the entries it allows are scanned, unless NULL
+	*/
+    void scan_list(const Entry* list, int n, const float* q_residual, float cell_dist, const unsigned int* sigs, unsigned int q_sig,
+                   query_ctx& ctx, FILE* fout_coarse_result, query_trace* trace, query_budget* budget);
+
+    /// scan_list for several query residuals at once: each entry is read once for all of them
+    void scan_list_multi(const Entry* list, int n, const float* residuals, const float* cell_dists, const unsigned int* sigs,
+                         const unsigned int* q_sigs, int nr, vector<Result>* ret);
+
+    /**
+    the distance between the normalized query residual q and the normalized reconstruction b,
+    from <q,b> and the squared norms of q and b.
+    @brief score of an entry
+    */
+    static float adc_score(float qn2, float ip, float bn2)
+    {
+        // with con.adc_full, q is the raw residual and the score is |q - b|^2, the estimated distance to the query
+        if(con.adc_full)
+            return qn2 - 2*ip + bn2;
+        float bn = sqrt(bn2);
+        if(bn < 0.0000001) // not normalized, see Util::normalize
+            return qn2 - 2*ip + bn2;
+        return qn2 - 2*ip/bn + 1;
+    }
+
+    /**
+    1 - <q, c + b> / |c + b|, the cosine distance between the query q and the reconstruction c + b of an entry,
+    from the distance 1 - <q, c> of q to the cell and <q, b>. 1/|c + b| follows the code, see Index::entry_size()
+    @brief score of an entry with METRIC_IP
+    */
+    static float ip_score(float cell_dist, float ip, const unsigned int* inv_norm)
+    {
+        float inv;
+        memcpy(&inv, inv_norm, sizeof(float));
+        return 1.0f - (1.0f - cell_dist + ip) * inv;
+    }
+
+    /// size_voc x 1. norm of the longest reconstructed residual of each list, NULL unless con.prune
+    float* cell_rmax;
+
+    /// compute cell_rmax from the loaded lists
+    void init_bounds();
+
+    /// set the thresholds of he for the centroids of voc
+    void init_embedding();
+
+    /**
+    @brief whether no entry of 'cell' can score better than 'bound', with con.prune
+    @param q_residual raw residual of the query against the centroid of the cell. size of d
+    */
+    bool pruned(int cell, const float* q_residual, float bound);
+
+    /// keep the depth best of ret, and return the score of the worst of them. 1e30 while there are fewer
+    static float keep_best(vector<Result*>& ret, int depth);
+
+    /// shards of the index when it is split across NUMA nodes, empty otherwise
+    vector<index_shard*> shards;
+    /// taken by scan_shards: the shard workers run one query at a time
+    pthread_mutex_t shard_mutex;
+    /// codes of the loaded lists: a block per list and per index loaded, index[i][j].residual_id points into it
+    Arena code_arena;
+    /// refine vectors of each index loaded, by increasing id. empty when con.rerank is 0
+    vector<refine_part> refine;
+    /// every index loaded has refine vectors
+    bool refined;
+
+    /// load the refine vectors of the index of 'dir', its first vector has id 'first'. false when there are none
+    bool loadRefine(string dir, int first, int n);
+
+    /// squared distance between q and the refine vector of 'id', 1 - <q, v> with METRIC_IP
+    float refine_dist(const float* q, int id);
+
+    /// rerank() on the results of a query_ctx, which come out with the topk best first and nothing else
+    void rerank(const float* q, vector<Result*>& ret, int topk);
+
+    /// of ncell candidate cells sorted by their squared distances, the number to scan: see con.probe_ratio
+    static int adaptive_cells(const float* cell_dists, int ncell);
+
+	/**
+	@brief select the cells to scan for query q
+	@param q the query. size of d
+	@param cells keeps the cells, nearest first. size of max_cells()
+	@param cell_dists keeps the squared distance of q to each cell, 1 - <q, c> with METRIC_IP. size of max_cells()
+	@param residuals keeps the normalized residual of q against each cell, raw with con.adc_full, q itself with METRIC_IP. ncell x d
+	@return ncell, number of cells to scan. at most con.ma without the multi-index, fewer with adaptive probing
+	*/
+    int probe(const float* q, int* cells, float* cell_dists, vector<float>& residuals);
+
+	/**
+	@brief scan the cells of a query on every shard, each on its node, and append the best topk of each shard to ctx.ret
+	@param budget split evenly between the shards, unless NULL. complete is cleared when a shard runs out
+	*/
+    void scan_shards(const int* cells, const float* residuals, const float* cell_dists, const unsigned int* q_sigs, int ncell, int topk,
+                     query_ctx& ctx, query_budget* budget);
+
+    /// count the lists probed and the codes scanned on the shards, and their time since 'start' as scan time
+    long trace_shards(query_trace& trace, int ncell, long start);
+
+    /// the budget of a query started at 'start', from con.scan_budget and con.deadline_us
+    static query_budget budget_of(long start);
+
+    /// job of a shard worker: copy the entries of its shard out of the loaded index
+    static void shard_build_job(void* arg);
+
+    /// job of a shard worker: scan the cells of the query on its shard
+    static void shard_scan_job(void* arg);
+
 	/**
 	@brief load one index located under directory 'idx_dir'
 	@param dir specific directory which contains one index
@@ -103,13 +423,6 @@ private:
 	@return the norm of the entrylist
 	*/
     float getNorm(Entry* entrylist, int n);
-
-	/**
-	@brief get number of ones in the binary form of an interger
-	@param x the interger to evaluate
-	@return number of ones in binary format of x
-	*/
-    inline int num_of_ones(int x);
 };
 
 #endif // SEARCHENGINE_H_INCLUDED
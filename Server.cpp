@@ -0,0 +1,312 @@
+/**
+@file Server.cpp
+@brief this file implements the search server defined in Server.h
+*/
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <fstream>
+#include <errno.h>
+#include <sys/un.h>
+#include <dirent.h>
+
+#include "Server.h"
+#include "SearchEngine.h"
+#include "Scheduler.h"
+#include "config.h"
+
+using std::vector;
+
+/// a request may not carry more than that many floats
+static const long max_request_floats = 1L << 28;
+
+
+/**
+@brief check the headers of the .vlad files of a directory sent by a client before IO::load_vlad reads them,
+as it trusts them and would exit or overflow on a bad one
+@return true if there is a .info file per .vlad file, and every .vlad file holds vectors of dimension d
+*/
+static bool check_vlad_dir(string dir, int d)
+{
+    vector<string> files = IO::getFileList(dir, "vlad", 0, 1);
+    vector<string> infos = IO::getFileList(dir, "info", 0, 1);
+    if(files.size() != infos.size())
+        return false;
+    long total = 0;
+    for(unsigned int k = 0; k < files.size(); k++)
+    {
+        std::ifstream fin(files[k].c_str());
+        int vec_num = -1, dim = -1;
+        fin >> vec_num >> dim;
+        if(!fin || vec_num < 0 || dim != d)
+            return false;
+        total += (long)vec_num*d;
+        if(total > max_request_floats)
+            return false;
+    }
+    return true;
+}
+
+
+SearchServer::SearchServer(SearchEngine* engine_l, int dim, int nt_l, BatchScheduler* sched_l)
+{
+    engine = engine_l;
+    sched = sched_l;
+    d = dim;
+    nt = std::max(nt_l, 1);
+    listen_fd = -1;
+    stopping = false;
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+SearchServer::~SearchServer()
+{
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&cond);
+}
+
+
+void SearchServer::run(string path)
+{
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(listen_fd < 0 || path.size() >= sizeof(addr.sun_path))
+    {
+        printf("error: can not create socket %s.\n", path.c_str());
+        exit(1);
+    }
+    strcpy(addr.sun_path, path.c_str());
+    unlink(path.c_str()); // left by a server that did not stop cleanly
+    if(bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listen_fd, 64) != 0)
+    {
+        printf("error: can not listen on %s: %s\n", path.c_str(), strerror(errno));
+        exit(1);
+    }
+
+    pthread_t* workers = new pthread_t[nt];
+    for(int i = 0; i < nt; i++)
+        pthread_create(&workers[i], NULL, &worker_routine, this);
+    printf("Serving on %s with %d workers.\n", path.c_str(), nt);
+    fflush(stdout);
+
+    while(1)
+    {
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            break; // the listening socket was shut down by stop()
+        }
+
+        pthread_mutex_lock(&mutex);
+        if(stopping)
+            close(fd);
+        else
+        {
+            pending.push_back(fd);
+            pthread_cond_signal(&cond);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    stop(); // accept may also fail on its own
+    for(int i = 0; i < nt; i++)
+        pthread_join(workers[i], NULL);
+    delete[] workers;
+
+    close(listen_fd);
+    unlink(path.c_str());
+    printf("Server stopped.\n");
+}
+
+
+void SearchServer::stop()
+{
+    pthread_mutex_lock(&mutex);
+    if(!stopping)
+    {
+        stopping = true;
+        shutdown(listen_fd, SHUT_RDWR);
+        // connections waiting for their next request would keep their worker forever
+        for(std::set<int>::iterator it = active.begin(); it != active.end(); it++)
+            shutdown(*it, SHUT_RD);
+        pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void* SearchServer::worker_routine(void* arg)
+{
+    SearchServer* server = (SearchServer*)arg;
+    while(1)
+    {
+        pthread_mutex_lock(&server->mutex);
+        while(server->pending.empty() && !server->stopping)
+            pthread_cond_wait(&server->cond, &server->mutex);
+        if(server->pending.empty()) // stopping
+        {
+            pthread_mutex_unlock(&server->mutex);
+            break;
+        }
+        int fd = server->pending.front();
+        server->pending.pop_front();
+        server->active.insert(fd);
+        if(server->stopping)
+            shutdown(fd, SHUT_RD);
+        pthread_mutex_unlock(&server->mutex);
+
+        server->serve(fd);
+
+        pthread_mutex_lock(&server->mutex);
+        server->active.erase(fd);
+        pthread_mutex_unlock(&server->mutex);
+        close(fd);
+    }
+    return NULL;
+}
+
+
+void SearchServer::serve(int fd)
+{
+    int type;
+    while(Wire::read_all(fd, &type, sizeof(int)))
+    {
+        if(type == REQ_STOP)
+        {
+            int topk;
+            Wire::read_all(fd, &topk, sizeof(int));
+            int head[2] = {0, 0};
+            Wire::write_all(fd, head, sizeof(head));
+            stop();
+            break;
+        }
+        if(type == REQ_STATS || type == REQ_LATENCY)
+        {
+            int topk;
+            if(!Wire::read_all(fd, &topk, sizeof(int)))
+                break;
+            string text;
+            if(type == REQ_LATENCY)
+                text = engine->stats.json();
+            else
+                text = (sched != NULL) ? sched->stats() : string("batching is off\n");
+            int head[2] = {0, (int)text.size()};
+            if(!Wire::write_all(fd, head, sizeof(head)) || !Wire::write_all(fd, text.c_str(), text.size()))
+                break;
+            continue;
+        }
+        if(!answer(fd, type))
+            break;
+    }
+}
+
+
+bool SearchServer::answer(int fd, int type)
+{
+    int head[2]; // topk, then nq or len
+    if(!Wire::read_all(fd, head, sizeof(head)))
+        return false;
+    int topk = head[0];
+
+    int err[2] = {REQ_ERROR, 0};
+    if(type == REQ_VECTORS)
+    {
+        int nq = head[1];
+        int dim;
+        if(!Wire::read_all(fd, &dim, sizeof(int)))
+            return false;
+        if(dim != d || nq < 0 || (long)nq*d > max_request_floats || topk < 0)
+        {
+            // the body can not be skipped safely, close the connection
+            Wire::write_all(fd, err, sizeof(err));
+            return false;
+        }
+
+        float* data = new float[(long)nq*d];
+        bool ok = Wire::read_all(fd, data, sizeof(float)*(long)nq*d);
+        if(ok)
+        {
+            for(int i = 0; i < nq; i++)
+                Util::normalize(data + (long)i*d, d);
+            ok = respond(fd, data, nq, topk);
+        }
+        delete[] data;
+        return ok;
+    }
+    else if(type == REQ_PATH)
+    {
+        int len = head[1];
+        if(len <= 0 || len > 4096)
+        {
+            Wire::write_all(fd, err, sizeof(err));
+            return false;
+        }
+        vector<char> buf(len + 1, 0);
+        if(!Wire::read_all(fd, &buf[0], len))
+            return false;
+        string dir(&buf[0]);
+        if(!Util::endWith(dir, "/"))
+            dir += "/";
+        DIR* dp = opendir(dir.c_str()); // IO would exit on a missing directory
+        if(!dp)
+            return Wire::write_all(fd, err, sizeof(err));
+        closedir(dp);
+        if(!check_vlad_dir(dir, d))
+            return Wire::write_all(fd, err, sizeof(err));
+
+        float* data = NULL;
+        int n = 0, dim = 0;
+        vector<string*> names;
+        IO::load_vlad(dir, &data, &names, &n, &dim);
+        for(unsigned int i = 0; i < names.size(); i++)
+            delete names[i];
+        for(int i = 0; i < n; i++)
+            Util::normalize(data + (long)i*d, d);
+        bool ok = respond(fd, data, n, topk);
+        delete[] data;
+        return ok;
+    }
+
+    Wire::write_all(fd, err, sizeof(err));
+    return false;
+}
+
+
+bool SearchServer::respond(int fd, float* data, int n, int topk)
+{
+    // one buffer for the whole response, so that it goes out in few writes
+    vector<int> msg;
+    msg.push_back(0);
+    msg.push_back(n);
+    vector< vector<Result> > all;
+    // the scheduler does not apply the budget of the queries, they all finish
+    vector<int> complete(n, 1);
+    if(sched != NULL)
+        sched->search(data, n, topk, all);
+    else
+    {
+        all.resize(n);
+        for(int i = 0; i < n; i++)
+            complete[i] = engine->search(data + (long)i*d, topk, all[i]);
+    }
+    for(int i = 0; i < n; i++)
+    {
+        const vector<Result>& res = all[i];
+        msg.push_back(res.size());
+        msg.push_back(complete[i]);
+        for(unsigned int j = 0; j < res.size(); j++)
+        {
+            int score;
+            memcpy(&score, &res[j].score, sizeof(float));
+            msg.push_back(res[j].im_id);
+            msg.push_back(score);
+        }
+    }
+    return Wire::write_all(fd, &msg[0], sizeof(int)*msg.size());
+}
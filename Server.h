@@ -0,0 +1,146 @@
+/**
+@file Server.h
+@brief This file defines the search server, which keeps the codebooks and the index in memory
+and answers queries sent over a Unix domain socket, and the binary protocol it speaks.
+
+All integers and floats are sent in the byte order of the machine.
+request:  [int type] [int topk] then
+          REQ_VECTORS: [int nq] [int d] [nq x d floats]
+          REQ_PATH:    [int len] [len chars]: a directory of .vlad/.info files the server reads
+          REQ_STOP:    nothing. the server stops once the running requests are answered
+          REQ_STATS:   nothing
+          REQ_LATENCY: nothing
+response: [int status] [int nq] then for each query: [int n] [int complete] [n x (int id, float score)]
+          status is 0, or REQ_ERROR with nq = 0.
+          complete is 0 when the budget of the query (scan_budget, deadline_us) ran out before all its
+          cells were scanned, the results being those of the cells scanned, and 1 otherwise.
+          The batched server (batch = 1) does not apply the budget, its queries are always complete.
+          REQ_STATS is answered by [int 0] [int len] [len chars]: the statistics of the batching.
+          REQ_LATENCY is answered the same way, with the per-stage latency report in JSON.
+*/
+
+#ifndef SERVER_H_INCLUDED
+#define SERVER_H_INCLUDED
+
+#include <string>
+#include <deque>
+#include <set>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+using std::string;
+
+class SearchEngine;
+class BatchScheduler;
+
+/// request types and error status of the protocol
+enum
+{
+    REQ_VECTORS = 1,
+    REQ_PATH    = 2,
+    REQ_STOP    = 3,
+    REQ_STATS   = 4,
+    REQ_LATENCY = 5,
+    REQ_ERROR   = -1
+};
+
+
+/// blocking reads and writes of whole messages on a socket
+class Wire
+{
+public:
+
+    /// read exactly n bytes. false if the peer closed or on error
+    static bool read_all(int fd, void* buf, long n)
+    {
+        char* p = (char*)buf;
+        while(n > 0)
+        {
+            long r = read(fd, p, n);
+            if(r <= 0)
+                return false;
+            p += r;
+            n -= r;
+        }
+        return true;
+    }
+
+    /// write exactly n bytes. false if the peer closed or on error
+    static bool write_all(int fd, const void* buf, long n)
+    {
+        const char* p = (const char*)buf;
+        while(n > 0)
+        {
+            long r = send(fd, p, n, MSG_NOSIGNAL);
+            if(r <= 0)
+                return false;
+            p += r;
+            n -= r;
+        }
+        return true;
+    }
+};
+
+
+/**
+The accepting thread hands connections to a fixed set of workers. A worker answers the
+requests of one connection till the client closes it. With a scheduler, the queries of all the
+connections are batched together, otherwise each worker searches its own queries.
+@brief search server on a Unix domain socket
+*/
+class SearchServer
+{
+public:
+
+    /**
+    @param engine the engine to search with, with its index loaded
+    @param dim dimension of the queries
+    @param nt number of workers, i.e. connections served at the same time
+    @param sched the scheduler to search through, NULL to search query by query
+    */
+    SearchServer(SearchEngine* engine, int dim, int nt, BatchScheduler* sched = NULL);
+
+    ~SearchServer();
+
+    /**
+    @brief serve on the socket 'path' till a REQ_STOP request
+    */
+    void run(string path);
+
+private:
+
+    SearchEngine* engine;
+    BatchScheduler* sched;
+    int d;
+    int nt;
+    /// listening socket
+    int listen_fd;
+    /// accepted connections waiting for a worker
+    std::deque<int> pending;
+    /// connections being served, shut down on stop
+    std::set<int> active;
+    bool stopping;
+    pthread_mutex_t mutex;
+    /// signals a pending connection or stop
+    pthread_cond_t cond;
+
+    static void* worker_routine(void* arg);
+
+    /// answer the requests of connection fd till it is closed
+    void serve(int fd);
+
+    /**
+    @brief read the queries of a request and answer them
+    @return false if the connection has to be closed
+    */
+    bool answer(int fd, int type);
+
+    /// search the n queries of data and write the response
+    bool respond(int fd, float* data, int n, int topk);
+
+    /// stop accepting, and end the connections being served
+    void stop();
+};
+
+#endif // SERVER_H_INCLUDED
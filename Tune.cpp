@@ -0,0 +1,119 @@
+/**
+@file Tune.cpp
+@brief this file implements the tuning defined in Tune.h
+*/
+#include <cstdio>
+#include <algorithm>
+
+#include "Tune.h"
+#include "CompactMat.h"
+
+extern Config con;
+
+/// recall at which the sweep of a setting stops once it does not grow anymore
+static const double saturated = 0.999;
+
+
+Tuner::Tuner(SearchEngine* engine, const eval_data* data, int nt, int R)
+{
+    this->engine = engine;
+    this->data = data;
+    this->nt = nt;
+    this->R = R;
+}
+
+
+const tune_point& Tuner::measure(int fmt, int ma, int ef, int budget)
+{
+    tune_point p;
+    p.fmt = fmt;
+    p.ma = ma;
+    p.ef = ef;
+    p.budget = budget;
+    p.res = Eval::measure(engine, *data, nt, R);
+    p.pareto = false;
+    printf("  %-5s ma %5d ef %5d budget %8d: R@%d %.4f, %.1f us\n", CompactMat::fmt_name(fmt).c_str(),
+           ma, ef, budget, R, p.res.recall_r, p.res.latency_us);
+    points.push_back(p);
+    return points.back();
+}
+
+
+void Tuner::sweep(int fmt, int max_cells)
+{
+    printf("Sweeping %s codebooks on %d queries...\n", CompactMat::fmt_name(fmt).c_str(), data->nq);
+    double last = -1;
+    if(engine->mvoc != NULL)
+    {
+        // the budget counts candidates, beyond the whole base it changes nothing
+        long n = engine->im_db.size();
+        for(long budget = 128; ; budget *= 2)
+        {
+            con.imi_budget = (int)std::min(budget, n);
+            double r = measure(fmt, 0, 0, con.imi_budget).res.recall_r;
+            if(con.imi_budget == n || (r >= saturated && r <= last))
+                break;
+            last = r;
+        }
+        return;
+    }
+
+    max_cells = std::min(max_cells, engine->voc->num_leaf);
+    for(int ma = 1; ma <= max_cells; ma *= 2)
+    {
+        con.ma = ma;
+        double r;
+        if(con.hnsw)
+        {
+            // the graph is walked only while the beam is wide enough and narrower than the vocabulary
+            r = 0;
+            for(int ef = ma; ef <= 4*ma && 4*ef < engine->voc->num_leaf; ef *= 2)
+            {
+                engine->voc->ef = ef;
+                r = std::max(r, measure(fmt, ma, ef, 0).res.recall_r);
+            }
+            engine->voc->ef = 0; // exact scan of the centroids
+        }
+        r = measure(fmt, ma, 0, 0).res.recall_r;
+        if(r >= saturated && r <= last)
+            break;
+        last = r;
+    }
+}
+
+
+/// faster first, then more recall first
+static bool faster(const tune_point& a, const tune_point& b)
+{
+    if(a.res.latency_us != b.res.latency_us)
+        return a.res.latency_us < b.res.latency_us;
+    return a.res.recall_r > b.res.recall_r;
+}
+
+
+const tune_point* Tuner::report(double target)
+{
+    std::sort(points.begin(), points.end(), faster);
+    // going from the fastest, a point is on the frontier when it beats the recall of all the faster ones
+    double best_recall = -1;
+    const tune_point* best = NULL;
+    for(unsigned int i = 0; i < points.size(); i++)
+    {
+        points[i].pareto = points[i].res.recall_r > best_recall;
+        best_recall = std::max(best_recall, points[i].res.recall_r);
+        if(best == NULL && points[i].res.recall_r >= target)
+            best = &points[i];
+    }
+
+    printf("%-2s %-5s %6s %6s %8s %8s %8s %10s %10s %10s\n", "", "fmt", "ma", "ef", "budget", "R@1",
+           ("R@" + Util::num2str(R)).c_str(), "QPS", "mean(us)", "p99(us)");
+    for(unsigned int i = 0; i < points.size(); i++)
+    {
+        const tune_point& p = points[i];
+        printf("%-2s %-5s %6d %6d %8d %8.4f %8.4f %10.1f %10.1f %10.1f\n", p.pareto ? "*" : "",
+               CompactMat::fmt_name(p.fmt).c_str(), p.ma, p.ef, p.budget, p.res.recall[0], p.res.recall_r,
+               p.res.qps, p.res.latency_us, p.res.p99_us);
+    }
+    printf("* on the Pareto frontier of recall@%d and mean latency\n", R);
+    return best;
+}
@@ -0,0 +1,71 @@
+/**
+@file Tune.h
+@brief This file defines the tuning of the search-time parameters: the cells visited per query
+(ma, or imi_budget with the multi-index) and the beam of the HNSW graph are swept on held-out
+queries, recall and latency are measured, and the cheapest setting reaching a target recall is kept.
+*/
+#ifndef TUNE_H_INCLUDED
+#define TUNE_H_INCLUDED
+
+#include <vector>
+
+#include "Eval.h"
+
+using std::vector;
+
+/// one measured setting of the search
+struct tune_point
+{
+    /// format of the codebooks, see CompactMat
+    int fmt;
+    /// cells visited per query, 0 with the multi-index
+    int ma;
+    /// beam of the HNSW graph, 0 without it
+    int ef;
+    /// candidates collected by the multi-index, 0 without it
+    int budget;
+    eval_result res;
+    /// no other point has a recall as high for a lower latency
+    bool pareto;
+};
+
+/// sweep of the search-time parameters of an engine on held-out queries
+class Tuner
+{
+public:
+
+    /// every setting measured so far
+    vector<tune_point> points;
+
+    /**
+    @param data the held-out queries with their ground truth, see Eval::prepare
+    @param nt number of threads searching
+    @param R the rank at which the recall is targeted
+    */
+    Tuner(SearchEngine* engine, const eval_data* data, int nt, int R);
+
+    /**
+    The number of cells doubles from 1 till max_cells, or till the recall stops growing once it is
+    above 0.999. con.ma, con.imi_budget and the beam of the graph are changed in place.
+    @brief measure the settings of the engine with the codebooks it has now, in format fmt
+    */
+    void sweep(int fmt, int max_cells);
+
+    /**
+    @brief mark and print the Pareto frontier of recall@R against the mean latency
+    @return the fastest point reaching recall@R >= target, NULL when none does
+    */
+    const tune_point* report(double target);
+
+private:
+
+    SearchEngine* engine;
+    const eval_data* data;
+    int nt;
+    int R;
+
+    /// measure the engine as it is set now and keep the point
+    const tune_point& measure(int fmt, int ma, int ef, int budget);
+};
+
+#endif // TUNE_H_INCLUDED
@@ -48,6 +48,8 @@ struct q_file_arg // quantization file args
     // out
     /// the quantized entrylist
     Entry* entrylist;
+    /// residual of each entry. size of (n x ma) x d
+    float* residuals;
 };
 
 
@@ -67,14 +69,34 @@ Vocab::Vocab(int k_assign, int l_assign, int dim)
     sp[0] = 0;
     for(int i = 1; i < l+1; i++)
         sp[i] = sp[i-1] + ROUND(pow(k, i-1))*d;
+
+    graph = NULL;
+    ef = 0;
+    cvec = NULL;
+    norms = NULL;
 }
 
 Vocab::~Vocab()
 {
+    delete graph;
+    delete cvec;
     delete[] vec;
+    delete[] norms;
     delete[] sp;
 }
 
+long Vocab::bytes() const
+{
+    long b = (l+1)*sizeof(int);
+    if(vec != NULL)
+        b += (long)total_len*sizeof(float);
+    if(cvec != NULL)
+        b += cvec->bytes();
+    if(norms != NULL)
+        b += (long)num_leaf*sizeof(float);
+    return b;
+}
+
 
 void Vocab::quantize2hie(float* v, int* out, int n, int m)
 {
@@ -105,6 +127,49 @@ void Vocab::quantize2leaf(float* v, int* out, int n, int m)
 }
 
 
+void Vocab::quantize2leaf_batch(const float* v, int n, int ma, int* out, float* dist)
+{
+    assert(l == 1 && ma <= num_leaf);
+    if(graph != NULL || cvec != NULL)
+    {
+        quantize2leaf((float*)v, out, n, 0, ma);
+        if(dist != NULL)
+            for(int i = 0; i < n*ma; i++)
+                dist[i] = dist2leaf(v + (i/ma)*d, out[i]);
+        return;
+    }
+
+    bool by_ip = (con.metric == METRIC_IP);
+    // the norms are only needed by l2
+    assert(by_ip || norms != NULL);
+    float* ip = new float[(long)n*num_leaf];
+    Util::inner_products(v, n, d, leaf(0), num_leaf, d, ip);
+
+    std::vector<distance> dists(num_leaf);
+    for(int i = 0; i < n; i++)
+    {
+        float vn = 0.0f;
+        if(!by_ip)
+            Util::sq_norms(v + i*d, 1, d, d, &vn);
+        for(int j = 0; j < num_leaf; j++)
+        {
+            float p = ip[(long)i*num_leaf + j];
+            dists[j].val = by_ip ? 1.0f - p : vn + norms[j] - 2*p;
+            dists[j].idx = j;
+        }
+        std::partial_sort(dists.begin(), dists.begin() + ma, dists.end(), sort_by_val);
+        for(int m = 0; m < ma; m++)
+        {
+            out[i*ma + m] = dists[m].idx;
+            if(dist != NULL)
+                dist[i*ma + m] = by_ip ? dists[m].val : std::max(dists[m].val, 0.0f);
+        }
+    }
+
+    delete[] ip;
+}
+
+
 static void quanti_task(void* args, int tid, int i, pthread_mutex_t& mutex)
 {
     q_file_arg* t = (q_file_arg*) args;
@@ -118,18 +183,15 @@ static void quanti_task(void* args, int tid, int i, pthread_mutex_t& mutex)
     for(int m = 0; m < t->ma; m++)
     {
         int idx = i*t->ma + m;
-        float* residual = new float[t->d];
-        for(int j=0; j < t->d; j++)
-        {
-            residual[j] = *(t->feat+pos+j) - *(t->voc->vec+out[m]*(t->d)+j);
-        }
+        float* residual = t->residuals + (long)idx*t->d;
+        t->voc->residual(t->feat+pos, out[m], residual);
         t->entrylist[idx].set( out[m], con.nsq, residual);
     }
 
     delete[] out;
 }
 
-Entry* Vocab::quantizeFile(float* feat, int& len, int nt, int ma, int d, int n)
+Entry* Vocab::quantizeFile(float* feat, int& len, int nt, int ma, int d, int n, Arena& arena)
 {
     std::cout << "enter quantizefile for " << n << " files." << std::endl;
     len = n*ma;
@@ -137,7 +199,7 @@ Entry* Vocab::quantizeFile(float* feat, int& len, int nt, int ma, int d, int n)
     int m = 0;
     Entry* entrylist = new Entry[n*ma];
 
-    q_file_arg args = {feat, this, d, m, ma, entrylist};
+    q_file_arg args = {feat, this, d, m, ma, entrylist, arena.alloc<float>((long)n*ma*d)};
     MultiThd::compute_tasks(n, nt, &quanti_task, &args);
 
 
@@ -163,6 +225,14 @@ void Vocab::loadFromDisk(string dir)
         memcpy(vec + sp[i+1], tmpmat, row*col*sizeof(float));
         delete[] tmpmat;
     }
+
+    // the norms of the leaves are computed once, for the blocked search of quantize2leaf_batch
+    if(l == 1)
+    {
+        delete[] norms;
+        norms = new float[num_leaf];
+        Util::sq_norms(leaf(0), num_leaf, d, d, norms);
+    }
 }
 
 void Vocab::write2Disk(string file)
@@ -175,6 +245,103 @@ void Vocab::write2Disk(string file)
 }
 
 
+void Vocab::loadGraph(string file, int M, int ef_construction, int ef_search)
+{
+    if(l != 1)
+    {
+        printf("HNSW graph is only used with flat vocabulary, exact scan is kept.\n");
+        return;
+    }
+
+    delete graph;
+    if(cvec != NULL) // no fp32 vectors to build with, the graph must be on disk
+    {
+        graph = new HNSW(NULL, num_leaf, d);
+        graph->set_data(cvec);
+        if(!graph->loadFromDisk(file))
+        {
+            printf("No HNSW graph %s for the compact vocabulary, exact scan is kept.\n", file.c_str());
+            delete graph;
+            graph = NULL;
+            return;
+        }
+    }
+    else
+    {
+        graph = new HNSW(vec + sp[1], num_leaf, d);
+        if(!graph->loadFromDisk(file))
+        {
+            graph->build(M, ef_construction);
+            graph->write2Disk(file);
+        }
+    }
+    ef = ef_search;
+}
+
+
+float Vocab::dist2leaf(const float* v, int i)
+{
+    if(con.metric == METRIC_IP)
+        return 1.0f - ((cvec != NULL) ? cvec->dot(v, i) : Util::dot(v, leaf(i), d));
+    if(cvec != NULL)
+        return cvec->dist_l2_sq(v, i);
+    return Util::dist_l2_sq(v, leaf(i), d);
+}
+
+void Vocab::residual(const float* v, int i, float* out)
+{
+    if(cvec != NULL)
+    {
+        cvec->decode(i, out);
+        for(int j = 0; j < d; j++)
+            out[j] = v[j] - out[j];
+        return;
+    }
+    const float* c = leaf(i);
+    for(int j = 0; j < d; j++)
+        out[j] = v[j] - c[j];
+}
+
+void Vocab::compress(int fmt)
+{
+    assert(l == 1 && cvec == NULL);
+    if(fmt == FMT_FP32)
+        return;
+    cvec = new CompactMat(leaf(0), num_leaf, d, fmt);
+    if(graph != NULL)
+        graph->set_data(cvec);
+    delete[] vec;
+    vec = NULL;
+    delete[] norms;
+    norms = NULL;
+}
+
+bool Vocab::loadCompact(string dir, int fmt)
+{
+    assert(l == 1 && cvec == NULL);
+    string file = dir + "vocab.l1." + CompactMat::fmt_name(fmt);
+    CompactMat* mat = CompactMat::loadFromDisk(file);
+    if(mat == NULL)
+        return false;
+
+    printf("Loading vocabulary: '%s'...\n", file.c_str());
+    assert(mat->n == num_leaf && mat->d == d && mat->fmt == fmt);
+    cvec = mat;
+    if(graph != NULL)
+        graph->set_data(cvec);
+    delete[] vec;
+    vec = NULL;
+    delete[] norms;
+    norms = NULL;
+    return true;
+}
+
+void Vocab::writeCompact(string dir)
+{
+    cvec->write2Disk(dir + "vocab.l1." + CompactMat::fmt_name(cvec->fmt));
+}
+
+
 // v: the vector to be quantized. size: d x 1
 // idx: quantization result of each layer. size: l x 1
 void Vocab::quantize_once(float* v, int* idx)
@@ -192,7 +359,8 @@ void Vocab::quantize_once(float* v, int* idx)
         float dist_best = 1e100;
         for(int j = 0; j < k; j++)
         {
-            float dist = Util::dist_l2_sq(v, vec + (global_index + j)*d, d);
+            // cvec is only set for flat vocabulary, whose first layer is the leaf layer
+            float dist = (cvec != NULL) ? cvec->dist_l2_sq(v, j) : Util::dist_l2_sq(v, vec + (global_index + j)*d, d);
             if(dist < dist_best)
             {
                 dist_best = dist;
@@ -205,6 +373,14 @@ void Vocab::quantize_once(float* v, int* idx)
 
 void Vocab::quantize2leaf(float* v, int* out, int n, int m, int ma)
 {
+    // the graph pays off only when its candidate list is much shorter than the vocabulary
+    if(graph != NULL && ma <= ef && 4*ef < num_leaf)
+    {
+        for(int p = 0; p < n; p++)
+            graph->search(v + p*(d+m) + m, ma, ef, out + p*ma, NULL);
+        return;
+    }
+
     memset(out, 0, sizeof(int)*n*ma); // init out to 0
 
     int* out_hie = new int[l-1];
@@ -236,7 +412,7 @@ void Vocab::quantize2leaf(float* v, int* out, int n, int m, int ma)
         vector<distance> dists(k);
         for(int i = 0; i < k; i++)
         {
-            dists[i].val = Util::dist_l2_sq(v + p*(d+m) + m, vec + (global_index + i)*d, d);
+            dists[i].val = (cvec != NULL) ? cvec->dist_l2_sq(v + p*(d+m) + m, i) : Util::dist_l2_sq(v + p*(d+m) + m, vec + (global_index + i)*d, d);
             dists[i].idx = i;
         }
 
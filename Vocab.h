@@ -12,6 +12,9 @@
 
 #include "IO.h"
 #include "entry.h"
+#include "HNSW.h"
+#include "CompactMat.h"
+#include "Arena.h"
 
 using std::string;
 
@@ -43,6 +46,14 @@ public:
     int num_leaf; 
     /// starting position of each layer
     int *sp; 
+    /// optional HNSW graph over the leaf layer, used by quantize2leaf with multiple assignment. NULL for exact scan
+    HNSW* graph;
+    /// size of the candidate list when searching the graph
+    int ef;
+    /// leaf layer in reduced precision. when set, vec is released and distances are computed on cvec
+    CompactMat* cvec;
+    /// squared norm of each leaf, size of num_leaf. set by loadFromDisk for flat vocabularies, released with vec
+    float* norms;
 
 private:
 	/// total number of
@@ -101,11 +112,62 @@ public:
     @param len number of entries for the quantized feature file
     @param nt number of cores to use
     @param ma multiple assignments factor
+    @param arena the residuals of the entries are taken from it, and live as long as it
     @return pointer to a entrylist
     */
-    Entry* quantizeFile(float* feat,int& len, int nt, int ma, int d, int n);
+    Entry* quantizeFile(float* feat,int& len, int nt, int ma, int d, int n, Arena& arena);
 
 
+    /**
+    @brief pointer to the i-th centroid of the leaf layer
+    @remark only valid while the vocabulary is kept in fp32 (cvec is NULL)
+    */
+    float* leaf(int i) { return vec + sp[l] + i*d; }
+
+    /**
+    The distances of all the points to all the leaves are computed at once, as inner products of
+    blocks of points. Falls back to quantize2leaf when the graph or the compact leaves are used.
+    @brief multiple assignment of n points to the leaf layer
+    @param v the points. size of n x d
+    @param out keeps the ma nearest leaves of each point, nearest first. size of n x ma
+    @param dist keeps the squared distance to each of them, can be NULL. size of n x ma
+    @remark with METRIC_L2, the vocabulary must be loaded by loadFromDisk, which sets the norms
+    @remark with METRIC_IP the leaves are ranked by the largest inner product, and dist keeps 1 - <v, c>
+    */
+    void quantize2leaf_batch(const float* v, int n, int ma, int* out, float* dist);
+
+    /**
+    @brief squared distance from v (size of d) to the i-th centroid of the leaf layer, 1 - <v, c> with METRIC_IP
+    */
+    float dist2leaf(const float* v, int i);
+
+    /**
+    @brief residual of v against the i-th centroid of the leaf layer: out = v - c(i)
+    */
+    void residual(const float* v, int i, float* out);
+
+    /**
+    the fp32 vocabulary is released. only flat vocabularies (l = 1) can be compressed, and
+    the HNSW graph, if any, must be attached before.
+    @brief keep the leaf layer in reduced precision
+    @param fmt storage format, see CompactMat.h
+    */
+    void compress(int fmt);
+
+    /**
+    @brief load the leaf layer in reduced precision from 'dir'/vocab.l1.<fmt>
+    @return false if there is no such file
+    */
+    bool loadCompact(string dir, int fmt);
+
+    /**
+    @brief write the reduced precision leaf layer to 'dir'/vocab.l1.<fmt>
+    */
+    void writeCompact(string dir);
+
+    /// bytes used by the centroids in memory, the graph apart
+    long bytes() const;
+
     /**
     @brief load the vocabulary 'vec' from disk
     */
@@ -116,6 +178,17 @@ public:
     */
     void write2Disk(string file);
 
+    /**
+    the graph is loaded from 'file' when it exists and matches the leaf layer, otherwise it is
+    built and written to 'file'. only flat vocabularies (l = 1) use the graph.
+    @brief attach an HNSW graph over the leaf centroids for approximate multiple assignment
+    @param file location of the persisted graph
+    @param M number of links per node
+    @param ef_construction size of the candidate list while building
+    @param ef_search size of the candidate list while searching
+    */
+    void loadGraph(string file, int M, int ef_construction, int ef_search);
+
 private:
 
     /**
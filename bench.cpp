@@ -0,0 +1,646 @@
+/**
+@file bench.cpp
+@brief microbenchmarks of the hot kernels of the search and the training, on random data of the
+sizes of our configs. Built and run by 'make bench'.
+
+Each kernel is timed over enough iterations to last min_time seconds, several times, and the best
+time is kept, which is the most stable figure from run to run. Usage:
+    ndk_bench [filter] [-t seconds]
+runs the benchmarks whose name contains 'filter'.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+
+#include "config.h"
+#include "util.h"
+#include "Vocab.h"
+#include "PQCluster.h"
+#include "SQCodec.h"
+#include "RQCodec.h"
+#include "SearchEngine.h"
+#include "MultiThd.h"
+#include "Latency.h"
+
+using std::string;
+using std::vector;
+
+Config con;
+
+/// runs a kernel 'iters' times
+typedef void (*bench_fun_t) (void* arg, long iters);
+
+/// minimal duration of a measure, in seconds
+static double min_time = 0.2;
+/// number of measures of each benchmark, the best is kept
+static const int trials = 5;
+/// only the benchmarks whose name contains it are run
+static string filter;
+/// number of benchmarks run, to tell when the filter matches none
+static int num_run = 0;
+/// results are written here so that the compiler keeps the kernels
+static volatile float sink;
+
+
+/**
+@brief time fun and print a line: ns per op, and GB/s when bytes are given
+@param ops number of ops done by one iteration
+@param bytes number of bytes read by one iteration, 0 if it does not apply
+*/
+static void bench(string name, string params, bench_fun_t fun, void* arg, double ops, double bytes)
+{
+    if(name.find(filter) == string::npos)
+        return;
+    num_run++;
+
+    // calibrate: double the iterations till a measure lasts long enough
+    long iters = 1;
+    while(1)
+    {
+        long start = clock_ns();
+        fun(arg, iters);
+        if((clock_ns() - start) * 1e-9 >= min_time / 4 || iters >= (1L << 40))
+            break;
+        iters *= 2;
+    }
+    iters *= 4;
+
+    double best = 1e300;
+    for(int t = 0; t < trials; t++)
+    {
+        long start = clock_ns();
+        fun(arg, iters);
+        best = std::min(best, (double)(clock_ns() - start));
+    }
+
+    double ns_op = best / (iters * ops);
+    printf("%-22s %-34s %12.2f ns/op", name.c_str(), params.c_str(), ns_op);
+    if(bytes > 0)
+        printf(" %9.2f GB/s", bytes * iters / best);
+    printf("\n");
+    fflush(stdout);
+}
+
+/// n x d uniform values in [-1, 1)
+static float* random_mat(long n, int d)
+{
+    float* m = new float[n*d];
+    for(long i = 0; i < n*d; i++)
+        m[i] = 2.0f * rand() / ((float)RAND_MAX + 1) - 1.0f;
+    return m;
+}
+
+
+// Util
+
+struct vec_arg
+{
+    float* a;
+    float* b;
+    int d;
+};
+
+static void dist_l2_sq_fun(void* arg, long iters)
+{
+    vec_arg* p = (vec_arg*)arg;
+    float s = 0;
+    for(long i = 0; i < iters; i++)
+        s += Util::dist_l2_sq(p->a, p->b, p->d);
+    sink = s;
+}
+
+static void normalize_fun(void* arg, long iters)
+{
+    vec_arg* p = (vec_arg*)arg;
+    for(long i = 0; i < iters; i++)
+        Util::normalize(p->a, p->d);
+    sink = p->a[0];
+}
+
+static void bench_util()
+{
+    int dims[] = {32, 128, 960, 8192};
+    for(int t = 0; t < 4; t++)
+    {
+        vec_arg p;
+        p.d = dims[t];
+        p.a = random_mat(1, p.d);
+        p.b = random_mat(1, p.d);
+        string params = "d=" + Util::num2str(p.d);
+        bench("dist_l2_sq", params, &dist_l2_sq_fun, &p, 1, 2.0*p.d*sizeof(float));
+        bench("normalize", params, &normalize_fun, &p, 1, p.d*sizeof(float));
+        delete[] p.a;
+        delete[] p.b;
+    }
+}
+
+
+// Vocab
+
+struct voc_arg
+{
+    Vocab* voc;
+    float* q;
+    int nq;
+    int ma;
+    int* out;
+};
+
+static void quantize2leaf_fun(void* arg, long iters)
+{
+    voc_arg* p = (voc_arg*)arg;
+    int d = p->voc->d;
+    for(long i = 0; i < iters; i++)
+        p->voc->quantize2leaf(p->q + (i % p->nq)*d, p->out, 1, 0);
+    sink = p->out[0];
+}
+
+static void quantize2leaf_ma_fun(void* arg, long iters)
+{
+    voc_arg* p = (voc_arg*)arg;
+    int d = p->voc->d;
+    for(long i = 0; i < iters; i++)
+        p->voc->quantize2leaf(p->q + (i % p->nq)*d, p->out, 1, 0, p->ma);
+    sink = p->out[0];
+}
+
+static void bench_vocab()
+{
+    // dim, coarsek
+    int sizes[][2] = {{32, 16}, {128, 1024}, {960, 1024}, {8192, 256}};
+    for(int t = 0; t < 4; t++)
+    {
+        int d = sizes[t][0], k = sizes[t][1];
+        Vocab voc(k, 1, d);
+        float* c = random_mat(k, d);
+        memcpy(voc.leaf(0), c, sizeof(float)*k*d);
+        delete[] c;
+
+        voc_arg p;
+        p.voc = &voc;
+        p.nq = 64;
+        p.q = random_mat(p.nq, d);
+        p.out = new int[64];
+        string params = "d=" + Util::num2str(d) + " coarsek=" + Util::num2str(k);
+        double bytes = (double)k*d*sizeof(float);
+        bench("quantize2leaf", params, &quantize2leaf_fun, &p, 1, bytes);
+        int mas[] = {2, 8, 32};
+        for(int m = 0; m < 3; m++)
+        {
+            p.ma = mas[m];
+            if(p.ma > k)
+                continue;
+            bench("quantize2leaf_ma", params + " ma=" + Util::num2str(p.ma), &quantize2leaf_ma_fun, &p, 1, bytes);
+        }
+        delete[] p.q;
+        delete[] p.out;
+    }
+}
+
+
+// PQCluster
+
+/// a residual quantizer with random centroids. loadFromDisk sets the norms, so they go through a temporary dir
+static PQCluster* random_pq(int nsqbits, int nsq, int d)
+{
+    PQCluster* pq = new PQCluster(nsqbits, nsq, d);
+    int ks = 1 << nsqbits;
+    char dir[] = "/tmp/ndk_bench.XXXXXX";
+    if(mkdtemp(dir) == NULL)
+    {
+        printf("error: can not create a temporary directory.\n");
+        exit(1);
+    }
+    string path = string(dir) + "/";
+    for(int i = 0; i < nsq; i++)
+    {
+        float* c = random_mat(ks, pq->get_ds());
+        memcpy(pq->subvec(i), c, sizeof(float)*ks*pq->get_ds());
+        delete[] c;
+        pq->write2Disk(path, i);
+    }
+    pq->loadFromDisk(path);
+    for(int i = 0; i < nsq; i++)
+        unlink((path + "vocab.l" + Util::num2str(i)).c_str());
+    rmdir(dir);
+    return pq;
+}
+
+struct pq_arg
+{
+    PQCluster* pq;
+    float* v;
+};
+
+static void quantize_once_fun(void* arg, long iters)
+{
+    pq_arg* p = (pq_arg*)arg;
+    int nsq = p->pq->get_nsq(), ds = p->pq->get_ds();
+    int out = 0;
+    for(long i = 0; i < iters; i++)
+    {
+        int x = i % nsq;
+        p->pq->quantize_once(p->v + x*ds, &out, x);
+    }
+    sink = out;
+}
+
+static void bench_pq()
+{
+    // dim, nsq, nsqbits
+    int sizes[][3] = {{32, 4, 4}, {128, 8, 8}, {128, 16, 8}, {8192, 64, 10}};
+    for(int t = 0; t < 4; t++)
+    {
+        int d = sizes[t][0], nsq = sizes[t][1], bits = sizes[t][2];
+        string params = "d=" + Util::num2str(d) + " nsq=" + Util::num2str(nsq) + " nsqbits=" + Util::num2str(bits);
+        if(string("quantize_once").find(filter) == string::npos)
+            continue;
+        pq_arg p;
+        p.pq = random_pq(bits, nsq, d);
+        p.v = random_mat(1, d);
+        double bytes = (double)(1 << bits) * p.pq->get_ds() * sizeof(float);
+        bench("quantize_once", params, &quantize_once_fun, &p, 1, bytes);
+        delete[] p.v;
+        delete p.pq;
+    }
+}
+
+
+// inverted list scanning
+
+struct scan_arg
+{
+    SearchEngine* engine;
+    float* q;
+    int nq;
+    int topk;
+    int nr;
+    /// distance of each query to cell 0, for scan_cell
+    float* dists;
+    /// signature of each query for cell 0, NULL to scan without Hamming embedding
+    unsigned int* sigs;
+    vector<Result> out;
+    vector<Result>* ret;
+};
+
+static void search_fun(void* arg, long iters)
+{
+    scan_arg* p = (scan_arg*)arg;
+    for(long i = 0; i < iters; i++)
+        p->engine->search(p->q + (i % p->nq)*con.dim, p->topk, p->out);
+    sink = p->out.empty() ? 0 : p->out[0].score;
+}
+
+static void scan_cell_fun(void* arg, long iters)
+{
+    scan_arg* p = (scan_arg*)arg;
+    for(long i = 0; i < iters; i++)
+    {
+        for(int r = 0; r < p->nr; r++)
+            p->ret[r].clear();
+        int q0 = i % (p->nq - p->nr + 1);
+        p->engine->scan_cell(0, p->q + q0*con.dim, p->dists + q0, (p->sigs != NULL) ? p->sigs + q0 : NULL, p->nr, p->ret);
+    }
+    sink = p->ret[0][0].score;
+}
+
+static void bench_scan()
+{
+    int d = 128, n = 100000, bits = 8;
+    int nsqs[] = {4, 8, 16, 32, 64};
+    for(int t = 0; t < 5; t++)
+    {
+        int nsq = nsqs[t];
+        string params = "nsq=" + Util::num2str(nsq) + " nsqbits=" + Util::num2str(bits) + " n=" + Util::num2str(n);
+        if(string("scan_list scan_cell").find(filter) == string::npos)
+            continue;
+
+        // two cells: the queries, near the origin, all go to the list of cell 0
+        con.dim = d;
+        con.ma = 1;
+        Vocab voc(2, 1, d);
+        for(int j = 0; j < d; j++)
+            voc.leaf(1)[j] = 100.0f;
+        PQCluster* pq = random_pq(bits, nsq, d);
+        SearchEngine* engine = new SearchEngine(&voc, pq);
+
+        // each code is followed by the 1/|c + b| that metric=ip reads, see Index::entry_size()
+        float one = 1.0f;
+        unsigned int* codes = new unsigned int[(long)n*(nsq+1)];
+        engine->index[0] = new Entry[n];
+        for(int f = 0; f < n; f++)
+        {
+            unsigned int* code = codes + (long)f*(nsq+1);
+            for(int x = 0; x < nsq; x++)
+                code[x] = rand() % (1 << bits);
+            memcpy(code + nsq, &one, sizeof(float));
+            engine->index[0][f].set(f, nsq, code);
+        }
+        engine->num_entries[0] = n;
+
+        scan_arg p;
+        p.engine = engine;
+        p.nq = 16;
+        p.q = random_mat(p.nq, d);
+        p.dists = new float[p.nq];
+        for(int i = 0; i < p.nq; i++)
+        {
+            Util::normalize(p.q + i*d, d);
+            p.dists[i] = voc.dist2leaf(p.q + i*d, 0);
+        }
+        p.sigs = NULL;
+        p.topk = 10;
+        double bytes = (double)n * (sizeof(Entry) + nsq*sizeof(unsigned int));
+        // search path: scan_list, then the top-k selection
+        bench("scan_list", params, &search_fun, &p, n, bytes);
+        // inner product: one table per query, and the stored inverse norm instead of the norms of the codewords
+        con.metric = METRIC_IP;
+        bench("scan_list", params + " metric=ip", &search_fun, &p, n, bytes + n*sizeof(float));
+        con.metric = METRIC_L2;
+        // the list read once for several queries of a batch
+        int nrs[] = {1, 8};
+        for(int r = 0; r < 2; r++)
+        {
+            p.nr = nrs[r];
+            p.ret = new vector<Result>[p.nr];
+            bench("scan_cell", params + " queries=" + Util::num2str(p.nr), &scan_cell_fun, &p, (double)n*p.nr, bytes);
+            delete[] p.ret;
+        }
+        // random 32-bit signatures: about 1 entry in 10 is within ht=12 bits of the query and gets its codes read
+        p.nr = 1;
+        p.ret = new vector<Result>[p.nr];
+        p.sigs = new unsigned int[p.nq];
+        engine->sigs = new unsigned int*[2];
+        engine->sigs[0] = new unsigned int[n];
+        engine->sigs[1] = NULL;
+        for(int f = 0; f < n; f++)
+            engine->sigs[0][f] = ((unsigned int)rand() << 16) ^ rand();
+        for(int i = 0; i < p.nq; i++)
+            p.sigs[i] = ((unsigned int)rand() << 16) ^ rand();
+        bench("scan_cell", params + " queries=1 he_len=32 ht=12", &scan_cell_fun, &p, n, bytes + n*sizeof(unsigned int));
+        delete[] p.ret;
+        delete[] p.sigs;
+
+        delete[] p.q;
+        delete[] p.dists;
+        delete engine; // frees index[0]
+        delete[] codes;
+        delete pq;
+    }
+}
+
+/// scan of the lists with the codes of another codec than pq, of n random residuals of dimension d
+static void bench_scan_codec(string params, ResidualCodec* codec, const float* residual, int d, int n)
+{
+    con.dim = d;
+    con.ma = 1;
+    Vocab voc(2, 1, d);
+    for(int j = 0; j < d; j++)
+        voc.leaf(1)[j] = 100.0f;
+    SearchEngine* engine = new SearchEngine(&voc, codec);
+
+    // each code is followed by the 1/|c + b| that metric=ip reads, see Index::entry_size()
+    int cs = codec->code_size();
+    float one = 1.0f;
+    unsigned int* encoded = new unsigned int[(long)n*cs];
+    unsigned int* codes = new unsigned int[(long)n*(cs+1)];
+    codec->encode(residual, n, encoded);
+    engine->index[0] = new Entry[n];
+    for(int f = 0; f < n; f++)
+    {
+        unsigned int* code = codes + (long)f*(cs+1);
+        memcpy(code, encoded + (long)f*cs, sizeof(unsigned int)*cs);
+        memcpy(code + cs, &one, sizeof(float));
+        engine->index[0][f].set(f, cs, code);
+    }
+    delete[] encoded;
+    engine->num_entries[0] = n;
+
+    scan_arg p;
+    p.engine = engine;
+    p.nq = 16;
+    p.q = random_mat(p.nq, d);
+    p.dists = new float[p.nq];
+    for(int i = 0; i < p.nq; i++)
+    {
+        Util::normalize(p.q + i*d, d);
+        p.dists[i] = voc.dist2leaf(p.q + i*d, 0);
+    }
+    p.sigs = NULL;
+    p.topk = 10;
+    double bytes = (double)n * (sizeof(Entry) + cs*sizeof(unsigned int));
+    bench("scan_list", params, &search_fun, &p, n, bytes);
+    con.metric = METRIC_IP;
+    bench("scan_list", params + " metric=ip", &search_fun, &p, n, bytes + n*sizeof(float));
+    con.metric = METRIC_L2;
+    int nrs[] = {1, 8};
+    for(int r = 0; r < 2; r++)
+    {
+        p.nr = nrs[r];
+        p.ret = new vector<Result>[p.nr];
+        bench("scan_cell", params + " queries=" + Util::num2str(p.nr), &scan_cell_fun, &p, (double)n*p.nr, bytes);
+        delete[] p.ret;
+    }
+
+    delete[] p.q;
+    delete[] p.dists;
+    delete engine; // frees index[0]
+    delete[] codes;
+}
+
+struct encode_arg
+{
+    ResidualCodec* codec;
+    float* residual;
+    unsigned int* codes;
+    int n;
+};
+
+static void encode_fun(void* arg, long iters)
+{
+    encode_arg* p = (encode_arg*)arg;
+    for(long i = 0; i < iters; i++)
+        p->codec->encode(p->residual, p->n, p->codes);
+    sink = p->codes[0];
+}
+
+/// 8-bit scalar codes: an integer dot product of d bytes per entry instead of nsq table lookups.
+/// residual codes: the lookups of pq, and a beam search to encode
+static void bench_codecs()
+{
+    int d = 128, n = 100000, nsq = 8, bits = 8;
+    float* residual = random_mat(n, d);
+    if(string("scan_list scan_cell").find(filter) != string::npos)
+    {
+        SQCodec sq(d);
+        sq.train(residual, n);
+        bench_scan_codec("codec=sq8 d=" + Util::num2str(d) + " n=" + Util::num2str(n), &sq, residual, d, n);
+    }
+
+    // random codebooks, of smaller and smaller scale as trained ones
+    RQCodec rq(bits, nsq, d, 1);
+    for(int i = 0; i < nsq; i++)
+    {
+        float* c = random_mat(1 << bits, d);
+        for(int j = 0; j < (1 << bits)*d; j++)
+            rq.stage(i)[j] = c[j] / (i + 1);
+        delete[] c;
+    }
+    rq.set_norms();
+    string params = "codec=rq nsq=" + Util::num2str(nsq) + " nsqbits=" + Util::num2str(bits);
+    if(string("scan_list scan_cell").find(filter) != string::npos)
+        bench_scan_codec(params + " n=" + Util::num2str(n), &rq, residual, d, n);
+
+    int beams[] = {1, 4};
+    for(int b = 0; b < 2 && string("encode").find(filter) != string::npos; b++)
+    {
+        RQCodec rqb(bits, nsq, d, beams[b]);
+        for(int i = 0; i < nsq; i++)
+            memcpy(rqb.stage(i), rq.stage(i), sizeof(float)*(1 << bits)*d);
+        rqb.set_norms();
+        encode_arg p = {&rqb, residual, new unsigned int[16*rqb.code_size()], 16};
+        bench("encode", params + " beam=" + Util::num2str(beams[b]), &encode_fun, &p, p.n, 0);
+        delete[] p.codes;
+    }
+    delete[] residual;
+}
+
+
+// top-k selection
+
+struct topk_arg
+{
+    vector<Result*> all;
+    vector<Result*> work;
+    int topk;
+};
+
+static void topk_fun(void* arg, long iters)
+{
+    topk_arg* p = (topk_arg*)arg;
+    for(long i = 0; i < iters; i++)
+    {
+        p->work = p->all;
+        std::partial_sort(p->work.begin(), p->work.begin() + p->topk, p->work.end(), Result::compare);
+    }
+    sink = p->work[0]->score;
+}
+
+static void bench_topk()
+{
+    int ns[] = {1000, 100000};
+    int ks[] = {10, 100};
+    for(int a = 0; a < 2; a++)
+    {
+        topk_arg p;
+        Result* res = new Result[ns[a]];
+        for(int i = 0; i < ns[a]; i++)
+        {
+            res[i] = Result(i, (float)rand() / RAND_MAX);
+            p.all.push_back(&res[i]);
+        }
+        for(int b = 0; b < 2; b++)
+        {
+            p.topk = ks[b];
+            // the copy of the candidates is part of the measure, as in the search
+            bench("topk", "n=" + Util::num2str(ns[a]) + " topk=" + Util::num2str(p.topk), &topk_fun, &p, ns[a], 0);
+        }
+        delete[] res;
+    }
+}
+
+
+// MultiThd
+
+struct thd_arg
+{
+    int n;
+    int nt;
+};
+
+static void empty_task(void* arg, int tid, int i, pthread_mutex_t& m)
+{
+}
+
+static void compute_tasks_fun(void* arg, long iters)
+{
+    thd_arg* p = (thd_arg*)arg;
+    for(long i = 0; i < iters; i++)
+        MultiThd::compute_tasks(p->n, p->nt, &empty_task, NULL);
+}
+
+static void bench_multithd()
+{
+    int nts[] = {1, 2, 8};
+    int ns[] = {1, 1000, 100000};
+    for(int a = 0; a < 3; a++)
+    {
+        for(int b = 0; b < 3; b++)
+        {
+            thd_arg p;
+            p.nt = nts[a];
+            p.n = ns[b];
+            // per call: the cost of dispatching, waking and joining the threads
+            bench("compute_tasks", "nt=" + Util::num2str(p.nt) + " items=" + Util::num2str(p.n), &compute_tasks_fun, &p, 1, 0);
+        }
+    }
+}
+
+
+static void usage()
+{
+    printf("usage: ndk_bench [filter] [-t seconds]\n");
+    printf("runs the benchmarks whose name contains 'filter', each measure lasting at least 'seconds' (%.1f).\n", min_time);
+}
+
+int main(int argc, char* argv[])
+{
+    for(int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if(arg == "-t")
+        {
+            if(i + 1 == argc)
+            {
+                printf("error: -t needs a number of seconds.\n");
+                usage();
+                return 1;
+            }
+            min_time = atof(argv[++i]);
+        }
+        else if(arg == "-h" || arg == "--help")
+        {
+            usage();
+            return 0;
+        }
+        else if(arg.size() > 1 && arg[0] == '-')
+        {
+            printf("error: unknown option '%s'.\n", arg.c_str());
+            usage();
+            return 1;
+        }
+        else
+            filter = arg;
+    }
+
+    srand(1);
+    printf("%-22s %-34s %15s %14s\n", "kernel", "params", "time", "bandwidth");
+    bench_util();
+    bench_vocab();
+    bench_pq();
+    bench_scan();
+    bench_codecs();
+    bench_topk();
+    bench_multithd();
+
+    if(num_run == 0)
+    {
+        printf("error: no benchmark matches '%s'.\n", filter.c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,165 @@
+/**
+@file client.cpp
+@brief a small client of the search server (mode 5), see Server.h for the protocol
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "config.h"
+#include "IO.h"
+#include "Server.h"
+
+using std::string;
+using std::vector;
+
+Config con; // needed by IO.h
+
+
+/// wall clock in milliseconds
+static double now_ms()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static int connect_to(string path)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        printf("error: can not connect to %s.\n", path.c_str());
+        exit(1);
+    }
+    return fd;
+}
+
+/// read a response and print the results of each query, labelled by names when given
+static void print_response(int fd, const vector<string*>* names, int first)
+{
+    int head[2];
+    if(!Wire::read_all(fd, head, sizeof(head)) || head[0] != 0)
+    {
+        printf("error: the server refused the request.\n");
+        exit(1);
+    }
+
+    for(int q = 0; q < head[1]; q++)
+    {
+        int n, complete;
+        assert( Wire::read_all(fd, &n, sizeof(int)) );
+        assert( Wire::read_all(fd, &complete, sizeof(int)) );
+        if(names != NULL)
+            printf("%s", (*names)[first + q]->c_str());
+        else
+            printf("%d", first + q);
+        for(int j = 0; j < n; j++)
+        {
+            int id;
+            float score;
+            assert( Wire::read_all(fd, &id, sizeof(int)) );
+            assert( Wire::read_all(fd, &score, sizeof(float)) );
+            printf(" %d %.6f ", id, score);
+        }
+        // as search_dir() marks the queries cut by their budget
+        if(!complete)
+            printf(" partial");
+        printf("\n");
+    }
+}
+
+
+int main(int argc, char* argv[])
+{
+    bool command = argc >= 3 && (string(argv[2]) == "stop" || string(argv[2]) == "stats" || string(argv[2]) == "latency");
+    if(argc < 3 || (!command && argc < 4))
+    {
+        printf("Usage: \n");
+        printf("%s <socket> <topk> <query_dir>        send the vectors of query_dir, one request each\n", argv[0]);
+        printf("%s <socket> <topk> -path <query_dir>  let the server read query_dir\n", argv[0]);
+        printf("%s <socket> stats                     print the batching statistics of the server\n", argv[0]);
+        printf("%s <socket> latency                   print the per-stage latency report of the server\n", argv[0]);
+        printf("%s <socket> stop                      stop the server\n", argv[0]);
+        exit(1);
+    }
+
+    int fd = connect_to(argv[1]);
+    if(string(argv[2]) == "stop")
+    {
+        int req[2] = {REQ_STOP, 0};
+        Wire::write_all(fd, req, sizeof(req));
+        int head[2];
+        Wire::read_all(fd, head, sizeof(head));
+        close(fd);
+        return 0;
+    }
+    if(string(argv[2]) == "stats" || string(argv[2]) == "latency")
+    {
+        int req[2] = {string(argv[2]) == "stats" ? REQ_STATS : REQ_LATENCY, 0};
+        Wire::write_all(fd, req, sizeof(req));
+        int head[2];
+        if(!Wire::read_all(fd, head, sizeof(head)) || head[0] != 0 || head[1] < 0)
+        {
+            printf("error: the server refused the request.\n");
+            exit(1);
+        }
+        vector<char> text(head[1] + 1, 0);
+        if(head[1] > 0)
+            assert( Wire::read_all(fd, &text[0], head[1]) );
+        printf("%s", &text[0]);
+        close(fd);
+        return 0;
+    }
+
+    int topk = atoi(argv[2]);
+    if(string(argv[3]) == "-path")
+    {
+        if(argc < 5)
+        {
+            printf("error: missing query_dir.\n");
+            exit(1);
+        }
+        string dir = argv[4];
+        int req[3] = {REQ_PATH, topk, (int)dir.size()};
+        double start = now_ms();
+        Wire::write_all(fd, req, sizeof(req));
+        Wire::write_all(fd, dir.c_str(), dir.size());
+        print_response(fd, NULL, 0);
+        printf("time: %.3f ms\n", now_ms() - start);
+        close(fd);
+        return 0;
+    }
+
+    float* data;
+    int n = 0, d = 0;
+    vector<string*> names;
+    IO::load_vlad(argv[3], &data, &names, &n, &d);
+
+    double tot = 0.0;
+    for(int i = 0; i < n; i++)
+    {
+        int req[4] = {REQ_VECTORS, topk, 1, d};
+        double start = now_ms();
+        Wire::write_all(fd, req, sizeof(req));
+        Wire::write_all(fd, data + (long)i*d, sizeof(float)*d);
+        print_response(fd, &names, i);
+        tot += now_ms() - start;
+    }
+    if(n > 0)
+        printf("%d queries, mean latency: %.3f ms\n", n, tot / n);
+
+    delete[] data;
+    for(unsigned int i = 0; i < names.size(); i++)
+        delete names[i];
+    close(fd);
+    return 0;
+}
@@ -16,9 +16,19 @@
 
 #include <string>
 
+#include "CompactMat.h"
+#include "ResidualCodec.h"
+
 
 using std::string;
 
+/// metrics of the search, see Config::metric
+enum
+{
+    METRIC_L2 = 0,  ///< squared l2 distance
+    METRIC_IP       ///< inner product, the cosine of the normalized vectors
+};
+
 /// holds the configurations of the whole project
 struct Config
 {
@@ -63,14 +73,18 @@ struct Config
 	/// # of multiple assignment
     int             ma;                 
 
-	/// length of hamming code
+	/// bits of the Hamming signature of each entry, at most 32. 0 for none
     int             he_len;             
-    /// hamming distance threshold
+    /// entries whose signature differs from the one of the query in more than ht bits are not scored
     int             ht;                 
     /// max image size: im_sz x im_sz
     int             im_sz;              
-    /// location of projection matrix file
+    /// location of projection matrix file, he_len x dim. a random projection is drawn when it does not exist
     string          p_mat;              
+    /// number the centroids of each subquantizer so that the Hamming distance between codes follows the distance of their centroids
+    int             polysemous;
+    /// entries whose code is more than poly_ht bits away from the code of the query are not scored. 0 to score all
+    int             poly_ht;
 
 	/// searching mode
     int             search_mode;        
@@ -79,12 +93,58 @@ struct Config
     int             nsq;
     // the number of bits per subquantizer
     int             nsqbits;
+    /// codes of the residuals: CODEC_PQ or CODEC_RQ with nsq and nsqbits, or CODEC_SQ8
+    int             codec;
+    /// number of partial codes kept after each stage when encoding with CODEC_RQ
+    int             rq_beam;
     /// number of elements to be returned
     int             k;
     // number of cell visited per query
     int             w;
     // number of centroids for the coarse quantizer
     int             coarsek;
+    /// use the inverted multi-index (coarsek x coarsek cells) as coarse quantizer
+    int             imi;
+    /// number of candidates to collect per query with the inverted multi-index
+    int             imi_budget;
+    /// select the cells to probe with an HNSW graph over the coarse centroids
+    int             hnsw;
+    /// number of links per node of the HNSW graph
+    int             hnsw_m;
+    /// size of the candidate list when building the HNSW graph
+    int             hnsw_efc;
+    /// size of the candidate list when searching the HNSW graph
+    int             hnsw_ef;
+    /// resume an interrupted training from its checkpoints
+    int             resume;
+    /// storage format of the codebooks at search time: FMT_FP32, FMT_FP16, FMT_BF16 or FMT_INT8
+    int             cb_fmt;
+    /// split the index across the NUMA nodes and scan the shards of each query in parallel
+    int             numa;
+    /// number of shards when numa is set. 0: one per node of the machine
+    int             numa_shards;
+    /// format of the vectors stored by indexing to re-rank the results, -1 for none
+    int             refine_fmt;
+    /// number of the best ADC results re-scored with the stored vectors at search time, 0 for none
+    int             rerank;
+    /// adaptive probing: of the ma nearest cells, those farther than probe_ratio x the squared distance
+    /// of the nearest one are not scanned. 0 to always scan ma cells
+    float           probe_ratio;
+    /// number of cells scanned at least with adaptive probing
+    int             probe_min;
+    /// METRIC_L2 or METRIC_IP. with METRIC_IP the coarse codebook is trained by spherical k-means, the cells are
+    /// assigned by the largest inner product and the entries are scored by the cosine distance 1 - <q, c + r> / |c + r|.
+    /// the index is built with the metric of the search. METRIC_IP is not supported with imi
+    int             metric;
+    /// score the entries by the estimated squared distance |q - c - r|^2 to the query, comparable across cells,
+    /// instead of the distance between the normalized residuals
+    int             adc_full;
+    /// with adc_full, skip the cells whose entries can not beat the results kept so far
+    int             prune;
+    /// most codes scanned per query by search() and search_dir(), the nearest cells first. 0 for no limit
+    long            scan_budget;
+    /// time after which a query searched by search() or search_dir() stops scanning, in microseconds. 0 for none
+    long            deadline_us;
 
     Config() // set default value to all configurations
     {
@@ -92,6 +152,8 @@ struct Config
         w = 4;
         nsq = 8;
         nsqbits = 8;
+        codec = CODEC_PQ;
+        rq_beam = 4;
         mode = 0;
         verbose = 0;
         dataId = "tmp_id";
@@ -114,8 +176,39 @@ struct Config
         num_layer = 2;
         num_per_file = 0.01;
 
+        he_len = 0;
         ht = 12;
         p_mat = "pmat_32.mat";
+        polysemous = 0;
+        poly_ht = 0;
+
+        imi = 0;
+        imi_budget = 10000;
+
+        hnsw = 0;
+        hnsw_m = 16;
+        hnsw_efc = 100;
+        hnsw_ef = 64;
+
+        resume = 0;
+
+        cb_fmt = FMT_FP32;
+
+        numa = 0;
+        numa_shards = 0;
+
+        refine_fmt = -1;
+        rerank = 0;
+
+        probe_ratio = 0;
+        probe_min = 1;
+
+        metric = METRIC_L2;
+        adc_full = 0;
+        prune = 0;
+
+        scan_budget = 0;
+        deadline_us = 0;
     }
 };
 
@@ -74,18 +74,13 @@ void Entry::write(FILE* fout)
 /**
 @brief read a single entry from file
 @param fin file pointer to read
+@param code keeps the codes of the entry, residual_id points to it. size of nsq
 */
-void Entry::read(FILE* fin)
+void Entry::read(FILE* fin, unsigned int* code)
 {
-    unsigned int *items = new unsigned int[nsq+1];
-    assert(nsq+1 == fread(items, sizeof(unsigned int), nsq+1, fin));
-
-    id     = items[0];
-    residual_id = new unsigned int[nsq];
-    for(unsigned int i = 0; i < nsq; i++)
-    {
-        residual_id[i] = items[i+1];
-    }
-
-    delete[] items;
+    unsigned int id_l;
+    assert(1 == fread(&id_l, sizeof(unsigned int), 1, fin));
+    assert(nsq == fread(code, sizeof(unsigned int), nsq, fin));
+    id = id_l;
+    residual_id = code;
 }
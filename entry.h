@@ -65,8 +65,9 @@ struct Entry
     /**
     @brief read a single entry from file
     @param fin file pointer to read
+    @param code keeps the codes of the entry, residual_id points to it. size of nsq
     */
-    void read(FILE* fin);
+    void read(FILE* fin, unsigned int* code);
 };
 
 #endif // ENTRY_H_INCLUDED
@@ -0,0 +1,128 @@
+/**
+@file gen.cpp
+@brief generator of synthetic datasets in the .vlad/.info layout read by IO::load_vlad, for
+benchmarks that can not use our own VLADs. The vectors are gathered around random centers, like
+real descriptors, and the same seed always gives the same files whatever the machine.
+
+Usage:
+    ndk_gen <out_dir> <n> [-d 128] [-centers 100] [-spread 0.3] [-seed 1] [-noise_seed 1] [-files 1] [-prefix vec]
+A query set drawn around the same centers as a base set is made with the same -seed and another -noise_seed.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <sys/stat.h>
+
+using std::string;
+
+
+/// xorshift64* generator, so that the files do not depend on the libc
+struct rng
+{
+    unsigned long long s;
+
+    rng(unsigned long long seed) : s(seed * 2685821657736338717ULL + 1) {}
+
+    unsigned long long next()
+    {
+        s ^= s >> 12;
+        s ^= s << 25;
+        s ^= s >> 27;
+        return s * 2685821657736338717ULL;
+    }
+
+    /// uniform in (0, 1)
+    double uniform()
+    {
+        return ((next() >> 11) + 0.5) / 9007199254740992.0;
+    }
+
+    /// standard normal, Box-Muller
+    double gauss()
+    {
+        return sqrt(-2.0 * log(uniform())) * cos(6.283185307179586 * uniform());
+    }
+};
+
+
+int main(int argc, char* argv[])
+{
+    if(argc < 3)
+    {
+        printf("Usage: %s <out_dir> <n> [-d 128] [-centers 100] [-spread 0.3] [-seed 1] [-noise_seed 1] [-files 1] [-prefix vec]\n", argv[0]);
+        exit(1);
+    }
+
+    string dir = argv[1];
+    long n = atol(argv[2]);
+    int d = 128, num_centers = 100, files = 1;
+    double spread = 0.3;
+    unsigned long long seed = 1, noise_seed = 1;
+    string prefix = "vec";
+    for(int i = 3; i + 1 < argc; i += 2)
+    {
+        string opt = argv[i];
+        if(opt == "-d")                 d = atoi(argv[i+1]);
+        else if(opt == "-centers")      num_centers = atoi(argv[i+1]);
+        else if(opt == "-spread")       spread = atof(argv[i+1]);
+        else if(opt == "-seed")         seed = strtoull(argv[i+1], NULL, 10);
+        else if(opt == "-noise_seed")   noise_seed = strtoull(argv[i+1], NULL, 10);
+        else if(opt == "-files")        files = atoi(argv[i+1]);
+        else if(opt == "-prefix")       prefix = argv[i+1];
+        else
+        {
+            printf("error: unknown option %s.\n", opt.c_str());
+            exit(1);
+        }
+    }
+    if(n <= 0 || d <= 0 || num_centers <= 0 || files <= 0)
+    {
+        printf("error: n, d, centers and files must be positive.\n");
+        exit(1);
+    }
+
+    if(dir[dir.size()-1] != '/')
+        dir += "/";
+    mkdir(dir.c_str(), 0755);
+
+    rng center_rng(seed);
+    double* centers = new double[(long)num_centers*d];
+    for(long i = 0; i < (long)num_centers*d; i++)
+        centers[i] = center_rng.gauss();
+
+    // the points are dealt to the centers at random, so the clusters have different sizes
+    rng noise_rng(noise_seed + 0x9e3779b97f4a7c15ULL);
+    long id = 0;
+    for(int f = 0; f < files; f++)
+    {
+        long cnt = n / files + (f < n % files ? 1 : 0);
+        char name[32];
+        sprintf(name, "part%03d", f);
+        string vlad_file = dir + name + ".vlad", info_file = dir + name + ".info";
+        FILE* fout = fopen(vlad_file.c_str(), "w");
+        FILE* fout_info = fopen(info_file.c_str(), "w");
+        if(fout == NULL || fout_info == NULL)
+        {
+            printf("error: can not write %s.\n", vlad_file.c_str());
+            exit(1);
+        }
+
+        fprintf(fout, "%ld %d\n", cnt, d);
+        for(long i = 0; i < cnt; i++, id++)
+        {
+            const double* c = centers + (long)(noise_rng.next() % num_centers) * d;
+            for(int j = 0; j < d; j++)
+                fprintf(fout, j ? " %.5f" : "%.5f", c[j] + spread * noise_rng.gauss());
+            fprintf(fout, "\n");
+            fprintf(fout_info, "%s_%ld\n", prefix.c_str(), id);
+        }
+        fclose(fout);
+        fclose(fout_info);
+    }
+    printf("%ld vectors of dimension %d around %d centers written to %s\n", n, d, num_centers, dir.c_str());
+
+    delete[] centers;
+    return 0;
+}
@@ -4,6 +4,10 @@
 #include "util.h"
 #include "Clustering.h"
 #include "PQCluster.h"
+#include "CompactMat.h"
+#include "HammingEmbed.h"
+#include "SQCodec.h"
+#include "RQCodec.h"
 #include <iostream>
 #include <vector>
 #include <math.h>
@@ -21,6 +25,14 @@ ivfpq_new::ivfpq_new( Config& con_l )
     train_desc = con_l.train_desc;
     nsq = con_l.nsq;
     nsqbits = con_l.nsqbits;
+    imi = con_l.imi;
+    resume = con_l.resume;
+    metric = con_l.metric;
+    he_len = con_l.he_len;
+    p_mat = con_l.p_mat;
+    polysemous = con_l.polysemous;
+    codec = con_l.codec;
+    mvoc = NULL;
 }
 
 /**
@@ -38,9 +50,20 @@ void ivfpq_new::init(std::string working_dir)
     IO::mkdir(working_dir + "vk_words/");
     std::cout << working_dir + "vk_words_residual/" << std::endl;
     IO::mkdir(working_dir + "vk_words_residual/");
+    IO::mkdir(working_dir + "ckpt/");
+
+    // keep the finished codebooks and the k-means checkpoints to pick up from
+    if(resume)
+        return;
+
+    // a fresh training does not pick up the k-means of a run on other data of the same size
+    vector<string> filelist = IO::getFileList(working_dir + "ckpt/", "", 0, 0);
+    for(unsigned int i = 0; i < filelist.size(); i++)
+        IO::rm(filelist[i]);
+    filelist.clear();
     
     // empty the folder of matrix and vk_words
-    vector<string> filelist = IO::getFileList(working_dir + "matrix/", "M.l", 0, 0);
+    filelist = IO::getFileList(working_dir + "matrix/", "M.l", 0, 0);
     for(unsigned int i = 0; i < filelist.size(); i++)
         IO::rm(filelist[i]);
     filelist.clear();
@@ -49,11 +72,38 @@ void ivfpq_new::init(std::string working_dir)
     for(unsigned int i = 0; i< filelist.size(); i++)
         IO::rm(filelist[i]);
     filelist.clear();
+
+    filelist = IO::getFileList(working_dir + "vk_words/", "imi", 0, 0);
+    for(unsigned int i = 0; i< filelist.size(); i++)
+        IO::rm(filelist[i]);
+    filelist.clear();
+
+    // a graph built over the old coarse codebook is stale
+    filelist = IO::getFileList(working_dir + "vk_words/", "hnsw", 0, 0);
+    for(unsigned int i = 0; i< filelist.size(); i++)
+        IO::rm(filelist[i]);
+    filelist.clear();
     
     filelist = IO::getFileList(working_dir + "vk_words_residual/", "vocab", 0, 0);
     for(unsigned int i = 0; i< filelist.size(); i++)
         IO::rm(filelist[i]);
     filelist.clear();
+
+    filelist = IO::getFileList(working_dir + "vk_words_residual/", "rq.", 0, 0);
+    for(unsigned int i = 0; i< filelist.size(); i++)
+        IO::rm(filelist[i]);
+    filelist.clear();
+
+    filelist = IO::getFileList(working_dir + "vk_words_residual/", "sq8", 0, 0);
+    for(unsigned int i = 0; i< filelist.size(); i++)
+        IO::rm(filelist[i]);
+    filelist.clear();
+
+    // an embedding learned on the old residuals is stale
+    filelist = IO::getFileList(working_dir + "vk_words_residual/", "he.", 0, 0);
+    for(unsigned int i = 0; i< filelist.size(); i++)
+        IO::rm(filelist[i]);
+    filelist.clear();
     
 }
 
@@ -86,18 +136,96 @@ void ivfpq_new::train_coarse_codebook()
         Util::normalize(data+i*d, d);
     }
     std::cout << "normalize finished..." << std::endl;
-    
+
+    if(imi)
+    {
+        train_coarse_multi_index(data, n, d, working_dir);
+        delete[] data;
+        return;
+    }
      
     Vocab* voc = new Vocab(coarsek, 1, d); // new the location to keep the centers
-    kmeans_par k_par = {data, n, d, coarsek, iter, attempts, nt, voc->vec};
-    Clustering::kmeans(&k_par);
-    coa_centroids = voc->vec;
-    cal_word_dis(voc->vec, coarsek, d, working_dir+"coarse_static.txt");
-    voc->write2Disk(working_dir + "vk_words/");
+    if(load_trained(working_dir + "vk_words/vocab.l1", coarsek, d, voc->leaf(0)))
+        std::cout << "coarse codebook already trained." << std::endl;
+    else
+    {
+        // unit centroids: their nearest by l2 is also their largest inner product, for the residuals below
+        kmeans_par k_par = {data, n, d, coarsek, iter, attempts, nt, voc->leaf(0), working_dir + "ckpt/coarse", metric == METRIC_IP};
+        Clustering::kmeans(&k_par);
+        voc->write2Disk(working_dir + "vk_words/");
+    }
+    coa_centroids = voc->leaf(0);
+    cal_word_dis(voc->leaf(0), coarsek, d, working_dir+"coarse_static.txt");
     //IO::write_img_db(img_db, working_dir+"vk_words/wordlist.txt");
     delete[] data;
 }
 
+void ivfpq_new::train_coarse_multi_index(const float* data, int n, int d, string working_dir)
+{
+    mvoc = new MultiVocab(coarsek, d);
+    int hd = mvoc->hd;
+    float* halfdata = new float[n*hd];
+    for(int h = 0; h < 2; h++)
+    {
+        string prefix = "imi" + Util::num2str(h) + ".";
+        if(load_trained(working_dir + "vk_words/" + prefix + "vocab.l1", coarsek, hd, mvoc->centroid(h, 0)))
+        {
+            printf("multi-index half %d already trained.\n", h);
+            continue;
+        }
+
+        // kmeans on one half of the data to get k centers for that half
+        for(int i = 0; i < n; i++)
+            memcpy(halfdata + i*hd, data + i*d + h*hd, sizeof(float)*hd);
+
+        printf("Clustering multi-index half %d\n", h);
+        kmeans_par k_par = {halfdata, n, hd, coarsek, iter, attempts, nt, mvoc->centroid(h, 0), working_dir + "ckpt/" + prefix + "coarse"};
+        Clustering::kmeans(&k_par);
+        mvoc->half[h]->write2Disk(working_dir + "vk_words/" + prefix);
+    }
+    delete[] halfdata;
+}
+
+bool ivfpq_new::load_trained(string file, int row, int col, float* dest)
+{
+    if(!resume || !IO::f_exists(file))
+        return false;
+
+    int r, c;
+    float* mat = IO::loadFMat(file, r, c, -1);
+    bool ok = (r == row && c == col);
+    if(ok)
+        memcpy(dest, mat, sizeof(float)*row*col);
+    else
+        printf("%s is %d x %d instead of %d x %d, train it again.\n", file.c_str(), r, c, row, col);
+    delete[] mat;
+    return ok;
+}
+
+void ivfpq_new::residual_multi_index(const float* data, int n, float* residual)
+{
+    int hd = mvoc->hd;
+    int* ownership = new int[n];
+    float* cost_tmp = new float[n];
+    float* halfdata = new float[n*hd];
+    float* halfres = new float[n*hd];
+    for(int h = 0; h < 2; h++)
+    {
+        for(int i = 0; i < n; i++)
+            memcpy(halfdata + i*hd, data + i*d + h*hd, sizeof(float)*hd);
+
+        nn_par2 ti = {mvoc->centroid(h, 0), halfdata, coarsek, hd, ownership, cost_tmp, iter, halfres};
+        MultiThd::compute_tasks(n, nt, &Clustering::nn_task2, &ti);
+
+        for(int i = 0; i < n; i++)
+            memcpy(residual + i*d + h*hd, halfres + i*hd, sizeof(float)*hd);
+    }
+    delete[] ownership;
+    delete[] cost_tmp;
+    delete[] halfdata;
+    delete[] halfres;
+}
+
 void ivfpq_new::cal_word_dis(float* codebook, int n_l, int dim_l, string filename)
 {
     fstream fout, fout2;
@@ -157,9 +285,26 @@ void ivfpq_new::train_residual_codebook()
     int* ownership = new int[n];
     float* cost_tmp = new float[n];
     float* residual = new float[n*d];
-    nn_par2 ti = {coa_centroids, data, coarsek, d, ownership, cost_tmp, iter, residual};
-    MultiThd::compute_tasks(n, nt, &Clustering::nn_task2, &ti);
+    if(imi)
+        residual_multi_index(data, n, residual);
+    else
+    {
+        nn_par2 ti = {coa_centroids, data, coarsek, d, ownership, cost_tmp, iter, residual};
+        MultiThd::compute_tasks(n, nt, &Clustering::nn_task2, &ti);
+    }
     delete[] data;
+
+    if(codec != CODEC_PQ)
+    {
+        if(codec == CODEC_SQ8)
+            train_scalar(residual, n);
+        else
+            train_stages(residual, n);
+        if(he_len > 0)
+            train_embedding(residual, ownership, n);
+        delete[] residual;
+        return;
+    }
     
     // run product k-means
     std::cout << "residual k:" << k << std::endl;
@@ -186,9 +331,17 @@ void ivfpq_new::train_residual_codebook()
             }
             fout << "\n"; 
         }
-        kmeans_par k_par = {subdata, n, ds, ks, iter, attempts, nt, pqvoc->subvec(i)};
-        Clustering::kmeans(&k_par);
-        pqvoc->write2Disk(working_dir + "vk_words_residual/", i);
+        // subquantizers written by an interrupted run are kept as they are
+        if(load_trained(working_dir + "vk_words_residual/vocab.l" + Util::num2str(i), ks, ds, pqvoc->subvec(i)))
+            printf("subquantizer %d already trained.\n", i);
+        else
+        {
+            kmeans_par k_par = {subdata, n, ds, ks, iter, attempts, nt, pqvoc->subvec(i), working_dir + "ckpt/pq" + Util::num2str(i)};
+            Clustering::kmeans(&k_par);
+            if(polysemous)
+                pqvoc->polysemous_order(i, 0);
+            pqvoc->write2Disk(working_dir + "vk_words_residual/", i);
+        }
         fout2 << "nsq: " << i << endl;
         for (int g=0;g<ks;g++)
         {
@@ -201,6 +354,125 @@ void ivfpq_new::train_residual_codebook()
     }
     //pqvoc->print_clusters();
 
+    if(he_len > 0)
+        train_embedding(residual, ownership, n);
     delete[] residual;
 }
 
+void ivfpq_new::train_scalar(const float* residual, int n)
+{
+    string dir = dataId + "vk_words_residual/";
+    SQCodec sq(d);
+    if(resume && sq.loadFromDisk(dir))
+    {
+        printf("8-bit scalar quantizer already trained.\n");
+        return;
+    }
+    sq.train(residual, n);
+    sq.write2Disk(dir);
+}
+
+void ivfpq_new::train_stages(const float* residual, int n)
+{
+    string dir = dataId + "vk_words_residual/";
+    int ks = ROUND(pow(2.0,(double)(nsqbits)));
+    RQCodec rq(nsqbits, nsq, d, 1);
+    // what the stages trained so far leave of the residuals
+    float* left = new float[(long)n*d];
+    memcpy(left, residual, sizeof(float)*n*d);
+    for(int i = 0; i < nsq; i++)
+    {
+        // stages written by an interrupted run are kept as they are
+        if(load_trained(dir + "rq.l" + Util::num2str(i), ks, d, rq.stage(i)))
+            printf("stage %d already trained.\n", i);
+        else
+        {
+            kmeans_par k_par = {left, n, d, ks, iter, attempts, nt, rq.stage(i), dataId + "ckpt/rq" + Util::num2str(i)};
+            Clustering::kmeans(&k_par);
+            rq.write2Disk(dir, i);
+        }
+        printf("stage %d: mean squared error %g\n", i, rq.subtract_stage(left, n, i));
+    }
+    delete[] left;
+}
+
+void ivfpq_new::train_embedding(const float* residual, const int* cells, int n)
+{
+    string dir = dataId + "vk_words_residual/";
+    HammingEmbed he(he_len, d);
+    if(resume && he.loadFromDisk(dir, coarsek))
+    {
+        printf("Hamming embedding already trained.\n");
+        return;
+    }
+    he.train(residual, cells, n, coarsek, p_mat);
+    he.write2Disk(dir);
+}
+
+
+void ivfpq_new::compact_codebooks(int fmt, string sample_desc)
+{
+    string working_dir = dataId;
+    string name = CompactMat::fmt_name(fmt);
+    if(fmt == FMT_FP32)
+    {
+        printf("codebooks are already fp32, nothing to do.\n");
+        return;
+    }
+
+    Vocab* voc = new Vocab(coarsek, 1, d);
+    voc->loadFromDisk(working_dir + "vk_words/");
+    PQCluster* pqvoc = new PQCluster(nsqbits, nsq, d);
+    pqvoc->loadFromDisk(working_dir + "vk_words_residual/");
+    int ks = ROUND(pow(2.0,(double)(nsqbits)));
+    int ds = d/nsq;
+
+    float* data;
+    int n=0, dim=0;
+    vector<string*> img_db;
+    IO::load_vlad(sample_desc, &data, &img_db, &n, &dim);
+    assert(dim == d);
+    for(int i=0; i < n; i++)
+        Util::normalize(data+i*d, d);
+
+    // coarse codebook: nearest centroid of the sample vectors
+    CompactMat* cvoc = new CompactMat(voc->leaf(0), coarsek, d, fmt);
+    float err;
+    float agree = cvoc->agreement(voc->leaf(0), data, n, d, 0, coarsek, err);
+    printf("coarse   %s: %ld -> %ld bytes, same nearest centroid %.4f, distance error %.2e\n",
+           name.c_str(), (long)coarsek*d*sizeof(float), cvoc->bytes(), agree, err);
+
+    // residual codebook: codes of the residuals against the fp32 coarse centroids
+    float* residual = new float[(long)n*d];
+    int* ownership = new int[n];
+    float* coarse_norms = new float[coarsek];
+    Util::sq_norms(voc->leaf(0), coarsek, d, d, coarse_norms);
+    Util::nearest(data, n, d, voc->leaf(0), coarse_norms, coarsek, d, ownership, NULL);
+    for(int i = 0; i < n; i++)
+        for(int j = 0; j < d; j++)
+            residual[(long)i*d + j] = data[(long)i*d + j] - voc->leaf(ownership[i])[j];
+
+    CompactMat* cpq = new CompactMat(pqvoc->subvec(0), nsq*ks, ds, fmt);
+    float agree_sum = 0.0f, err_sum = 0.0f;
+    for(int i = 0; i < nsq; i++)
+    {
+        agree_sum += cpq->agreement(pqvoc->subvec(0), residual + i*ds, n, d, i*ks, ks, err);
+        err_sum += err;
+    }
+    printf("residual %s: %ld -> %ld bytes, same code %.4f, distance error %.2e\n",
+           name.c_str(), (long)nsq*ks*ds*sizeof(float), cpq->bytes(), agree_sum/nsq, err_sum/nsq);
+
+    voc->compress(fmt);
+    voc->writeCompact(working_dir + "vk_words/");
+    pqvoc->compress(fmt);
+    pqvoc->writeCompact(working_dir + "vk_words_residual/");
+
+    delete cvoc;
+    delete cpq;
+    delete[] residual;
+    delete[] ownership;
+    delete[] coarse_norms;
+    delete[] data;
+    delete voc;
+    delete pqvoc;
+}
@@ -1,5 +1,6 @@
 #include <iostream>
 #include "Vocab.h"
+#include "MultiVocab.h"
 #include "config.h"
 
 using namespace std;
@@ -23,6 +24,22 @@ private:
     string train_matrix;
     // residual hiearachy codebook
     Vocab* voc;
+    // use the inverted multi-index as coarse quantizer
+    int imi;
+    // coarse multi-index, when imi is set
+    MultiVocab* mvoc;
+    // keep finished codebooks and continue interrupted k-means from their checkpoints
+    int resume;
+    // METRIC_IP trains the coarse codebook by spherical k-means
+    int metric;
+    // bits of the Hamming signatures of the residuals, 0 for none
+    int he_len;
+    // projection of the Hamming embedding, drawn at random when the file does not exist
+    string p_mat;
+    // renumber the centroids of the subquantizers for polysemous codes
+    int polysemous;
+    // codes of the residuals, CODEC_PQ, CODEC_SQ8 or CODEC_RQ
+    int codec;
     /////////////////////////////////////////////////
     // use for kmeans
     int iter;
@@ -37,11 +54,25 @@ private:
     
 private:
     void init(string work_dir);
+    // kmeans on each half of data to get the two codebooks of the multi-index
+    void train_coarse_multi_index(const float* data, int n, int d, string working_dir);
+    // when resuming, copy the row x col codebook of 'file' to dest. false if it has to be trained
+    bool load_trained(string file, int row, int col, float* dest);
+    // residual of data against its nearest multi-index cell. size of n x d
+    void residual_multi_index(const float* data, int n, float* residual);
+    // learn the 8-bit scalar quantizer of the n residuals
+    void train_scalar(const float* residual, int n);
+    // learn the nsq codebooks of the residual quantizer, each on what the previous ones leave of the n residuals
+    void train_stages(const float* residual, int n);
+    // learn the Hamming embedding of the n residuals, cells[i] being the coarse cell of residual i
+    void train_embedding(const float* residual, const int* cells, int n);
     
 public:
     ivfpq_new(Config& con_l);
     void train_coarse_codebook();
     void train_residual_codebook();
+    // write the trained codebooks in reduced precision and report how much they change on the vectors of sample_desc
+    void compact_codebooks(int fmt, string sample_desc);
     
     void cal_word_dis(float* codebook, int n_l, int dim_l, string filename);
 };
@@ -2,6 +2,8 @@
 #include <cstdlib>
 #include <string>
 #include <iostream>
+#include <sstream>
+#include <algorithm>
 #include <stdio.h>
 
 #include "ParamReader.h"
@@ -9,7 +11,13 @@
 #include "config.h"
 #include "Index.h"
 #include "SearchEngine.h"
+#include "Server.h"
+#include "Scheduler.h"
+#include "Eval.h"
+#include "Tune.h"
 #include "PQCluster.h"
+#include "SQCodec.h"
+#include "RQCodec.h"
 
 
 using std::string;
@@ -19,6 +27,85 @@ using namespace std;
 Config con; // global configuration: keeps settings of the program
 
 
+/// the codes of the residuals of 'id', con.codec: the pq codebooks in format con.cb_fmt, the scalar or the residual quantizer
+static ResidualCodec* load_residual(string id)
+{
+    if(con.codec == CODEC_SQ8)
+    {
+        SQCodec* sq = new SQCodec(con.dim);
+        if(!sq->loadFromDisk(id + "/vk_words_residual/"))
+        {
+            printf("error: no 8-bit scalar quantizer in %s, train it with codec = sq8.\n", (id + "/vk_words_residual/").c_str());
+            exit(1);
+        }
+        return sq;
+    }
+    if(con.codec == CODEC_RQ)
+    {
+        RQCodec* rq = new RQCodec(con.nsqbits, con.nsq, con.dim, con.rq_beam);
+        if(!rq->loadFromDisk(id + "/vk_words_residual/"))
+        {
+            printf("error: no residual quantizer of %d x %d bits in %s, train it with codec = rq.\n", con.nsq, con.nsqbits,
+                   (id + "/vk_words_residual/").c_str());
+            exit(1);
+        }
+        return rq;
+    }
+    PQCluster* pqvoc = new PQCluster(con.nsqbits, con.nsq, con.dim);
+    if(con.cb_fmt == FMT_FP32 || !pqvoc->loadCompact(id + "/vk_words_residual/", con.cb_fmt))
+    {
+        pqvoc->loadFromDisk(id + "/vk_words_residual/");
+        pqvoc->compress(con.cb_fmt);
+    }
+    return pqvoc;
+}
+
+/// the halves of the multi-index are trained and searched by l2, there is no multi-index for METRIC_IP
+static void check_imi_metric()
+{
+    if(con.imi && con.metric == METRIC_IP)
+    {
+        printf("error: metric ip is not supported with imi.\n");
+        exit(1);
+    }
+}
+
+/// the Hamming embedding of the residuals of 'id', NULL when con.he_len is 0
+static HammingEmbed* load_embedding(string id)
+{
+    if(con.he_len <= 0)
+        return NULL;
+    if(con.imi)
+    {
+        printf("error: he_len is not supported with imi.\n");
+        exit(1);
+    }
+    HammingEmbed* he = new HammingEmbed(con.he_len, con.dim);
+    if(!he->loadFromDisk(id + "/vk_words_residual/", con.coarsek))
+    {
+        printf("error: no Hamming embedding of %d bits in %s, train it with he_len = %d.\n", con.he_len,
+               (id + "/vk_words_residual/").c_str(), con.he_len);
+        exit(1);
+    }
+    return he;
+}
+
+/// the coarse vocabulary of 'id' in format con.cb_fmt, with its graph when con.hnsw
+static Vocab* load_coarse(string id)
+{
+    Vocab* voc = new Vocab(con.coarsek, 1, con.dim);
+    bool compact = con.cb_fmt != FMT_FP32 && voc->loadCompact(id + "/vk_words/", con.cb_fmt);
+    if(!compact)
+        voc->loadFromDisk(id + "/vk_words/");
+    // the graph is built on the fp32 centroids, before they are compressed
+    if(con.hnsw)
+        voc->loadGraph(id + "/vk_words/hnsw.l1", con.hnsw_m, con.hnsw_efc, con.hnsw_ef);
+    if(!compact)
+        voc->compress(con.cb_fmt);
+    return voc;
+}
+
+
 /// entry point of whole project
 int main(int argc, char* argv[])
 {
@@ -38,6 +125,17 @@ int main(int argc, char* argv[])
     con.dataId              = params->GetStr ("dataId");
     string id               = con.dataId;
     con.nt                  = params->GetInt ("nt");
+    // metric of every mode: l2, or ip for the inner product (the cosine of the normalized vectors)
+    string metric           = params->GetStr ("metric", "l2");
+    if(metric != "l2" && metric != "ip")
+    {
+        printf("error: unknown metric %s, expected l2 or ip.\n", metric.c_str());
+        exit(1);
+    }
+    con.metric              = (metric == "ip") ? METRIC_IP : METRIC_L2;
+    // codes of the residuals, from training to search: pq (nsq codes of nsqbits), sq8 (a byte per dimension)
+    // or rq (nsq stages of nsqbits over the whole residual)
+    con.codec               = ResidualCodec::parse(params->GetStr ("codec", "pq"));
     con.num_per_file        = 0.02;
     con.T                   = 10000;
 
@@ -57,6 +155,26 @@ int main(int argc, char* argv[])
             con.dim                 = params->GetInt ("dim");
             con.iter                = params->GetInt ("iter");
             con.attempts            = params->GetInt ("attempts");
+            // use the inverted multi-index as coarse quantizer
+            con.imi                 = params->GetInt ("imi", 0);
+            check_imi_metric();
+            // pick up an interrupted training from the last checkpoint
+            con.resume              = params->GetInt ("resume", 0);
+            // bits of the Hamming signature of the residuals, and the file of their projection
+            con.he_len              = params->GetInt ("he_len", 0);
+            con.p_mat               = params->GetStr ("p_mat", con.p_mat);
+            // renumber the centroids of the subquantizers so that the codes can be compared by Hamming distance
+            con.polysemous          = params->GetInt ("polysemous", 0);
+            if(con.he_len > 0 && (con.imi || con.he_len > 32 || con.he_len > con.dim))
+            {
+                printf("error: he_len %d must be at most 32 and dim, without imi.\n", con.he_len);
+                exit(1);
+            }
+            if(con.polysemous && con.codec != CODEC_PQ)
+            {
+                printf("error: polysemous codes need codec = pq.\n");
+                exit(1);
+            }
 
             //con.coarsek             = params->GetInt("coarsek");
             //Vocab* voc = new Vocab(con.coarsek, 1, con.dim);
@@ -76,47 +194,233 @@ int main(int argc, char* argv[])
 
             con.nsq                 = params->GetInt("nsq");
             con.nsqbits             = params->GetInt("nsqbits");
-            
-            Vocab* voc = new Vocab(con.coarsek, 1, con.dim);
-            voc->loadFromDisk(id + "/vk_words/");
+            con.imi                 = params->GetInt("imi", 0);
+            check_imi_metric();
+            // codebooks in reduced precision: fp32, fp16, bf16 or int8
+            con.cb_fmt              = CompactMat::parse_fmt(params->GetStr("cb_fmt", "fp32"));
+            // store the vectors aside to re-rank the results: none, fp32, fp16, bf16 or int8
+            string refine           = params->GetStr("refine", "none");
+            con.refine_fmt          = (refine == "none") ? -1 : CompactMat::parse_fmt(refine);
+            // with codec = rq, the partial codes kept after each stage by the beam search of the codes
+            con.rq_beam             = params->GetInt("rq_beam", con.rq_beam);
+            // signatures of the residuals, with the embedding trained in mode 1
+            con.he_len              = params->GetInt("he_len", 0);
+            HammingEmbed* he        = load_embedding(id);
 
-            PQCluster* pqvoc = new PQCluster(con.nsqbits, con.nsq, con.dim);
-            pqvoc->loadFromDisk(id + "/vk_words_residual/");
-            //pqvoc->print_clusters();
+            ResidualCodec* rvoc = load_residual(id);
 
             IO::mkdir(id + "/index/");
-            Index::indexFiles(voc, pqvoc, con.index_desc, ".vlad", id + "/index/", con.nt,con.coarsek);
-
-            delete voc;
+            if(con.imi)
+            {
+                MultiVocab* mvoc = new MultiVocab(con.coarsek, con.dim);
+                mvoc->loadFromDisk(id + "/vk_words/");
+                Index::indexFiles(mvoc, rvoc, con.index_desc, ".vlad", id + "/index/", con.nt, con.refine_fmt);
+                delete mvoc;
+            }
+            else
+            {
+                Vocab* voc = new Vocab(con.coarsek, 1, con.dim);
+                if(con.cb_fmt == FMT_FP32 || !voc->loadCompact(id + "/vk_words/", con.cb_fmt))
+                {
+                    voc->loadFromDisk(id + "/vk_words/");
+                    voc->compress(con.cb_fmt);
+                }
+                Index::indexFiles(voc, rvoc, con.index_desc, ".vlad", id + "/index/", con.nt,con.coarsek, con.refine_fmt, he);
+                delete voc;
+            }
+            delete rvoc;
+            delete he;
             break;
         }
         case 3: // online search
+        case 5: // search server: keeps everything loaded and answers queries on a socket
+        case 6: // recall@R and QPS of the search against exact nearest neighbours
+        case 7: // tuning of the search-time parameters to a target recall
         {
             con.coarsek             = params->GetInt("coarsek");
             con.nsq                 = params->GetInt("nsq");
             con.nsqbits             = params->GetInt("nsqbits");
-            con.query_desc          = params->GetStr ("query_desc");
+            if(con.mode == 3 || con.mode == 6)
+                con.query_desc      = params->GetStr ("query_desc");
+            // the queries held out for tuning, by default those of the evaluation
+            if(con.mode == 7)
+                con.query_desc      = params->GetStr ("tune_desc", params->GetStr("query_desc"));
+            // the indexed vectors, searched by brute force for the ground truth
+            if(con.mode == 6 || con.mode == 7)
+                con.index_desc      = params->GetStr ("index_desc");
             con.dim                 = params->GetInt ("dim");
 
             // number of elements to be returned.
             con.num_ret             = params->GetInt ("num_ret");
             // number of cell visited per query.
             con.ma                  = params->GetInt ("ma");
+            // with the multi-index, cells are visited till imi_budget candidates are collected
+            con.imi                 = params->GetInt ("imi", 0);
+            check_imi_metric();
+            con.imi_budget          = params->GetInt ("imi_budget", con.imi_budget);
+            // HNSW graph over the coarse centroids to select the ma cells, instead of exact scan
+            con.hnsw                = params->GetInt ("hnsw", 0);
+            con.hnsw_m              = params->GetInt ("hnsw_m", con.hnsw_m);
+            con.hnsw_efc            = params->GetInt ("hnsw_efc", con.hnsw_efc);
+            con.hnsw_ef             = params->GetInt ("hnsw_ef", con.hnsw_ef);
+            // codebooks in reduced precision: fp32, fp16, bf16 or int8
+            con.cb_fmt              = CompactMat::parse_fmt(params->GetStr("cb_fmt", "fp32"));
+            // shard the index over the NUMA nodes. numa_shards overrides the number of nodes
+            con.numa                = params->GetInt ("numa", 0);
+            con.numa_shards         = params->GetInt ("numa_shards", 0);
+            // the best rerank results of ADC are scored again with the vectors stored by indexing
+            con.rerank              = params->GetInt ("rerank", 0);
+            // of the ma nearest cells, those farther than probe_ratio x the nearest are skipped, keeping probe_min at least
+            con.probe_ratio         = params->GetFlt ("probe_ratio", 0);
+            con.probe_min           = params->GetInt ("probe_min", con.probe_min);
+            // score: residual (distance between normalized residuals) or full (distance to the query, comparable across cells)
+            string score            = params->GetStr ("score", "residual");
+            if(score != "residual" && score != "full")
+            {
+                printf("error: unknown score %s, expected residual or full.\n", score.c_str());
+                exit(1);
+            }
+            con.adc_full            = (score == "full") && con.metric == METRIC_L2;
+            // with the full score, the cells that can not improve the results are not scanned
+            con.prune               = params->GetInt ("prune", 0) && con.adc_full;
+            // a query stops scanning after scan_budget codes or deadline_us microseconds, its results are then partial
+            con.scan_budget         = params->GetInt ("scan_budget", 0);
+            con.deadline_us         = params->GetInt ("deadline_us", 0);
+            // entries whose signature is more than ht bits away from the one of the query are not scored
+            con.he_len              = params->GetInt ("he_len", 0);
+            con.ht                  = params->GetInt ("ht", con.ht);
+            // with polysemous codebooks, entries whose code is more than poly_ht bits away from the query's are not scored
+            con.poly_ht             = params->GetInt ("poly_ht", 0);
+            if(con.poly_ht > 0 && con.codec != CODEC_PQ)
+            {
+                printf("error: poly_ht needs codec = pq.\n");
+                exit(1);
+            }
 
-            Vocab* voc = new Vocab(con.coarsek, 1, con.dim);
-            voc->loadFromDisk(id + "/vk_words/");
-            
-            PQCluster* pqvoc = new PQCluster(con.nsqbits, con.nsq, con.dim);
-            pqvoc->loadFromDisk(id + "/vk_words_residual/");
-            //pqvoc->print_clusters()
+            Vocab* voc = NULL;
+            MultiVocab* mvoc = NULL;
+            ResidualCodec* rvoc = load_residual(id);
 
-            SearchEngine* engine = new SearchEngine(voc, pqvoc);
+            SearchEngine* engine;
+            if(con.imi)
+            {
+                mvoc = new MultiVocab(con.coarsek, con.dim);
+                mvoc->loadFromDisk(id + "/vk_words/");
+                engine = new SearchEngine(mvoc, rvoc);
+            }
+            else
+            {
+                voc = load_coarse(id);
+                engine = new SearchEngine(voc, rvoc);
+            }
+            HammingEmbed* he = load_embedding(id);
+            engine->he = he;
             engine->loadIndexes(id + "index/");
-            engine->search_dir(con.query_desc, id + "result", id + "coarse_result", con.num_ret);
+            if(con.numa)
+                engine->shard_index(con.numa_shards > 0 ? con.numa_shards : Numa::num_nodes());
+            if(con.mode == 3)
+                engine->search_dir(con.query_desc, id + "result", id + "coarse_result", con.num_ret);
+            else if(con.mode == 6)
+            {
+                eval_result res = Eval::evaluate(engine, con.index_desc, con.query_desc, id + "gt.bin", con.nt);
+                Eval::report(res, Eval::setting(), id + "eval.tsv");
+                // with the peak scratch of the queries
+                engine->print_memory();
+            }
+            else if(con.mode == 7)
+            {
+                // recall@tune_R to be reached, at the lowest mean latency
+                double target = params->GetFlt("tune_recall", 0.9);
+                int R = params->GetInt("tune_R", con.num_ret);
+                string fmts = params->GetStr("tune_fmts", CompactMat::fmt_name(con.cb_fmt));
+                string out = params->GetStr("tune_out", id + "tuned.config");
+
+                eval_data* data = Eval::prepare(engine, con.index_desc, con.query_desc, id + "tune_gt.bin", con.nt);
+                Tuner tuner(engine, data, con.nt, R);
+                // each format of the codebooks is swept with its own codebooks, loaded in place of the current ones
+                std::replace(fmts.begin(), fmts.end(), ',', ' ');
+                std::istringstream fmt_list(fmts);
+                string fmt;
+                int loaded = con.cb_fmt;
+                while(fmt_list >> fmt)
+                {
+                    con.cb_fmt = CompactMat::parse_fmt(fmt);
+                    if(con.cb_fmt != loaded)
+                    {
+                        delete rvoc;
+                        engine->rvoc = rvoc = load_residual(id);
+                        if(voc != NULL)
+                        {
+                            delete voc;
+                            engine->voc = voc = load_coarse(id);
+                        }
+                        loaded = con.cb_fmt;
+                    }
+                    tuner.sweep(con.cb_fmt, params->GetInt("tune_ma_max", con.coarsek));
+                }
+                const tune_point* best = tuner.report(target);
+                if(best == NULL)
+                    printf("No setting reaches recall@%d of %.4f, nothing written.\n", R, target);
+                else
+                {
+                    map<string, string> changes;
+                    changes["cb_fmt"] = CompactMat::fmt_name(best->fmt);
+                    if(con.imi)
+                        changes["imi_budget"] = Util::num2str(best->budget);
+                    else
+                        changes["ma"] = Util::num2str(best->ma);
+                    // the exact scan of the centroids may beat the graph
+                    if(con.hnsw && best->ef == 0)
+                        changes["hnsw"] = "0";
+                    else if(con.hnsw)
+                        changes["hnsw_ef"] = Util::num2str(best->ef);
+                    params->WriteParamFile(out, changes);
+                    printf("Recall@%d %.4f at %.1f us with %s ma %d ef %d budget %d, written to %s\n", R,
+                           best->res.recall_r, best->res.latency_us, changes["cb_fmt"].c_str(),
+                           best->ma, best->ef, best->budget, out.c_str());
+                }
+                delete data;
+            }
+            else
+            {
+                // the queries of all the connections are gathered into micro-batches
+                BatchScheduler* sched = NULL;
+                if(params->GetInt("batch", 0))
+                    sched = new BatchScheduler(engine, con.dim, params->GetInt("batch_max", 32),
+                                               params->GetInt("batch_wait_us", 500), params->GetInt("batch_nt", con.nt));
+                // number of connections served at the same time
+                SearchServer server(engine, con.dim, params->GetInt("server_nt", con.nt), sched);
+                server.run(params->GetStr("socket", id + "search.sock"));
+                delete sched;
+                printf("%s", engine->stats.json().c_str());
+            }
 
             delete engine;
             delete voc;
+            delete mvoc;
+            delete rvoc;
+            delete he;
+
+            break;
+        }
+        case 4: // codebooks in reduced precision
+        {
+            con.coarsek             = params->GetInt("coarsek");
+            con.nsq                 = params->GetInt("nsq");
+            con.nsqbits             = params->GetInt("nsqbits");
+            con.dim                 = params->GetInt ("dim");
+            // vectors to check the converted codebooks on
+            con.query_desc          = params->GetStr ("query_desc");
+            con.cb_fmt              = CompactMat::parse_fmt(params->GetStr("cb_fmt", "fp16"));
+            if(con.codec != CODEC_PQ)
+            {
+                printf("error: the codebooks in reduced precision need codec = pq.\n");
+                exit(1);
+            }
 
+            ivfpq_new* ivfpq = new ivfpq_new(con);
+            ivfpq->compact_codebooks(con.cb_fmt, con.query_desc);
+            delete ivfpq;
             break;
         }
         default:
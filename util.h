@@ -28,6 +28,7 @@ including string manipulation, math operations as well as other common functions
 #include <algorithm>
 #include <cstring>
 #include <cassert>
+#include <sys/time.h>
 
 using std::string;
 
@@ -247,6 +248,172 @@ public:
     }
 
 
+    /**
+    @brief calc inner product
+    */
+    static float dot(const float* a, const float* b, int d)
+    {
+        float ip = 0.0f;
+        for(int i = 0; i < d; i++)
+            ip += a[i]*b[i];
+        return ip;
+    }
+
+
+    /**
+    @brief calc squared l2 norm of each row of a n x d matrix
+    @param a pointer to the matrix. row i starts at a + i*lda
+    @param out keeps the squared norms. size of n
+    */
+    static void sq_norms(const float* a, int n, int d, int lda, float* out)
+    {
+        for(int i = 0; i < n; i++)
+        {
+            float s = 0.0f;
+            for(int j = 0; j < d; j++)
+                s += a[i*lda + j]*a[i*lda + j];
+            out[i] = s;
+        }
+    }
+
+    /**
+    Distances are expanded as ||x - c||^2 = ||x||^2 - 2<x, c> + ||c||^2, and 4 points are
+    matched against each center at a time so that every center is loaded once per 4 points.
+    @brief find the nearest center of each point of a block
+    @param x the points. point i starts at x + i*ldx and has d components
+    @param n number of points
+    @param ldx stride between two points
+    @param c the centers. size of k x d
+    @param c_norm squared norm of each center. size of k
+    @param k number of centers
+    @param d dimension
+    @param out keeps the id of the nearest center of each point. size of n
+    @param dist keeps the squared distance to the nearest center, can be NULL. size of n
+    */
+    static void nearest(const float* x, int n, int ldx, const float* c, const float* c_norm, int k, int d, int* out, float* dist)
+    {
+        int p = 0;
+        for(; p + 4 <= n; p += 4)
+        {
+            const float* x0 = x + (p  )*ldx;
+            const float* x1 = x + (p+1)*ldx;
+            const float* x2 = x + (p+2)*ldx;
+            const float* x3 = x + (p+3)*ldx;
+            float best[4] = {1e30f, 1e30f, 1e30f, 1e30f};
+            int id[4] = {0, 0, 0, 0};
+            for(int j = 0; j < k; j++)
+            {
+                const float* cj = c + j*d;
+                float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+                for(int e = 0; e < d; e++)
+                {
+                    float ce = cj[e];
+                    s0 += x0[e]*ce;
+                    s1 += x1[e]*ce;
+                    s2 += x2[e]*ce;
+                    s3 += x3[e]*ce;
+                }
+                float v[4] = {c_norm[j] - 2*s0, c_norm[j] - 2*s1, c_norm[j] - 2*s2, c_norm[j] - 2*s3};
+                for(int q = 0; q < 4; q++)
+                {
+                    if(v[q] < best[q])
+                    {
+                        best[q] = v[q];
+                        id[q] = j;
+                    }
+                }
+            }
+            for(int q = 0; q < 4; q++)
+            {
+                out[p+q] = id[q];
+                if(dist != NULL)
+                {
+                    float xn;
+                    sq_norms(x + (p+q)*ldx, 1, d, ldx, &xn);
+                    dist[p+q] = best[q] + xn;
+                }
+            }
+        }
+
+        for(; p < n; p++) // the remaining points, one by one
+        {
+            const float* xp = x + p*ldx;
+            float best = 1e30f;
+            int id = 0;
+            for(int j = 0; j < k; j++)
+            {
+                const float* cj = c + j*d;
+                float s = 0.0f;
+                for(int e = 0; e < d; e++)
+                    s += xp[e]*cj[e];
+                float v = c_norm[j] - 2*s;
+                if(v < best)
+                {
+                    best = v;
+                    id = j;
+                }
+            }
+            out[p] = id;
+            if(dist != NULL)
+            {
+                float xn;
+                sq_norms(xp, 1, d, ldx, &xn);
+                dist[p] = best + xn;
+            }
+        }
+    }
+
+
+    /**
+    Same blocking as nearest(): 4 points are matched against each center at a time.
+    @brief inner products of each point of a block with each center
+    @param x the points. point i starts at x + i*ldx and has d components
+    @param c the centers. size of k x d
+    @param out keeps <x_i, c_j> at out[i*k + j]. size of n x k
+    */
+    static void inner_products(const float* x, int n, int ldx, const float* c, int k, int d, float* out)
+    {
+        int p = 0;
+        for(; p + 4 <= n; p += 4)
+        {
+            const float* x0 = x + (p  )*ldx;
+            const float* x1 = x + (p+1)*ldx;
+            const float* x2 = x + (p+2)*ldx;
+            const float* x3 = x + (p+3)*ldx;
+            for(int j = 0; j < k; j++)
+            {
+                const float* cj = c + j*d;
+                float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+                for(int e = 0; e < d; e++)
+                {
+                    float ce = cj[e];
+                    s0 += x0[e]*ce;
+                    s1 += x1[e]*ce;
+                    s2 += x2[e]*ce;
+                    s3 += x3[e]*ce;
+                }
+                out[(p  )*k + j] = s0;
+                out[(p+1)*k + j] = s1;
+                out[(p+2)*k + j] = s2;
+                out[(p+3)*k + j] = s3;
+            }
+        }
+
+        for(; p < n; p++) // the remaining points, one by one
+        {
+            const float* xp = x + p*ldx;
+            for(int j = 0; j < k; j++)
+            {
+                const float* cj = c + j*d;
+                float s = 0.0f;
+                for(int e = 0; e < d; e++)
+                    s += xp[e]*cj[e];
+                out[p*k + j] = s;
+            }
+        }
+    }
+
+
 	/**
 	@brief count number of physical cpu cores
 	*/
@@ -316,6 +483,16 @@ public:
         */
         //sleep(waitTime/1000.0);
     }
+
+	/**
+	@brief wall clock in microseconds
+	*/
+    static double now_us()
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec * 1000000.0 + tv.tv_usec;
+    }
 };
 
 #endif // UTIL_H_INCLUDED
@@ -0,0 +1,144 @@
+"""
+End-to-end benchmark: generates a synthetic dataset with ndk_gen, then runs
+train (mode 1), index (mode 2) and search (mode 3) of ndk on it, and reports
+the time and peak RSS of each stage, the size of the index and the QPS.
+
+Needs only a Linux box and the binaries built by make:
+    python e2e_bench.py --work /tmp/e2e --n 100000 --nq 1000
+The report is printed and written to <work>/e2e_report.json.
+"""
+import os
+import sys
+import json
+import time
+import shutil
+import argparse
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(HERE)
+
+
+def run_stage(cmd, log):
+    """run cmd in the directory of log, return (seconds, peak rss in MB, exit status)"""
+    start = time.time()
+    with open(log, "w") as out:
+        pid = os.fork()
+        if pid == 0:
+            os.dup2(out.fileno(), 1)
+            os.dup2(out.fileno(), 2)
+            os.chdir(os.path.dirname(log)) # ndk leaves a 'log' file in its working directory
+            try:
+                os.execv(cmd[0], cmd)
+            finally:
+                os._exit(127)
+        _, status, usage = os.wait4(pid, 0)
+    # ru_maxrss is in KB on Linux
+    return time.time() - start, usage.ru_maxrss / 1024.0, status
+
+
+def dir_size(path):
+    tot = 0
+    for base, _, files in os.walk(path):
+        for f in files:
+            tot += os.path.getsize(os.path.join(base, f))
+    return tot
+
+
+def main():
+    ap = argparse.ArgumentParser(description="end-to-end benchmark of ndk on synthetic data")
+    ap.add_argument("--work", default="/tmp/ndk_e2e", help="working directory, emptied first")
+    ap.add_argument("--ndk", default=os.path.join(ROOT, "ndk"))
+    ap.add_argument("--gen", default=os.path.join(ROOT, "ndk_gen"))
+    ap.add_argument("--n", type=int, default=100000, help="number of indexed vectors")
+    ap.add_argument("--nq", type=int, default=1000, help="number of queries")
+    ap.add_argument("--d", type=int, default=128)
+    ap.add_argument("--centers", type=int, default=100, help="clusters of the synthetic data")
+    ap.add_argument("--spread", type=float, default=0.3)
+    ap.add_argument("--seed", type=int, default=1)
+    ap.add_argument("--coarsek", type=int, default=256)
+    ap.add_argument("--nsq", type=int, default=8)
+    ap.add_argument("--nsqbits", type=int, default=8)
+    ap.add_argument("--ma", type=int, default=4)
+    ap.add_argument("--num_ret", type=int, default=10)
+    ap.add_argument("--iter", type=int, default=10)
+    ap.add_argument("--nt", type=int, default=4)
+    ap.add_argument("--extra", action="append", default=[], help="extra 'key = value' config line, repeatable")
+    args = ap.parse_args()
+
+    for b in (args.ndk, args.gen):
+        if not os.access(b, os.X_OK):
+            sys.exit("error: %s is not built, run make first." % b)
+
+    work = os.path.abspath(args.work)
+    if os.path.exists(work):
+        shutil.rmtree(work)
+    base, query, data = work + "/base/", work + "/query/", work + "/data/"
+    os.makedirs(data)
+
+    report = {"params": vars(args), "stages": {}}
+    stages = report["stages"]
+
+    # the queries come from the same centers as the base, with other noise
+    common = [str(args.d), "-centers", str(args.centers), "-spread", str(args.spread), "-seed", str(args.seed)]
+    t, rss, st = run_stage([args.gen, base, str(args.n), "-d"] + common + ["-noise_seed", "1", "-prefix", "base"], work + "/gen_base.log")
+    t2, rss2, st2 = run_stage([args.gen, query, str(args.nq), "-d"] + common + ["-noise_seed", "2", "-prefix", "query"], work + "/gen_query.log")
+    if st or st2:
+        sys.exit("error: generation failed, see %s/gen_*.log" % work)
+    stages["generate"] = {"seconds": t + t2, "peak_rss_mb": max(rss, rss2)}
+
+    config = work + "/bench.config"
+    with open(config, "w") as f:
+        for key, val in [("dataId", data), ("nt", args.nt), ("coarsek", args.coarsek),
+                         ("train_desc", base), ("index_desc", base), ("query_desc", query),
+                         ("nsq", args.nsq), ("nsqbits", args.nsqbits), ("dim", args.d),
+                         ("iter", args.iter), ("attempts", 1), ("num_ret", args.num_ret),
+                         ("ma", args.ma), ("w", 1)]:
+            f.write("%s = %s\n" % (key, val))
+        for line in args.extra:
+            f.write(line + "\n")
+
+    for mode, name in [(1, "train"), (2, "index"), (3, "search")]:
+        if mode == 3:
+            # search loads every index under index/, indexing writes its files right there: idx, nl and voc_sz,
+            # and the refine vectors and signatures when they are asked for
+            part = data + "index/p0/"
+            files = [f for f in os.listdir(data + "index/") if os.path.isfile(data + "index/" + f)]
+            os.makedirs(part)
+            for f in files:
+                shutil.move(data + "index/" + f, part + f)
+        log = "%s/%s.log" % (work, name)
+        t, rss, st = run_stage([args.ndk, config, str(mode)], log)
+        if st:
+            sys.exit("error: %s failed, see %s" % (name, log))
+        stages[name] = {"seconds": t, "peak_rss_mb": rss}
+
+    report["index_bytes"] = dir_size(data + "index/")
+    report["codebook_bytes"] = dir_size(data + "vk_words/") + dir_size(data + "vk_words_residual/")
+    report["search_qps_wall"] = args.nq / stages["search"]["seconds"]
+    # the latency report of search_dir excludes the loading of the codebooks and of the index
+    lat_file = data + "result.latency.json"
+    if os.path.exists(lat_file):
+        with open(lat_file) as f:
+            lat = json.load(f)
+        total = lat["stages_us"].get("total")
+        if total and total["mean"] > 0:
+            report["search_qps"] = 1e6 / total["mean"]
+            report["latency_us"] = total
+
+    print("%-10s %10s %14s" % ("stage", "seconds", "peak RSS (MB)"))
+    for name in ("generate", "train", "index", "search"):
+        print("%-10s %10.2f %14.1f" % (name, stages[name]["seconds"], stages[name]["peak_rss_mb"]))
+    print("index size: %.1f MB, codebooks: %.1f MB" % (report["index_bytes"] / 1e6, report["codebook_bytes"] / 1e6))
+    print("QPS: %.1f (wall, with loading)" % report["search_qps_wall"])
+    if "search_qps" in report:
+        l = report["latency_us"]
+        print("QPS: %.1f (single thread, search only), latency us p50 %.1f p99 %.1f"
+              % (report["search_qps"], l["p50"], l["p99"]))
+
+    with open(work + "/e2e_report.json", "w") as f:
+        json.dump(report, f, indent=2)
+    print("report written to %s/e2e_report.json" % work)
+
+
+if __name__ == "__main__":
+    main()